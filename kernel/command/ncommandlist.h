@@ -2,6 +2,7 @@
 // Created by EgrZver on 04.07.2023.
 //
 #include <iostream>
+#include <array>
 #include <kernel/command/ncommands.h>
 #include <kernel/storage/nmachinememory.h>
 
@@ -9,7 +10,12 @@
 #define NERVI_NCOMMANDLISTS_H
 
 namespace NerviKernel {
-    int (*NerviCoreCommands[8]) (NVirtualMachineStorage*, long long, long long) = {
+    /**
+     * \brief The type of a command handler
+     */
+    typedef int (*NCommandHandler) (NVirtualMachineStorage*, long long, long long);
+
+    constexpr NCommandHandler NerviCoreCommands[12] = {
         NerviCoreCommandsDeclaration::byteAnd,
         NerviCoreCommandsDeclaration::byteOr,
         NerviCoreCommandsDeclaration::byteNot,
@@ -17,9 +23,36 @@ namespace NerviKernel {
         NerviCoreCommandsDeclaration::byteEqv,
         NerviCoreCommandsDeclaration::byteImp,
         NerviCoreCommandsDeclaration::byteNand,
-        NerviCoreCommandsDeclaration::byteNor
+        NerviCoreCommandsDeclaration::byteNor,
+        NerviCoreCommandsDeclaration::byteMove,
+        NerviCoreCommandsDeclaration::wordMove,
+        NerviCoreCommandsDeclaration::dwordMove,
+        NerviCoreCommandsDeclaration::qwordMove
+    };
+    static_assert(NerviCoreCommands[CORE_AND] == NerviCoreCommandsDeclaration::byteAnd && NerviCoreCommands[CORE_OR] == NerviCoreCommandsDeclaration::byteOr &&
+                  NerviCoreCommands[CORE_NOT] == NerviCoreCommandsDeclaration::byteNot && NerviCoreCommands[CORE_XOR] == NerviCoreCommandsDeclaration::byteXor &&
+                  NerviCoreCommands[CORE_EQV] == NerviCoreCommandsDeclaration::byteEqv && NerviCoreCommands[CORE_IMP] == NerviCoreCommandsDeclaration::byteImp &&
+                  NerviCoreCommands[CORE_NAND] == NerviCoreCommandsDeclaration::byteNand && NerviCoreCommands[CORE_NOR] == NerviCoreCommandsDeclaration::byteNor &&
+                  NerviCoreCommands[CORE_MOVE] == NerviCoreCommandsDeclaration::byteMove && NerviCoreCommands[CORE_WORD_MOVE] == NerviCoreCommandsDeclaration::wordMove &&
+                  NerviCoreCommands[CORE_DWORD_MOVE] == NerviCoreCommandsDeclaration::dwordMove &&
+                  NerviCoreCommands[CORE_QWORD_MOVE] == NerviCoreCommandsDeclaration::qwordMove && std::size(NerviCoreCommands) == CORE_QWORD_MOVE + 1,
+                  "NCoreCommandIndex must follow the order of NerviCoreCommands");
+
+    /**
+     * \brief The unchecked handlers of the byte core commands (NerviUncheckedCoreCommandsDeclaration), indexed like NerviCoreCommands
+     */
+    constexpr NCommandHandler NerviUncheckedCoreCommands[9] = {
+        NerviUncheckedCoreCommandsDeclaration::byteAnd,
+        NerviUncheckedCoreCommandsDeclaration::byteOr,
+        NerviUncheckedCoreCommandsDeclaration::byteNot,
+        NerviUncheckedCoreCommandsDeclaration::byteXor,
+        NerviUncheckedCoreCommandsDeclaration::byteEqv,
+        NerviUncheckedCoreCommandsDeclaration::byteImp,
+        NerviUncheckedCoreCommandsDeclaration::byteNand,
+        NerviUncheckedCoreCommandsDeclaration::byteNor,
+        NerviUncheckedCoreCommandsDeclaration::byteMove
     };
-    std::string NerviCoreCommandsNames[8] = {
+    std::string NerviCoreCommandsNames[12] = {
         "and",
         "or",
         "not",
@@ -27,7 +60,185 @@ namespace NerviKernel {
         "eqv",
         "imp",
         "nand",
-        "nor"
+        "nor",
+        "mov",
+        "mov16",
+        "mov32",
+        "mov64"
+    };
+
+    constexpr NCommandHandler NerviWideCommands[15] = {
+        NerviWideCommandsDeclaration::wideLoad<std::uint16_t>,
+        NerviWideCommandsDeclaration::wideStore<std::uint16_t>,
+        NerviWideCommandsDeclaration::wideAdd<std::uint16_t>,
+        NerviWideCommandsDeclaration::wideSub<std::uint16_t>,
+        NerviWideCommandsDeclaration::wideMul<std::uint16_t>,
+        NerviWideCommandsDeclaration::wideLoad<std::uint32_t>,
+        NerviWideCommandsDeclaration::wideStore<std::uint32_t>,
+        NerviWideCommandsDeclaration::wideAdd<std::uint32_t>,
+        NerviWideCommandsDeclaration::wideSub<std::uint32_t>,
+        NerviWideCommandsDeclaration::wideMul<std::uint32_t>,
+        NerviWideCommandsDeclaration::wideLoad<std::uint64_t>,
+        NerviWideCommandsDeclaration::wideStore<std::uint64_t>,
+        NerviWideCommandsDeclaration::wideAdd<std::uint64_t>,
+        NerviWideCommandsDeclaration::wideSub<std::uint64_t>,
+        NerviWideCommandsDeclaration::wideMul<std::uint64_t>
+    };
+    std::string NerviWideCommandsNames[15] = {
+        "ld16",
+        "st16",
+        "add16",
+        "sub16",
+        "mul16",
+        "ld32",
+        "st32",
+        "add32",
+        "sub32",
+        "mul32",
+        "ld64",
+        "st64",
+        "add64",
+        "sub64",
+        "mul64"
+    };
+
+    constexpr NCommandHandler NerviFlowCommands[7] = {
+        NerviFlowCommandsDeclaration::jump,
+        NerviFlowCommandsDeclaration::jumpIfZero,
+        NerviFlowCommandsDeclaration::jumpIfNotZero,
+        NerviFlowCommandsDeclaration::decrementJumpIfNotZero,
+        NerviFlowCommandsDeclaration::call,
+        NerviFlowCommandsDeclaration::ret,
+        NerviFlowCommandsDeclaration::halt
+    };
+    static_assert(NerviFlowCommands[FLOW_JUMP] == NerviFlowCommandsDeclaration::jump && NerviFlowCommands[FLOW_JUMP_IF_ZERO] == NerviFlowCommandsDeclaration::jumpIfZero &&
+                  NerviFlowCommands[FLOW_JUMP_IF_NOT_ZERO] == NerviFlowCommandsDeclaration::jumpIfNotZero &&
+                  NerviFlowCommands[FLOW_DECREMENT_JUMP_IF_NOT_ZERO] == NerviFlowCommandsDeclaration::decrementJumpIfNotZero &&
+                  NerviFlowCommands[FLOW_CALL] == NerviFlowCommandsDeclaration::call && NerviFlowCommands[FLOW_RET] == NerviFlowCommandsDeclaration::ret &&
+                  NerviFlowCommands[FLOW_HALT] == NerviFlowCommandsDeclaration::halt && std::size(NerviFlowCommands) == FLOW_HALT + 1,
+                  "NFlowCommandIndex must follow the order of NerviFlowCommands");
+    std::string NerviFlowCommandsNames[7] = {
+        "jmp",
+        "jz",
+        "jnz",
+        "djnz",
+        "call",
+        "ret",
+        "halt"
+    };
+
+    auto& NerviRegisterCommands = NerviRegisterCommandsDeclaration::NRegisterCommandTable<std::make_integer_sequence<int, IP>>::commands;
+    std::string NerviRegisterCommandsNames[2 * IP] = {
+        "ld.putc", "ld.getc", "ld.fputc", "ld.fputc_flags_1", "ld.fputc_flags_2", "ld.fputc_flags_3", "ld.fputc_flags_4",
+        "ld.stdin", "ld.stdout", "ld.cmpres", "ld.eax", "ld.ebx", "ld.ecx", "ld.edx", "ld.eex", "ld.efx", "ld.fax", "ld.fbx",
+        "ld.fcx", "ld.fdx", "ld.fex", "ld.ffx", "ld.eas", "ld.ebs", "ld.ead", "ld.ebd", "ld.lastintr",
+        "st.putc", "st.getc", "st.fputc", "st.fputc_flags_1", "st.fputc_flags_2", "st.fputc_flags_3", "st.fputc_flags_4",
+        "st.stdin", "st.stdout", "st.cmpres", "st.eax", "st.ebx", "st.ecx", "st.edx", "st.eex", "st.efx", "st.fax", "st.fbx",
+        "st.fcx", "st.fdx", "st.fex", "st.ffx", "st.eas", "st.ebs", "st.ead", "st.ebd", "st.lastintr"
+    };
+
+    /**
+     * \brief The indexes of the plugins in NerviPlugins, i.e. the values of NCommand::pluginIndex
+     */
+    enum NPluginIndex {
+        CORE_PLUGIN, /// The core commands (NerviCoreCommands)
+        WIDE_PLUGIN, /// The wide register commands (NerviWideCommands)
+        FLOW_PLUGIN, /// The control flow commands (NerviFlowCommands)
+        REGISTER_PLUGIN /// The register commands (NerviRegisterCommands)
+    };
+
+    /**
+     * \brief The kinds of command operands
+     * \details Tells what the address of a command argument means, so a program can be checked before it runs
+     */
+    enum NOperandKind {
+        OPERAND_NONE, /// The argument is not used
+        OPERAND_CELL, /// The argument is the address of the first of the cells the command reads or writes
+        OPERAND_VIEW, /// The argument is a wide register view (NWideRegisterNames)
+        OPERAND_TARGET /// The argument is the number of a command to jump to
+    };
+
+    /**
+     * \brief A structure to represent an operand of a command
+     * \details Stores the kind of the operand and its width in bytes (the amount of cells or the width of the view)
+     */
+    struct NOperand {
+        NOperandKind kind;
+        int width;
+    };
+
+    /**
+     * \brief A structure to represent the operands of a command
+     */
+    struct NCommandSignature {
+        NOperand first, second;
+    };
+
+    NCommandSignature NerviCoreCommandsSignatures[12] = {
+        {{OPERAND_CELL, 1}, {OPERAND_CELL, 1}},
+        {{OPERAND_CELL, 1}, {OPERAND_CELL, 1}},
+        {{OPERAND_CELL, 1}, {OPERAND_NONE, 0}},
+        {{OPERAND_CELL, 1}, {OPERAND_CELL, 1}},
+        {{OPERAND_CELL, 1}, {OPERAND_CELL, 1}},
+        {{OPERAND_CELL, 1}, {OPERAND_CELL, 1}},
+        {{OPERAND_CELL, 1}, {OPERAND_CELL, 1}},
+        {{OPERAND_CELL, 1}, {OPERAND_CELL, 1}},
+        {{OPERAND_CELL, 1}, {OPERAND_CELL, 1}},
+        {{OPERAND_CELL, 2}, {OPERAND_CELL, 2}},
+        {{OPERAND_CELL, 4}, {OPERAND_CELL, 4}},
+        {{OPERAND_CELL, 8}, {OPERAND_CELL, 8}}
+    };
+
+    NCommandSignature NerviWideCommandsSignatures[15] = {
+        {{OPERAND_VIEW, 2}, {OPERAND_CELL, 2}},
+        {{OPERAND_CELL, 2}, {OPERAND_VIEW, 2}},
+        {{OPERAND_VIEW, 2}, {OPERAND_VIEW, 2}},
+        {{OPERAND_VIEW, 2}, {OPERAND_VIEW, 2}},
+        {{OPERAND_VIEW, 2}, {OPERAND_VIEW, 2}},
+        {{OPERAND_VIEW, 4}, {OPERAND_CELL, 4}},
+        {{OPERAND_CELL, 4}, {OPERAND_VIEW, 4}},
+        {{OPERAND_VIEW, 4}, {OPERAND_VIEW, 4}},
+        {{OPERAND_VIEW, 4}, {OPERAND_VIEW, 4}},
+        {{OPERAND_VIEW, 4}, {OPERAND_VIEW, 4}},
+        {{OPERAND_VIEW, 8}, {OPERAND_CELL, 8}},
+        {{OPERAND_CELL, 8}, {OPERAND_VIEW, 8}},
+        {{OPERAND_VIEW, 8}, {OPERAND_VIEW, 8}},
+        {{OPERAND_VIEW, 8}, {OPERAND_VIEW, 8}},
+        {{OPERAND_VIEW, 8}, {OPERAND_VIEW, 8}}
+    };
+
+    NCommandSignature NerviFlowCommandsSignatures[7] = {
+        {{OPERAND_TARGET, 0}, {OPERAND_NONE, 0}},
+        {{OPERAND_CELL, 1}, {OPERAND_TARGET, 0}},
+        {{OPERAND_CELL, 1}, {OPERAND_TARGET, 0}},
+        {{OPERAND_CELL, 1}, {OPERAND_TARGET, 0}},
+        {{OPERAND_TARGET, 0}, {OPERAND_NONE, 0}},
+        {{OPERAND_NONE, 0}, {OPERAND_NONE, 0}},
+        {{OPERAND_NONE, 0}, {OPERAND_NONE, 0}}
+    };
+
+    auto NerviRegisterCommandsSignatures = [] {
+        std::array<NCommandSignature, 2 * IP> signatures;
+        signatures.fill({{OPERAND_CELL, 1}, {OPERAND_NONE, 0}});
+        return signatures;
+    }();
+
+    /**
+     * \brief A structure to represent a plugin, i.e. a list of commands
+     * \details Stores the handler table of a plugin, the amount of its commands, their names and their operands
+     */
+    struct NCommandPlugin {
+        const NCommandHandler* commands;
+        int commandCount;
+        const std::string* names;
+        const NCommandSignature* signatures;
+    };
+
+    NCommandPlugin NerviPlugins[4] = {
+        {NerviCoreCommands, 12, NerviCoreCommandsNames, NerviCoreCommandsSignatures},
+        {NerviWideCommands, 15, NerviWideCommandsNames, NerviWideCommandsSignatures},
+        {NerviFlowCommands, 7, NerviFlowCommandsNames, NerviFlowCommandsSignatures},
+        {NerviRegisterCommands, 2 * IP, NerviRegisterCommandsNames, NerviRegisterCommandsSignatures.data()}
     };
 }
 
@@ -1,6 +1,8 @@
 //
 // Created by EgrZver on 30.06.2023.
 //
+#include <utility>
+#include <kernel/command/ncommand.h>
 #include <kernel/storage/nmachinememory.h>
 
 
@@ -8,44 +10,351 @@
 #define NERVI_NCOMMANDLIST_H
 
 namespace NerviKernel {
+    /**
+     * \brief The statuses returned by command handlers
+     * \details A handler returns COMMAND_OK to let the program go on, any other status stops NVirtualMachine::run
+     */
+    enum NCommandStatus {
+        COMMAND_OK, /// The command has been executed
+        COMMAND_HALT, /// The command has stopped the program
+        COMMAND_STACK_OVERFLOW, /// The command has been rejected because a stack is full
+        COMMAND_STACK_UNDERFLOW /// The command has been rejected because a stack does not contain enough values
+    };
+
+    /**
+     * \brief The indexes of the core commands in NerviCoreCommands, which are their labels too (see NDecodedCommand::label)
+     */
+    enum NCoreCommandIndex {
+        CORE_AND, /// and [first], [second]
+        CORE_OR, /// or [first], [second]
+        CORE_NOT, /// not [first]
+        CORE_XOR, /// xor [first], [second]
+        CORE_EQV, /// eqv [first], [second]
+        CORE_IMP, /// imp [first], [second]
+        CORE_NAND, /// nand [first], [second]
+        CORE_NOR, /// nor [first], [second]
+        CORE_MOVE, /// mov [first], [second]
+        CORE_WORD_MOVE, /// mov16 [first], [second]
+        CORE_DWORD_MOVE, /// mov32 [first], [second]
+        CORE_QWORD_MOVE /// mov64 [first], [second]
+    };
+
+    /**
+     * \brief The indexes of the flow commands in NerviFlowCommands, the label of a flow command is NERVI_FLOW_LABEL plus its index
+     */
+    enum NFlowCommandIndex {
+        FLOW_JUMP, /// jmp first
+        FLOW_JUMP_IF_ZERO, /// jz [first], second
+        FLOW_JUMP_IF_NOT_ZERO, /// jnz [first], second
+        FLOW_DECREMENT_JUMP_IF_NOT_ZERO, /// djnz [first], second
+        FLOW_CALL, /// call first
+        FLOW_RET, /// ret
+        FLOW_HALT /// halt
+    };
+
     namespace NerviCoreCommandsDeclaration {
         int byteAnd(NVirtualMachineStorage* storage, long long first, long long second) {
             storage->setValueAt(first, storage->getValueAt(first) & storage->getValueAt(second));
+            return 0;
         }
 
         int byteOr(NVirtualMachineStorage* storage, long long first, long long second) {
             storage->setValueAt(first, storage->getValueAt(first) | storage->getValueAt(second));
+            return 0;
         }
 
         int byteNot(NVirtualMachineStorage* storage, long long first, long long second) {
             storage->setValueAt(first, ~storage->getValueAt(first));
+            return 0;
         }
 
         int byteXor(NVirtualMachineStorage* storage, long long first, long long second) {
             storage->setValueAt(first, storage->getValueAt(first) ^ storage->getValueAt(second));
+            return 0;
         }
 
         int byteEqv(NVirtualMachineStorage* storage, long long first, long long second) {
-            byteXor(storage, first, second);
-            byteNot(storage, first, second);
+            storage->setValueAt(first, ~(storage->getValueAt(first) ^ storage->getValueAt(second)));
+            return 0;
         }
 
+        // the inverted first cell is the second operand too when both addresses are the same, so x imp x is ~x
         int byteImp(NVirtualMachineStorage* storage, long long first, long long second) {
-            byteNot(storage, first, second);
-            byteOr(storage, first, second);
+            char inverted = ~storage->getValueAt(first);
+            storage->setValueAt(first, inverted | (first == second ? inverted : storage->getValueAt(second)));
+            return 0;
         }
 
         int byteNand(NVirtualMachineStorage* storage, long long first, long long second) {
-            byteAnd(storage, first, second);
-            byteNot(storage, first, second);
+            storage->setValueAt(first, ~(storage->getValueAt(first) & storage->getValueAt(second)));
+            return 0;
         }
 
         int byteNor(NVirtualMachineStorage* storage, long long first, long long second) {
-            byteOr(storage, first, second);
-            byteNot(storage, first, second);
+            storage->setValueAt(first, ~(storage->getValueAt(first) | storage->getValueAt(second)));
+            return 0;
+        }
+
+        int byteMove(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAt(first, storage->getValueAt(second));
+            return 0;
+        }
+
+        int wordMove(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setU16(first, storage->getU16(second));
+            return 0;
+        }
+
+        int dwordMove(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setU32(first, storage->getU32(second));
+            return 0;
+        }
+
+        int qwordMove(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setU64(first, storage->getU64(second));
+            return 0;
+        }
+
+    }
+
+    /**
+     * \brief The byte core commands with the unchecked accessors of NMemoryCard
+     * \details Run only the commands of a verified program (see NDecodedProgram::verify), whose cells are proven to be in the memory,
+     * while the memory is writable and has no locked cells
+     */
+    namespace NerviUncheckedCoreCommandsDeclaration {
+        int byteAnd(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAtUnchecked(first, storage->getValueAtUnchecked(first) & storage->getValueAtUnchecked(second));
+            return 0;
+        }
+
+        int byteOr(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAtUnchecked(first, storage->getValueAtUnchecked(first) | storage->getValueAtUnchecked(second));
+            return 0;
+        }
+
+        int byteNot(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAtUnchecked(first, ~storage->getValueAtUnchecked(first));
+            return 0;
+        }
+
+        int byteXor(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAtUnchecked(first, storage->getValueAtUnchecked(first) ^ storage->getValueAtUnchecked(second));
+            return 0;
+        }
+
+        int byteEqv(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAtUnchecked(first, ~(storage->getValueAtUnchecked(first) ^ storage->getValueAtUnchecked(second)));
+            return 0;
+        }
+
+        int byteImp(NVirtualMachineStorage* storage, long long first, long long second) {
+            char inverted = ~storage->getValueAtUnchecked(first);
+            storage->setValueAtUnchecked(first, inverted | (first == second ? inverted : storage->getValueAtUnchecked(second)));
+            return 0;
+        }
+
+        int byteNand(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAtUnchecked(first, ~(storage->getValueAtUnchecked(first) & storage->getValueAtUnchecked(second)));
+            return 0;
+        }
+
+        int byteNor(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAtUnchecked(first, ~(storage->getValueAtUnchecked(first) | storage->getValueAtUnchecked(second)));
+            return 0;
+        }
+
+        int byteMove(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAtUnchecked(first, storage->getValueAtUnchecked(second));
+            return 0;
+        }
+    }
+
+    /**
+     * \brief The core commands with operands on the attached discs
+     * \details The same commands as NerviCoreCommandsDeclaration, but every operand is read from (and the first one written to) the card
+     * of its own disc (see NVirtualMachineStorage::getDisc). The disc 0 is the memory of the programs with its usual checks, the other discs
+     * are checked by their cards, so writing to a ROM disc throws ReadOnlyMemoryException
+     */
+    namespace NerviDiscCommandsDeclaration {
+        template<typename T, typename S>
+        int coreCommand(int index, T* target, long long first, S* source, long long second, bool same) {
+            switch (index) {
+                case CORE_AND: target->setValueAt(first, target->getValueAt(first) & source->getValueAt(second)); break;
+                case CORE_OR: target->setValueAt(first, target->getValueAt(first) | source->getValueAt(second)); break;
+                case CORE_NOT: target->setValueAt(first, ~target->getValueAt(first)); break;
+                case CORE_XOR: target->setValueAt(first, target->getValueAt(first) ^ source->getValueAt(second)); break;
+                case CORE_EQV: target->setValueAt(first, ~(target->getValueAt(first) ^ source->getValueAt(second))); break;
+                case CORE_IMP: {
+                    char inverted = ~target->getValueAt(first);
+                    target->setValueAt(first, inverted | (same ? inverted : source->getValueAt(second)));
+                    break;
+                }
+                case CORE_NAND: target->setValueAt(first, ~(target->getValueAt(first) & source->getValueAt(second))); break;
+                case CORE_NOR: target->setValueAt(first, ~(target->getValueAt(first) | source->getValueAt(second))); break;
+                case CORE_MOVE: target->setValueAt(first, source->getValueAt(second)); break;
+                case CORE_WORD_MOVE: target->setU16(first, source->getU16(second)); break;
+                case CORE_DWORD_MOVE: target->setU32(first, source->getU32(second)); break;
+                default: target->setU64(first, source->getU64(second)); break;
+            }
+            return COMMAND_OK;
+        }
+
+        // the disc 0 goes through the accessors of the machine storage, which keep the programs out of the stack region,
+        // and the second operand of not is not looked up, as the core command ignores it
+        int coreCommand(NVirtualMachineStorage* storage, int index, const NMemoryAddress& first, const NMemoryAddress& second) {
+            const bool same = first.discNumber == second.discNumber && first.address == second.address;
+            const short sourceDisc = index == CORE_NOT ? first.discNumber : second.discNumber;
+            if (first.discNumber == 0 && sourceDisc == 0) {
+                return coreCommand(index, storage, first.address, storage, second.address, same);
+            }
+            if (first.discNumber == 0) {
+                return coreCommand(index, storage, first.address, storage->getDisc(sourceDisc), second.address, same);
+            }
+            NMemoryCard* target = storage->getDisc(first.discNumber);
+            if (sourceDisc == 0) {
+                return coreCommand(index, target, first.address, storage, second.address, same);
+            }
+            return coreCommand(index, target, first.address, storage->getDisc(sourceDisc), second.address, same);
+        }
+    }
+
+    namespace NerviWideCommandsDeclaration {
+        NWideRegisterNames toView(long long view) {
+            if (view < EAX_EBX || view > FCX_EBD) {
+                throw NerviInternalExceptions::InvalidRegisterException(fmt::format("Invalid required register view index: {}", view));
+            }
+            return NWideRegisterNames(view);
+        }
+
+        template<typename T>
+        T readView(NVirtualMachineStorage* storage, long long view) {
+            if constexpr (sizeof(T) == 2) return storage->getRegister16(toView(view));
+            else if constexpr (sizeof(T) == 4) return storage->getRegister32(toView(view));
+            else return storage->getRegister64(toView(view));
+        }
+
+        template<typename T>
+        void writeView(NVirtualMachineStorage* storage, long long view, T value) {
+            if constexpr (sizeof(T) == 2) storage->pushToRegister16(toView(view), value);
+            else if constexpr (sizeof(T) == 4) storage->pushToRegister32(toView(view), value);
+            else storage->pushToRegister64(toView(view), value);
+        }
+
+        template<typename T>
+        int wideLoad(NVirtualMachineStorage* storage, long long first, long long second) {
+            if constexpr (sizeof(T) == 2) writeView<T>(storage, first, storage->getU16(second));
+            else if constexpr (sizeof(T) == 4) writeView<T>(storage, first, storage->getU32(second));
+            else writeView<T>(storage, first, storage->getU64(second));
+            return 0;
+        }
+
+        template<typename T>
+        int wideStore(NVirtualMachineStorage* storage, long long first, long long second) {
+            if constexpr (sizeof(T) == 2) storage->setU16(first, readView<T>(storage, second));
+            else if constexpr (sizeof(T) == 4) storage->setU32(first, readView<T>(storage, second));
+            else storage->setU64(first, readView<T>(storage, second));
+            return 0;
+        }
+
+        template<typename T>
+        int wideAdd(NVirtualMachineStorage* storage, long long first, long long second) {
+            writeView<T>(storage, first, T(readView<T>(storage, first) + readView<T>(storage, second)));
+            return 0;
+        }
+
+        template<typename T>
+        int wideSub(NVirtualMachineStorage* storage, long long first, long long second) {
+            writeView<T>(storage, first, T(readView<T>(storage, first) - readView<T>(storage, second)));
+            return 0;
+        }
+
+        template<typename T>
+        int wideMul(NVirtualMachineStorage* storage, long long first, long long second) {
+            writeView<T>(storage, first, T(readView<T>(storage, first) * readView<T>(storage, second)));
+            return 0;
+        }
+    }
+
+    /**
+     * \brief The control flow commands
+     * \details The handlers are called after the IP has been moved to the next command, so a handler that does not jump lets the program
+     * go on and call pushes the address of the command that follows it. The jump targets are command numbers
+     */
+    namespace NerviFlowCommandsDeclaration {
+        int jump(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->jump(first);
+            return COMMAND_OK;
+        }
+
+        int jumpIfZero(NVirtualMachineStorage* storage, long long first, long long second) {
+            if (storage->getValueAt(first) == 0) {
+                storage->jump(second);
+            }
+            return COMMAND_OK;
+        }
+
+        int jumpIfNotZero(NVirtualMachineStorage* storage, long long first, long long second) {
+            if (storage->getValueAt(first) != 0) {
+                storage->jump(second);
+            }
+            return COMMAND_OK;
+        }
+
+        int decrementJumpIfNotZero(NVirtualMachineStorage* storage, long long first, long long second) {
+            char value = char(storage->getValueAt(first) - 1);
+            storage->setValueAt(first, value);
+            if (value != 0) {
+                storage->jump(second);
+            }
+            return COMMAND_OK;
+        }
+
+        int call(NVirtualMachineStorage* storage, long long first, long long second) {
+            if (storage->pushReturnAddress(storage->getIP()) != STACK_OK) {
+                return COMMAND_STACK_OVERFLOW;
+            }
+            storage->jump(first);
+            return COMMAND_OK;
+        }
+
+        int ret(NVirtualMachineStorage* storage, long long first, long long second) {
+            return storage->returnJump() == STACK_OK ? COMMAND_OK : COMMAND_STACK_UNDERFLOW;
+        }
+
+        int halt(NVirtualMachineStorage* storage, long long first, long long second) {
+            return COMMAND_HALT;
+        }
+    }
+
+    namespace NerviRegisterCommandsDeclaration {
+        template<NRegisterNames R>
+        int registerLoad(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setReg<R>(storage->getValueAt(first));
+            return 0;
+        }
+
+        template<NRegisterNames R>
+        int registerStore(NVirtualMachineStorage* storage, long long first, long long second) {
+            storage->setValueAt(first, storage->reg<R>());
+            return 0;
         }
 
+        template<typename Sequence>
+        struct NRegisterCommandTable;
 
+        /**
+         * \brief Generates the register commands for every char register
+         * \details The register is a template argument of each handler, so a handler does not check it at run time.
+         * The table contains registerLoad for all the registers followed by registerStore for all the registers
+         */
+        template<int... R>
+        struct NRegisterCommandTable<std::integer_sequence<int, R...>> {
+            static constexpr int (*commands[]) (NVirtualMachineStorage*, long long, long long) = {
+                registerLoad<NRegisterNames(R)>...,
+                registerStore<NRegisterNames(R)>...
+            };
+        };
     }
 
 }
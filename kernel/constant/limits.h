@@ -0,0 +1,51 @@
+//
+// Default limits of the virtual machine structures
+//
+
+#ifndef NERVI_LIMITS_H
+#define NERVI_LIMITS_H
+
+namespace NerviKernel {
+    /**
+     * \brief The default capacity of the data stack of NVirtualMachineStorage in bytes
+     */
+    constexpr long long NERVI_DEFAULT_STACK_LIMIT = 1 << 20;
+
+    /**
+     * \brief The default maximal depth of the return stack of NVirtualMachineStorage, i.e. the maximal depth of nested calls
+     */
+    constexpr long long NERVI_DEFAULT_RETURN_STACK_LIMIT = 1 << 16;
+
+    /**
+     * \brief The size in bytes of the in-object top segment of a stack backed by a memory card (see NFixedStack)
+     */
+    constexpr long long NERVI_STACK_HOT_BYTES = 256;
+
+    /**
+     * \brief The amount of common purpose registers a register window of NVirtualMachineStorage advances by on a call
+     * \details Adjacent windows overlap by this amount: the registers FCX..EBD of a caller are the registers EAX..FBX of its callee
+     */
+    constexpr long long NERVI_REGISTER_WINDOW_STEP = 8;
+
+    /**
+     * \brief The binary logarithm of the size of a page tracked by the dirty page bitmaps of NMemoryCard
+     */
+    constexpr int NERVI_TRACKED_PAGE_SHIFT = 12;
+
+    /**
+     * \brief The default amount of backward jumps to a command after which NTracedProgram records a trace from it
+     */
+    constexpr long long NERVI_DEFAULT_TRACE_THRESHOLD = 64;
+
+    /**
+     * \brief The maximal amount of commands in a trace of NTracedProgram, a longer recording is aborted
+     */
+    constexpr long long NERVI_MAX_TRACE_LENGTH = 512;
+
+    /**
+     * \brief The maximal amount of times the threshold of a command of NTracedProgram is doubled after aborted recordings
+     */
+    constexpr int NERVI_MAX_TRACE_BACKOFF = 16;
+}
+
+#endif //NERVI_LIMITS_H
@@ -41,6 +41,48 @@ namespace NerviKernel {
         LASTINTR, /// The LASTINTR register that stores the number of the last invoked interrupt
         IP /// The IP register of the number of a currently executing command
     };
+
+    /**
+     * \brief The names of wide register views
+     * \details A wide view joins 2, 4 or 8 adjacent common purpose registers into a 16-, 32- or 64-bit value.
+     * The first register of a view holds the least significant byte, i.e. the registers form the value in little-endian order like memory cells do.
+     * The views of the same width do not overlap, the views of different widths do (e.g. EAX_EDX contains EAX_EBX and ECX_EDX)
+     */
+    enum NWideRegisterNames {
+        EAX_EBX, /// The 16-bit view of EAX and EBX
+        ECX_EDX, /// The 16-bit view of ECX and EDX
+        EEX_EFX, /// The 16-bit view of EEX and EFX
+        FAX_FBX, /// The 16-bit view of FAX and FBX
+        FCX_FDX, /// The 16-bit view of FCX and FDX
+        FEX_FFX, /// The 16-bit view of FEX and FFX
+        EAS_EBS, /// The 16-bit view of EAS and EBS
+        EAD_EBD, /// The 16-bit view of EAD and EBD
+        EAX_EDX, /// The 32-bit view of the registers from EAX to EDX
+        EEX_FBX, /// The 32-bit view of the registers from EEX to FBX
+        FCX_FFX, /// The 32-bit view of the registers from FCX to FFX
+        EAS_EBD, /// The 32-bit view of the registers from EAS to EBD
+        EAX_FBX, /// The 64-bit view of the registers from EAX to FBX
+        FCX_EBD /// The 64-bit view of the registers from FCX to EBD
+    };
+
+    /**
+     * \brief Returns the width of a wide register view
+     * \param view The name of the view
+     * \return The amount of registers (bytes) in the view
+     */
+    constexpr int wideRegisterWidth(NWideRegisterNames view) {
+        return view < EAX_EDX ? 2 : view < EAX_FBX ? 4 : 8;
+    }
+
+    /**
+     * \brief Returns the first register of a wide register view
+     * \param view The name of the view
+     * \return The name of the register holding the least significant byte of the view
+     */
+    constexpr NRegisterNames wideRegisterFirst(NWideRegisterNames view) {
+        return view < EAX_EDX ? NRegisterNames(EAX + 2 * view) :
+               view < EAX_FBX ? NRegisterNames(EAX + 4 * (view - EAX_EDX)) : NRegisterNames(EAX + 8 * (view - EAX_FBX));
+    }
 }
 
 #endif //NERVI_REGADRESSES_H
@@ -39,6 +39,62 @@ namespace NerviInternalExceptions {
         const char *what() const noexcept override { return message_.c_str(); }
     };
 
+    /**
+    * \brief Represents the class of the exception caused by writing to a read-only memory device
+    * \details This is the class of the exception that is thrown if you are trying to change the contents or the size of a read-only
+    * memory card (i.e. NRomCard). Unlike LockedAddressException it does not depend on the locks of particular cells
+    */
+    class ReadOnlyMemoryException : public std::exception {
+    private:
+        std::string message_;
+    public:
+        explicit ReadOnlyMemoryException(const std::string &message);
+
+        const char *what() const noexcept override { return message_.c_str(); }
+    };
+
+    /**
+    * \brief Represents the class of the exception caused by addressing a non-existent disc
+    * \details This is the class of the exception that is thrown if a disc number does not refer to a disc attached to a virtual machine,
+    * or if you are trying to attach a disc with the number reserved by the virtual machine's own storage (0)
+    */
+    class InvalidDiscException : public std::exception {
+    private:
+        std::string message_;
+    public:
+        explicit InvalidDiscException(const std::string &message);
+
+        const char *what() const noexcept override { return message_.c_str(); }
+    };
+
+    /**
+    * \brief Represents the class of the exception caused by loading a malformed saved state
+    * \details This is the class of the exception that is thrown if a stream passed to the load methods of a memory card or a virtual machine
+    * ends too early or contains something that cannot be a saved state (a wrong signature, a range out of bounds, a stack deeper than its limit)
+    */
+    class InvalidStateException : public std::exception {
+    private:
+        std::string message_;
+    public:
+        explicit InvalidStateException(const std::string &message);
+
+        const char *what() const noexcept override { return message_.c_str(); }
+    };
+
+    /**
+    * \brief Represents the class of the exception caused by an invalid command of a program
+    * \details This is the class of the exception that is thrown when a program is prepared for running and one of its commands refers to
+    * an unknown plugin or command, or has an operand that is out of range (a cell beyond its card, an unknown register view, a jump target beyond the program)
+    */
+    class InvalidCommandException : public std::exception {
+    private:
+        std::string message_;
+    public:
+        explicit InvalidCommandException(const std::string &message);
+
+        const char *what() const noexcept override { return message_.c_str(); }
+    };
+
     /**
     * \brief Represents the class of the exception caused by addressing an non-existent register
     * \details This is the class of the exception that is thrown if the number of register you are trying to push a value into represent an unknown register
@@ -88,6 +144,14 @@ namespace NerviInternalExceptions {
 
     InvalidIndexException::InvalidIndexException(const std::string &message) : message_(message) {}
 
+    ReadOnlyMemoryException::ReadOnlyMemoryException(const std::string &message) : message_(message) {}
+
+    InvalidDiscException::InvalidDiscException(const std::string &message) : message_(message) {}
+
+    InvalidStateException::InvalidStateException(const std::string &message) : message_(message) {}
+
+    InvalidCommandException::InvalidCommandException(const std::string &message) : message_(message) {}
+
     InvalidRegisterException::InvalidRegisterException(const std::string &message) : message_(message) {}
 
     DeveloperTestException::DeveloperTestException(const std::string &message) : message_(message) {}
@@ -0,0 +1,111 @@
+/**
+ * \file bench.cpp
+ * \brief The benchmark of the interpreter loop of NVirtualMachine
+ * \details Runs representative programs (bitwise commands, wide register arithmetic, calls) to completion
+ * and reports the amount of executed instructions per second for each of them, as NCommand vectors, decoded by NVirtualMachine::load
+ * (without and with superinstructions, verified for the unchecked accessors, and after the peephole pass), packed by NPackedProgram::encode
+ * compiled by NJitProgram, traced by NTracedProgram and split into basic blocks by NBlockProgram.
+ * The target NerviBenchRunThreaded runs the same programs on the direct-threaded engine
+ */
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <kernel/machine/nmachine.h>
+
+using namespace NerviKernel;
+
+NCommand command(int plugin, int index, long long first = 0, long long second = 0) {
+    return NCommand{plugin, index, {{0, first}, 0}, {{0, second}, 0}};
+}
+
+// wraps a body into two nested djnz loops: 255 inner iterations (cell 0) times the outer count (cell 1)
+std::vector<NCommand> loop(const std::vector<NCommand>& body, std::vector<NCommand> subroutine = {}) {
+    std::vector<NCommand> program;
+    program.push_back(command(CORE_PLUGIN, 8, 0, 2));
+    program.insert(program.end(), body.begin(), body.end());
+    program.push_back(command(FLOW_PLUGIN, 3, 0, 1));
+    program.push_back(command(FLOW_PLUGIN, 3, 1, 0));
+    program.push_back(command(FLOW_PLUGIN, 6));
+    program.insert(program.end(), subroutine.begin(), subroutine.end());
+    return program;
+}
+
+enum NProgramForm { COMMANDS, DECODED, FUSED, VERIFIED, PEEPHOLE, PACKED, COMPILED, TRACED, BLOCKS };
+
+void measure(const std::string& name, const std::vector<NCommand>& program, int rounds, NProgramForm form) {
+    NVirtualMachineStorage storage(1 << 16);
+    NVirtualMachine machine(storage);
+    NSuperinstructionProfile profile;
+    profile.addProgram(program);
+    NDecodedProgram decoded = form == FUSED ? machine.load(program, profile, 16) : machine.load(program, form == PEEPHOLE ? LOAD_PEEPHOLE : LOAD_AS_IS);
+    if (form == VERIFIED) {
+        decoded.verify();
+    }
+    NPackedProgram packed = NPackedProgram::encode(program);
+    NJitProgram compiled(program, storage);
+    NTracedProgram traced(program, storage);
+    NBlockProgram blocks(program, storage);
+    long long executed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        storage.setValueAt(1, 100);
+        storage.setValueAt(2, char(255));
+        storage.jump(0);
+        executed += form == DECODED || form == FUSED || form == VERIFIED || form == PEEPHOLE ? machine.run(decoded).executed : form == PACKED ? machine.run(packed).executed :
+                    form == COMPILED ? machine.run(compiled).executed : form == TRACED ? machine.run(traced).executed :
+                    form == BLOCKS ? machine.run(blocks).executed : machine.run(program).executed;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fmt::print("{:8} {:8}: {} instructions in {:.3f} s, {:.1f} M instructions per second\n", name, form == DECODED ? "decoded" : form == FUSED ? "fused" : form == VERIFIED ? "verified" : form == PEEPHOLE ? "peephole" : form == PACKED ? "packed" : form == COMPILED ? "jit" : form == TRACED ? "trace" : form == BLOCKS ? "blocks" : "", executed, seconds, double(executed) / seconds / 1e6);
+}
+
+int main() {
+#ifdef NERVI_THREADED_DISPATCH
+    fmt::print("engine: direct-threaded\n");
+#else
+    fmt::print("engine: dispatch table\n");
+#endif
+    std::vector<NCommand> bitwise;
+    for (int i = 0; i < 16; i++) {
+        bitwise.push_back(command(CORE_PLUGIN, i % 12 < 8 ? i % 8 : 8, 64 + i * 7 % 32, 128 + i * 13 % 32));
+    }
+    std::vector<NCommand> wide = {
+        command(WIDE_PLUGIN, 10, EAX_FBX, 256),
+        command(WIDE_PLUGIN, 10, FCX_EBD, 264),
+        command(WIDE_PLUGIN, 12, EAX_FBX, FCX_EBD),
+        command(WIDE_PLUGIN, 14, FCX_EBD, EAX_FBX),
+        command(WIDE_PLUGIN, 11, 272, EAX_FBX),
+        command(CORE_PLUGIN, 11, 280, 272),
+        command(WIDE_PLUGIN, 5, EAX_EDX, 280),
+        command(WIDE_PLUGIN, 7, EAX_EDX, EAX_EDX)
+    };
+    // the peephole pass removes two thirds of it: the pairs of not, the xor of each xor-or pair (folded to a mov) and the mov x,x
+    std::vector<NCommand> redundant;
+    for (int i = 0; i < 4; i++) {
+        redundant.push_back(command(CORE_PLUGIN, 2, 64 + i));
+        redundant.push_back(command(CORE_PLUGIN, 2, 64 + i));
+        redundant.push_back(command(CORE_PLUGIN, 3, 72 + i, 72 + i));
+        redundant.push_back(command(CORE_PLUGIN, 1, 72 + i, 80 + i));
+        redundant.push_back(command(CORE_PLUGIN, 8, 88 + i, 88 + i));
+        redundant.push_back(command(CORE_PLUGIN, 0, 96 + i, 104 + i));
+    }
+    std::vector<NCommand> calls = {
+        command(FLOW_PLUGIN, 4, 0),
+        command(CORE_PLUGIN, 3, 300, 301)
+    };
+    std::vector<NCommand> subroutine = {
+        command(CORE_PLUGIN, 8, 302, 300),
+        command(CORE_PLUGIN, 0, 302, 303),
+        command(FLOW_PLUGIN, 5)
+    };
+    std::vector<NCommand> program = loop(calls, subroutine);
+    program[1].fArg.argAddress.address = (long long) program.size() - (long long) subroutine.size();
+    for (NProgramForm form : {COMMANDS, DECODED, FUSED, VERIFIED, PEEPHOLE, PACKED, COMPILED, TRACED, BLOCKS}) {
+        measure("bitwise", loop(bitwise), 20, form);
+        measure("wide", loop(wide), 20, form);
+        measure("calls", program, 20, form);
+        measure("folds", loop(redundant), 20, form);
+    }
+    return 0;
+}
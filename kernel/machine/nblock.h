@@ -0,0 +1,191 @@
+/**
+ * \file nblock.h
+ * \brief Contains the definition of the class NBlockProgram
+ * \details Contains the definition of the basic block decoder of Nervi programs and the following documentation
+ */
+
+#include <vector>
+#include <algorithm>
+#include <kernel/command/ncommand.h>
+#include <kernel/command/ncommandlist.h>
+#include <kernel/machine/nprogram.h>
+
+#ifndef KERNEL_MACHINE_NBLOCK
+#define KERNEL_MACHINE_NBLOCK
+
+namespace NerviKernel {
+
+    class NVirtualMachine;
+
+    /**
+     * \brief A class of a program split into basic blocks
+     * \details The program is decoded (see NDecodedProgram) and split at the jump targets and after the flow commands. A block is a run of
+     * the decoded commands: the straight commands, which do not jump, followed by the flow command that ends the block, if any.
+     * A block is resolved the first time the IP reaches its entry: the length of its straight part is cached by the entry, and its commands
+     * are stored at their own indexes with the handlers resolved. The byte core commands whose cells are inside the memory of the programs
+     * (the condition of NDecodedProgram::verify) get the unchecked handlers, which address the storage directly, the other commands
+     * keep their checked handlers. Entering in the middle of a block (e.g. continuing a run stopped by the budget) makes a block of its own.
+     * NVirtualMachine runs the straight commands of a block in one loop without fetching them and moving the IP one by one.
+     * The resolved commands are used while the memory allows the unchecked accessors for all the resolved cells
+     * (see NMemoryCard::allowsUnchecked), otherwise the block runs the decoded commands with their checks:
+     * \code
+     * NerviKernel::NBlockProgram blocks(program, storage);
+     * NerviKernel::NVirtualMachine machine(storage);
+     * machine.run(blocks);
+     * double rate = blocks.getHitRate();
+     * \endcode
+     */
+    class NBlockProgram {
+        friend class NVirtualMachine;
+        NBlockProgram(const NBlockProgram& nbp) = delete;
+        NBlockProgram& operator=(const NBlockProgram& nbp) = delete;
+    private:
+        NDecodedProgram decoded;
+        std::vector<bool> leaders;
+        std::vector<long long> straight;
+        std::vector<NDecodedCommand> resolved;
+        long long extent, entered, misses;
+        long long decodeBlock(long long ip);
+    public:
+        NBlockProgram(const std::vector<NCommand>& program, NVirtualMachineStorage& storage);
+        const NDecodedProgram& getDecoded() const;
+        const NDecodedCommand* getResolvedCommands() const;
+        long long getResolvedExtent() const;
+        long long getStraightLength(long long ip);
+        long long getBlockCount() const;
+        long long getHitCount() const;
+        long long getMissCount() const;
+        double getHitRate() const;
+    };
+
+    /**
+     * \brief The NBlockProgram constructor that finds the leaders of the blocks
+     * \param program The commands of the program
+     * \param storage The machine the program is decoded for
+     * \throw InvalidCommandException If a command of the program is invalid (see NDecodedProgram)
+     */
+    NBlockProgram::NBlockProgram(const std::vector<NCommand>& program, NVirtualMachineStorage& storage): decoded(program, storage) {
+        const long long length = (long long) program.size();
+        this->leaders.assign(length + 1, false);
+        this->straight.assign(length, -1);
+        this->resolved.assign(length, NDecodedCommand{});
+        this->extent = 0;
+        this->entered = 0;
+        this->misses = 0;
+        for (long long index = 0; index < length; index++) {
+            const NCommand& command = program[index];
+            const NCommandSignature& signature = NerviPlugins[command.pluginIndex].signatures[command.commandIndex];
+            if (signature.first.kind == OPERAND_TARGET) {
+                this->leaders[command.fArg.argAddress.address] = true;
+            }
+            if (signature.second.kind == OPERAND_TARGET) {
+                this->leaders[command.sArg.argAddress.address] = true;
+            }
+            if (command.pluginIndex == FLOW_PLUGIN) {
+                this->leaders[index + 1] = true;
+            }
+        }
+    }
+
+    long long NBlockProgram::decodeBlock(long long ip) {
+        const NDecodedCommand* commands = this->decoded.getCommands();
+        const long long length = this->decoded.getLength();
+        long long index = ip;
+        while (index < length && (index == ip || !this->leaders[index])) {
+            const int label = commands[index].label;
+            if (label < 0 || label >= NERVI_SUPERINSTRUCTION_LABEL) {
+                throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid label {} of the command {} of a block", label, index));
+            }
+            if (label >= NERVI_FLOW_LABEL && label < NERVI_PLUGIN_LABEL) {
+                break;
+            }
+            index++;
+        }
+        // the straight commands get their operands resolved, the command after them is stored as is for the check of the terminator
+        const long long memorySize = this->decoded.getStorage()->getProgramSize();
+        for (long long command = ip; command <= index && command < length; command++) {
+            NDecodedCommand& target = this->resolved[command] = commands[command];
+            if (command < index && target.label < (int) std::size(NerviUncheckedCoreCommands)) {
+                long long end = NDecodedProgram::getCellExtent(target, memorySize);
+                if (end >= 0) {
+                    target.handler = NerviUncheckedCoreCommands[target.label];
+                    this->extent = std::max(this->extent, end);
+                }
+            }
+        }
+        this->misses++;
+        return this->straight[ip] = index - ip;
+    }
+
+    /**
+     * \brief Returns the decoded program the blocks are made of
+     * \return The decoded program
+     */
+    const NDecodedProgram& NBlockProgram::getDecoded() const {
+        return this->decoded;
+    }
+
+    /**
+     * \brief Returns the commands of the resolved blocks
+     * \details The commands are stored at their indexes in the program, the commands of the blocks not resolved yet are empty
+     * \return The pointer to the first command
+     */
+    const NDecodedCommand* NBlockProgram::getResolvedCommands() const {
+        return this->resolved.data();
+    }
+
+    /**
+     * \brief Returns the end of the cells addressed by the unchecked handlers of the resolved blocks
+     * \return The index after the last cell, 0 if no command has got an unchecked handler
+     */
+    long long NBlockProgram::getResolvedExtent() const {
+        return this->extent;
+    }
+
+    /**
+     * \brief Returns the amount of straight commands of the block that starts at a command
+     * \details Resolves the block if it is not cached yet. The straight commands are the decoded commands from the IP on, the one
+     * after them is the flow command that ends the block, if it is a flow command
+     * \param ip The index of the command, it must be a command of the program
+     * \return The amount of straight commands, 0 if the block is only a flow command
+     */
+    long long NBlockProgram::getStraightLength(long long ip) {
+        const long long length = this->straight[ip];
+        return length >= 0 ? length : this->decodeBlock(ip);
+    }
+
+    /**
+     * \brief Returns the amount of cached blocks
+     * \return The amount of blocks
+     */
+    long long NBlockProgram::getBlockCount() const {
+        return this->misses;
+    }
+
+    /**
+     * \brief Returns the amount of blocks entered whose end was cached
+     * \return The amount of hits
+     */
+    long long NBlockProgram::getHitCount() const {
+        return this->entered - this->misses;
+    }
+
+    /**
+     * \brief Returns the amount of blocks whose end was found because it was not cached
+     * \return The amount of misses
+     */
+    long long NBlockProgram::getMissCount() const {
+        return this->misses;
+    }
+
+    /**
+     * \brief Returns the share of the entered blocks whose end was cached
+     * \details The entered blocks are counted by NVirtualMachine at the end of a run
+     * \return The hit rate from 0 to 1, 0 if no block has been entered
+     */
+    double NBlockProgram::getHitRate() const {
+        return this->entered == 0 ? 0.0 : double(this->entered - this->misses) / double(this->entered);
+    }
+}
+
+#endif
@@ -0,0 +1,211 @@
+/**
+ * \file nbytecode.h
+ * \brief Contains the definition of the class NPackedProgram
+ * \details Contains the definition of the packed bytecode of Nervi programs, its encoder and decoder and the following documentation
+ */
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <kernel/command/ncommand.h>
+#include <kernel/command/ncommandlist.h>
+#include <kernel/machine/nprogram.h>
+
+#ifndef KERNEL_MACHINE_NBYTECODE
+#define KERNEL_MACHINE_NBYTECODE
+
+namespace NerviKernel {
+
+    /**
+     * \brief The first opcodes of the plugins, indexed by NPluginIndex
+     * \details The opcodes of the core and flow commands are the labels of the threaded engine (see NDecodedCommand::label),
+     * the commands of the other plugins follow them
+     */
+    constexpr int NerviOpcodeBase[4] = {0, NERVI_PLUGIN_LABEL, NERVI_FLOW_LABEL, NERVI_PLUGIN_LABEL + 15};
+
+    /**
+     * \brief The amount of opcodes
+     */
+    constexpr int NERVI_OPCODE_COUNT = NERVI_PLUGIN_LABEL + 15 + 2 * IP;
+
+    /**
+     * \brief A structure to represent the command of an opcode
+     */
+    struct NOpcode {
+        int pluginIndex, commandIndex;
+        NCommandHandler handler;
+    };
+
+    /**
+     * \brief The commands of the opcodes
+     */
+    std::array<NOpcode, NERVI_OPCODE_COUNT> NerviOpcodes = [] {
+        std::array<NOpcode, NERVI_OPCODE_COUNT> opcodes;
+        for (int plugin = 0; plugin < (int) std::size(NerviPlugins); plugin++) {
+            for (int command = 0; command < NerviPlugins[plugin].commandCount; command++) {
+                opcodes[NerviOpcodeBase[plugin] + command] = {plugin, command, NerviPlugins[plugin].commands[command]};
+            }
+        }
+        return opcodes;
+    }();
+
+    /**
+     * \brief The operand mode bits of a packed command
+     * \details An operand is narrow when its disc fits in a byte and its address fits in 32 bits, and is stored in the command then.
+     * A wide operand is stored in the wide operand table of the program, and the address field of the command holds its index in the table
+     */
+    enum NPackedOperandMode {
+        PACKED_WIDE_FIRST = 1, /// The first operand is wide
+        PACKED_WIDE_SECOND = 2, /// The second operand is wide
+        PACKED_DISCS = 4 /// An operand is on an attached disc (not the disc 0), the command runs with NVirtualMachine's disc path
+    };
+
+    /**
+     * \brief A structure to represent a packed command
+     * \details Stores the opcode of a command, the mode bits of its operands, their narrow discs and addresses (or indexes of wide operands)
+     * and the data of its arguments in 16 bytes, so four commands share a cache line
+     */
+    struct alignas(16) NPackedCommand {
+        std::uint8_t opcode;
+        std::uint8_t modes;
+        std::uint8_t firstDisc, secondDisc;
+        std::int32_t first, second;
+        char firstData, secondData;
+    };
+
+    static_assert(sizeof(NPackedCommand) == 16, "A packed command must take 16 bytes");
+
+    /**
+     * \brief A class of a program in the packed bytecode
+     * \details The encoder turns a vector of NCommand into a stream of NPackedCommand and a table of wide operands,
+     * the decoder restores the original commands exactly. NVirtualMachine runs the packed stream directly, the IP is the index of a packed command:
+     * \code
+     * NerviKernel::NPackedProgram packed = NerviKernel::NPackedProgram::encode(program);
+     * machine.run(packed);
+     * std::vector<NerviKernel::NCommand> same = packed.decode();
+     * \endcode
+     */
+    class NPackedProgram {
+    private:
+        std::vector<NPackedCommand> commands;
+        std::vector<NMemoryAddress> wide;
+        std::int32_t packOperand(const NMemoryAddress& address, std::uint8_t& disc, std::uint8_t& modes, std::uint8_t wideMode);
+        NMemoryAddress unpackOperand(std::int32_t value, std::uint8_t disc, std::uint8_t modes, std::uint8_t wideMode) const;
+    public:
+        static NPackedProgram encode(const std::vector<NCommand>& program);
+        std::vector<NCommand> decode() const;
+        NCommand getCommand(long long index) const;
+        const NPackedCommand* getCommands() const;
+        const NMemoryAddress* getWideOperands() const;
+        long long getLength() const;
+        long long getWideOperandCount() const;
+    };
+
+    std::int32_t NPackedProgram::packOperand(const NMemoryAddress& address, std::uint8_t& disc, std::uint8_t& modes, std::uint8_t wideMode) {
+        if (address.discNumber >= 0 && address.discNumber <= std::numeric_limits<std::uint8_t>::max() &&
+            address.address >= std::numeric_limits<std::int32_t>::min() && address.address <= std::numeric_limits<std::int32_t>::max()) {
+            disc = std::uint8_t(address.discNumber);
+            return std::int32_t(address.address);
+        }
+        disc = 0;
+        modes |= wideMode;
+        this->wide.push_back(address);
+        return std::int32_t(this->wide.size() - 1);
+    }
+
+    NMemoryAddress NPackedProgram::unpackOperand(std::int32_t value, std::uint8_t disc, std::uint8_t modes, std::uint8_t wideMode) const {
+        return modes & wideMode ? this->wide[value] : NMemoryAddress{short(disc), value};
+    }
+
+    /**
+     * \brief Encodes a program into the packed bytecode
+     * \param program The commands of the program
+     * \return The packed program
+     * \throw InvalidCommandException If a command refers to an unknown plugin or command
+     */
+    NPackedProgram NPackedProgram::encode(const std::vector<NCommand>& program) {
+        NPackedProgram packed;
+        packed.commands.reserve(program.size());
+        for (long long index = 0; index < (long long) program.size(); index++) {
+            const NCommand& command = program[index];
+            if ((unsigned) command.pluginIndex >= std::size(NerviPlugins) || (unsigned) command.commandIndex >= (unsigned) NerviPlugins[command.pluginIndex].commandCount) {
+                throw NerviInternalExceptions::InvalidCommandException(fmt::format("Invalid command {}: unknown command {} of plugin {}", index, command.commandIndex, command.pluginIndex));
+            }
+            NPackedCommand result{};
+            result.opcode = std::uint8_t(NerviOpcodeBase[command.pluginIndex] + command.commandIndex);
+            result.first = packed.packOperand(command.fArg.argAddress, result.firstDisc, result.modes, PACKED_WIDE_FIRST);
+            result.second = packed.packOperand(command.sArg.argAddress, result.secondDisc, result.modes, PACKED_WIDE_SECOND);
+            if (command.fArg.argAddress.discNumber != 0 || command.sArg.argAddress.discNumber != 0) {
+                result.modes |= PACKED_DISCS;
+            }
+            result.firstData = command.fArg.argData;
+            result.secondData = command.sArg.argData;
+            packed.commands.push_back(result);
+        }
+        return packed;
+    }
+
+    /**
+     * \brief Decodes the packed bytecode
+     * \return The commands of the program
+     */
+    std::vector<NCommand> NPackedProgram::decode() const {
+        std::vector<NCommand> program;
+        program.reserve(this->commands.size());
+        for (long long index = 0; index < this->getLength(); index++) {
+            program.push_back(this->getCommand(index));
+        }
+        return program;
+    }
+
+    /**
+     * \brief Decodes a packed command
+     * \param index The index of the command, it must be a command of the program
+     * \return The command
+     */
+    NCommand NPackedProgram::getCommand(long long index) const {
+        const NPackedCommand& command = this->commands[index];
+        const NOpcode& opcode = NerviOpcodes[command.opcode];
+        return {
+            opcode.pluginIndex,
+            opcode.commandIndex,
+            {this->unpackOperand(command.first, command.firstDisc, command.modes, PACKED_WIDE_FIRST), command.firstData},
+            {this->unpackOperand(command.second, command.secondDisc, command.modes, PACKED_WIDE_SECOND), command.secondData}
+        };
+    }
+
+    /**
+     * \brief Returns the packed commands
+     * \return The pointer to the first packed command
+     */
+    const NPackedCommand* NPackedProgram::getCommands() const {
+        return this->commands.data();
+    }
+
+    /**
+     * \brief Returns the wide operands
+     * \return The pointer to the first wide operand
+     */
+    const NMemoryAddress* NPackedProgram::getWideOperands() const {
+        return this->wide.data();
+    }
+
+    /**
+     * \brief Returns the amount of commands of the program
+     * \return The amount of commands
+     */
+    long long NPackedProgram::getLength() const {
+        return (long long) this->commands.size();
+    }
+
+    /**
+     * \brief Returns the amount of operands stored in the wide operand table
+     * \return The amount of wide operands
+     */
+    long long NPackedProgram::getWideOperandCount() const {
+        return (long long) this->wide.size();
+    }
+}
+
+#endif
@@ -0,0 +1,525 @@
+/**
+ * \file njit.h
+ * \brief Contains the definition of the class NJitProgram
+ * \details Contains the definitions of the x86-64 assembler of Nervi commands, the native code blocks, the baseline compiler of Nervi programs and the following documentation
+ */
+
+#include <map>
+#include <utility>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <kernel/command/ncommand.h>
+#include <kernel/command/ncommandlist.h>
+#include <kernel/machine/nprogram.h>
+#include <kernel/storage/nmachinememory.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define NERVI_JIT
+#endif
+
+#ifndef KERNEL_MACHINE_NJIT
+#define KERNEL_MACHINE_NJIT
+
+namespace NerviKernel {
+
+    /**
+     * \brief The type of native code
+     * \details The code runs from its entry until the budget is spent or the IP leaves the compiled commands, and returns the IP.
+     * The registers: rdi holds the memory base, rsi the dirty page bitmap, rdx the remaining budget and rcx the address the remaining budget
+     * is stored to on return
+     */
+    typedef long long (*NNativeEntry) (char* memory, std::uint64_t* dirtyPages, long long budget, long long* left);
+
+    /**
+     * \brief A class of a block of native code
+     * \details Owns the executable memory of the code made by NNativeAssembler and enters the code on a machine. The code addresses
+     * the cells below its extent without checks, so it is entered only while the memory is writable, has no locked cells and is not smaller
+     * than the extent. The class objects can be moved but not copied
+     */
+    class NNativeCode {
+        NNativeCode(const NNativeCode& nnc) = delete;
+        NNativeCode& operator=(const NNativeCode& nnc) = delete;
+    private:
+        char* code;
+        long long size, extent;
+    public:
+        NNativeCode();
+        NNativeCode(char* code, long long size, long long extent);
+        NNativeCode(NNativeCode&& nnc) noexcept;
+        NNativeCode& operator=(NNativeCode&& nnc) noexcept;
+        ~NNativeCode();
+        bool isEmpty() const;
+        long long getSize() const;
+        bool enter(NVirtualMachineStorage* storage, long long offset, long long& executed, long long budget) const;
+    };
+
+    /**
+     * \brief The NNativeCode constructor that creates an empty block
+     */
+    NNativeCode::NNativeCode() {
+        this->code = nullptr;
+        this->size = 0;
+        this->extent = 0;
+    }
+
+    /**
+     * \brief The NNativeCode constructor that takes executable memory
+     * \param code The executable memory mapped by mmap
+     * \param size The size of the memory
+     * \param extent The end of the cells addressed by the code
+     */
+    NNativeCode::NNativeCode(char* code, long long size, long long extent) {
+        this->code = code;
+        this->size = size;
+        this->extent = extent;
+    }
+
+    NNativeCode::NNativeCode(NNativeCode&& nnc) noexcept {
+        this->code = std::exchange(nnc.code, nullptr);
+        this->size = std::exchange(nnc.size, 0);
+        this->extent = nnc.extent;
+    }
+
+    NNativeCode& NNativeCode::operator=(NNativeCode&& nnc) noexcept {
+        std::swap(this->code, nnc.code);
+        std::swap(this->size, nnc.size);
+        std::swap(this->extent, nnc.extent);
+        return *this;
+    }
+
+    /**
+     * \brief The NNativeCode destructor
+     * \details Unmaps the executable memory
+     */
+    NNativeCode::~NNativeCode() {
+#ifdef NERVI_JIT
+        if (this->code != nullptr) {
+            munmap(this->code, this->size);
+        }
+#endif
+    }
+
+    /**
+     * \brief Checks if the block has no code
+     * \return True if the block is empty
+     */
+    bool NNativeCode::isEmpty() const {
+        return this->code == nullptr;
+    }
+
+    /**
+     * \brief Returns the size of the code
+     * \return The size in bytes
+     */
+    long long NNativeCode::getSize() const {
+        return this->size;
+    }
+
+    /**
+     * \brief Runs the code on a machine
+     * \details Does nothing if the block is empty or the memory of the machine does not allow entering the code. Otherwise runs the code
+     * and moves the IP of the machine to the IP returned by the code
+     * \param storage The machine
+     * \param offset The offset of the entry in the code
+     * \param executed The amount of executed commands, increased by the amount executed by the code
+     * \param budget The maximal amount of commands to execute
+     * \return True if the code has run
+     */
+    bool NNativeCode::enter(NVirtualMachineStorage* storage, long long offset, long long& executed, long long budget) const {
+        NMemoryCard* card = storage;
+        if (this->code == nullptr || !card->allowsUnchecked(this->extent)) {
+            return false;
+        }
+        long long left;
+        NNativeEntry entry = reinterpret_cast<NNativeEntry>(this->code + offset);
+        long long next = entry(card->storage, card->dirtyBits, budget - executed, &left);
+        executed = budget - left;
+        storage->jump(next);
+        return true;
+    }
+
+#ifdef NERVI_JIT
+    /**
+     * \brief The conditions of native branches
+     */
+    enum NNativeCondition {
+        NATIVE_ALWAYS, /// The branch is always taken
+        NATIVE_ZERO, /// The branch is taken if the tested cell is zero
+        NATIVE_NOT_ZERO /// The branch is taken if the tested cell is not zero
+    };
+
+    /**
+     * \brief A class of the assembler of native code
+     * \details Emits the x86-64 templates of the core bitwise commands, the byte move and the jumps (see NJitProgram) and the branches to commands.
+     * A branch to a command goes to its code if the finishing resolver gives one, otherwise to an exit that returns the IP of the command.
+     * The exits are placed after the code
+     */
+    class NNativeAssembler {
+    private:
+        std::vector<unsigned char> out;
+        std::vector<std::pair<long long, long long>> branches, exits;
+        long long extent;
+        void emit(std::initializer_list<unsigned char> bytes);
+        void emit32(std::int32_t value);
+        void cell(unsigned char opcode, int reg, long long address);
+        void markDirty(long long address);
+        void emitBranch(NNativeCondition condition);
+    public:
+        NNativeAssembler();
+        static bool isCompilable(const NDecodedCommand& command, long long memorySize);
+        static NNativeCondition takenCondition(const NDecodedCommand& command);
+        static NNativeCondition invert(NNativeCondition condition);
+        long long getPosition() const;
+        void checkBudget(long long ip);
+        void command(const NDecodedCommand& command);
+        void branch(NNativeCondition condition, long long ip);
+        void branchTo(NNativeCondition condition, long long position);
+        template<typename F> NNativeCode finish(F resolve);
+    };
+
+    /**
+     * \brief The NNativeAssembler constructor
+     */
+    NNativeAssembler::NNativeAssembler() {
+        this->extent = 0;
+    }
+
+    void NNativeAssembler::emit(std::initializer_list<unsigned char> bytes) {
+        this->out.insert(this->out.end(), bytes);
+    }
+
+    void NNativeAssembler::emit32(std::int32_t value) {
+        unsigned char bytes[4];
+        memcpy(bytes, &value, 4);
+        this->out.insert(this->out.end(), bytes, bytes + 4);
+    }
+
+    // modrm with a 32-bit displacement from rdi (the memory base)
+    void NNativeAssembler::cell(unsigned char opcode, int reg, long long address) {
+        this->emit({opcode, (unsigned char) (0x87 | reg << 3)});
+        this->emit32(std::int32_t(address));
+        this->extent = std::max(this->extent, address + 1);
+    }
+
+    // or byte [rsi + page / 8], 1 << page % 8, i.e. the bit of the page in the dirty bitmap (little-endian)
+    void NNativeAssembler::markDirty(long long address) {
+        long long page = address >> NERVI_TRACKED_PAGE_SHIFT;
+        this->emit({0x80, 0x8E});
+        this->emit32(std::int32_t(page >> 3));
+        this->emit({(unsigned char) (1 << (page & 7))});
+    }
+
+    // jmp, je or jne with a rel32 placeholder
+    void NNativeAssembler::emitBranch(NNativeCondition condition) {
+        if (condition == NATIVE_ALWAYS) {
+            this->emit({0xE9});
+        } else {
+            this->emit({0x0F, (unsigned char) (condition == NATIVE_ZERO ? 0x84 : 0x85)});
+        }
+    }
+
+    /**
+     * \brief Checks if a command has a template
+     * \details The core bitwise commands, the byte move and the jumps have templates. A command is compilable if its cells are proven to be in the memory
+     * and are addressable by a 32-bit displacement
+     * \param command The decoded command
+     * \param memorySize The size of the memory of the machine
+     * \return True if the command can be compiled
+     */
+    bool NNativeAssembler::isCompilable(const NDecodedCommand& command, long long memorySize) {
+        auto proven = [memorySize](long long address) {
+            return address >= 0 && address < memorySize && address <= std::numeric_limits<std::int32_t>::max();
+        };
+        if (command.label <= CORE_MOVE) {
+            return proven(command.first) && (command.label == CORE_NOT || proven(command.second));
+        }
+        if (command.label >= NERVI_FLOW_LABEL + FLOW_JUMP && command.label <= NERVI_FLOW_LABEL + FLOW_DECREMENT_JUMP_IF_NOT_ZERO) {
+            return command.label == NERVI_FLOW_LABEL + FLOW_JUMP || proven(command.first);
+        }
+        return false;
+    }
+
+    /**
+     * \brief Returns the condition a jump is taken on after its template
+     * \param command The decoded jump (jmp, jz, jnz or djnz)
+     * \return The condition of the branch to the target of the jump
+     */
+    NNativeCondition NNativeAssembler::takenCondition(const NDecodedCommand& command) {
+        return command.label == NERVI_FLOW_LABEL + FLOW_JUMP ? NATIVE_ALWAYS : command.label == NERVI_FLOW_LABEL + FLOW_JUMP_IF_ZERO ? NATIVE_ZERO : NATIVE_NOT_ZERO;
+    }
+
+    /**
+     * \brief Returns the opposite condition
+     * \param condition The condition of a conditional branch
+     * \return The opposite condition
+     */
+    NNativeCondition NNativeAssembler::invert(NNativeCondition condition) {
+        return condition == NATIVE_ZERO ? NATIVE_NOT_ZERO : NATIVE_ZERO;
+    }
+
+    /**
+     * \brief Returns the position of the next emitted instruction
+     * \return The offset in the code
+     */
+    long long NNativeAssembler::getPosition() const {
+        return (long long) this->out.size();
+    }
+
+    /**
+     * \brief Emits the budget check of a command
+     * \details The code exits with the IP of the command if the budget is spent, otherwise takes the command from the budget:
+     * test rdx, rdx; jz exit; dec rdx
+     * \param ip The index of the command
+     */
+    void NNativeAssembler::checkBudget(long long ip) {
+        this->emit({0x48, 0x85, 0xD2});
+        this->emitBranch(NATIVE_ZERO);
+        this->exits.emplace_back(this->getPosition(), ip);
+        this->emit32(0);
+        this->emit({0x48, 0xFF, 0xCA});
+    }
+
+    /**
+     * \brief Emits the template of a command
+     * \details A bitwise command is executed, a conditional jump only tests its cell (djnz decrements it first), the branch is emitted separately
+     * \param command The decoded command, which must be compilable
+     */
+    void NNativeAssembler::command(const NDecodedCommand& command) {
+        long long first = command.first, second = command.second;
+        switch (command.label) {
+            case CORE_AND: case CORE_OR: case CORE_XOR: // mov al, [second]; and/or/xor [first], al
+                this->cell(0x8A, 0, second);
+                this->cell(command.label == CORE_AND ? 0x20 : command.label == CORE_OR ? 0x08 : 0x30, 0, first);
+                break;
+            case CORE_MOVE: // mov al, [second]; mov [first], al
+                this->cell(0x8A, 0, second);
+                this->cell(0x88, 0, first);
+                break;
+            case CORE_NOT: // not byte [first]
+                this->cell(0xF6, 2, first);
+                break;
+            case CORE_IMP:
+                if (first == second) { // x imp x is ~x
+                    this->cell(0xF6, 2, first);
+                    break;
+                } // mov al, [first]; not al; or al, [second]; mov [first], al
+                this->cell(0x8A, 0, first);
+                this->emit({0xF6, 0xD0});
+                this->cell(0x0A, 0, second);
+                this->cell(0x88, 0, first);
+                break;
+            case CORE_EQV: case CORE_NAND: case CORE_NOR: // mov al, [first]; xor/and/or al, [second]; not al; mov [first], al
+                this->cell(0x8A, 0, first);
+                this->cell(command.label == CORE_EQV ? 0x32 : command.label == CORE_NAND ? 0x22 : 0x0A, 0, second);
+                this->emit({0xF6, 0xD0});
+                this->cell(0x88, 0, first);
+                break;
+            case NERVI_FLOW_LABEL + FLOW_JUMP_IF_ZERO: case NERVI_FLOW_LABEL + FLOW_JUMP_IF_NOT_ZERO: // cmp byte [first], 0
+                this->cell(0x80, 7, first);
+                this->emit({0x00});
+                return;
+            case NERVI_FLOW_LABEL + FLOW_DECREMENT_JUMP_IF_NOT_ZERO: // the page is marked first, because or changes the flags; dec byte [first]
+                this->markDirty(first);
+                this->cell(0xFE, 1, first);
+                return;
+            default:
+                return;
+        }
+        this->markDirty(first);
+    }
+
+    /**
+     * \brief Emits a branch to a command
+     * \param condition The condition of the branch
+     * \param ip The index of the command
+     */
+    void NNativeAssembler::branch(NNativeCondition condition, long long ip) {
+        this->emitBranch(condition);
+        this->branches.emplace_back(this->getPosition(), ip);
+        this->emit32(0);
+    }
+
+    /**
+     * \brief Emits a branch to a position of the code
+     * \param condition The condition of the branch
+     * \param position The offset of the destination in the code
+     */
+    void NNativeAssembler::branchTo(NNativeCondition condition, long long position) {
+        this->emitBranch(condition);
+        this->emit32(std::int32_t(position - (this->getPosition() + 4)));
+    }
+
+    /**
+     * \brief Resolves the branches and maps the code to executable memory
+     * \details The exits are: mov [rcx], rdx; mov rax, ip; ret
+     * \param resolve The function that returns the offset of the code of a command by its index, or a negative value if it has none
+     * \return The block of native code, which is empty if the memory cannot be mapped
+     */
+    template<typename F>
+    NNativeCode NNativeAssembler::finish(F resolve) {
+        std::map<long long, long long> stubs;
+        auto stub = [this, &stubs](long long ip) {
+            auto iterator = stubs.find(ip);
+            if (iterator == stubs.end()) {
+                iterator = stubs.emplace(ip, this->getPosition()).first;
+                this->emit({0x48, 0x89, 0x11, 0x48, 0xB8});
+                for (int byte = 0; byte < 8; byte++) {
+                    this->out.push_back((unsigned char) ((unsigned long long) ip >> (8 * byte)));
+                }
+                this->emit({0xC3});
+            }
+            return iterator->second;
+        };
+        auto patch = [this](long long offset, long long destination) {
+            std::int32_t relative = std::int32_t(destination - (offset + 4));
+            memcpy(this->out.data() + offset, &relative, 4);
+        };
+        for (auto& [offset, ip] : this->branches) {
+            long long destination = resolve(ip);
+            patch(offset, destination >= 0 ? destination : stub(ip));
+        }
+        for (auto& [offset, ip] : this->exits) {
+            patch(offset, stub(ip));
+        }
+        void* memory = mmap(nullptr, this->out.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return NNativeCode();
+        }
+        memcpy(memory, this->out.data(), this->out.size());
+        if (mprotect(memory, this->out.size(), PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, this->out.size());
+            return NNativeCode();
+        }
+        return NNativeCode(static_cast<char*>(memory), (long long) this->out.size(), this->extent);
+    }
+#endif
+
+    /**
+     * \brief A class of a program compiled to native code
+     * \details The program is decoded (see NDecodedProgram) and its core bitwise commands (and, or, not, xor, eqv, imp, nand, nor), byte moves and jumps
+     * (jmp, jz, jnz, djnz) are translated to x86-64 code by templates (see NNativeAssembler), one after another, so a jump between compiled
+     * commands is a native branch. A command is compiled only if its cells are proven to be in the machine's memory, the other commands
+     * (the plugin commands as well) run on the interpreter, the native code returns to it before them. The memory base is held in a register,
+     * the writes mark the written pages dirty like the accessors of NMemoryCard do, and every command counts against the budget,
+     * so a run gives the same results as the interpreter:
+     * \code
+     * NerviKernel::NJitProgram compiled(program, storage);
+     * NerviKernel::NVirtualMachine machine(storage);
+     * machine.run(compiled);
+     * \endcode
+     * The native code is entered only while the memory is writable, has no locked cells and is not smaller than at compile time,
+     * otherwise the whole program runs on the interpreter. On other platforms than x86-64 Linux nothing is compiled
+     */
+    class NJitProgram {
+    private:
+        NDecodedProgram decoded;
+        std::vector<long long> entries;
+        NNativeCode code;
+        long long compiledCount;
+        void compile();
+    public:
+        NJitProgram(const std::vector<NCommand>& program, NVirtualMachineStorage& storage);
+        const NDecodedProgram& getDecoded() const;
+        bool runNative(long long& executed, long long budget) const;
+        long long getCompiledCount() const;
+        long long getCodeSize() const;
+    };
+
+    /**
+     * \brief The NJitProgram constructor that compiles a program
+     * \param program The commands of the program
+     * \param storage The machine the program is compiled for
+     * \throw InvalidCommandException If a command of the program is invalid (see NDecodedProgram)
+     */
+    NJitProgram::NJitProgram(const std::vector<NCommand>& program, NVirtualMachineStorage& storage): decoded(program, storage) {
+        this->entries.assign(program.size(), -1);
+        this->compiledCount = 0;
+        this->compile();
+    }
+
+    void NJitProgram::compile() {
+#ifdef NERVI_JIT
+        const NDecodedCommand* commands = this->decoded.getCommands();
+        const long long length = this->decoded.getLength();
+        const long long memorySize = this->decoded.getStorage()->getProgramSize();
+        NNativeAssembler assembler;
+        for (long long index = 0; index < length; index++) {
+            const NDecodedCommand& command = commands[index];
+            if (!NNativeAssembler::isCompilable(command, memorySize)) {
+                continue;
+            }
+            this->entries[index] = assembler.getPosition();
+            this->compiledCount++;
+            assembler.checkBudget(index);
+            assembler.command(command);
+            if (command.label == NERVI_FLOW_LABEL + FLOW_JUMP) {
+                assembler.branch(NATIVE_ALWAYS, command.first);
+                continue;
+            }
+            if (command.label > NERVI_FLOW_LABEL + FLOW_JUMP) {
+                assembler.branch(NNativeAssembler::takenCondition(command), command.second);
+            }
+            // the next command runs on the interpreter or the program ends
+            if (index + 1 == length || !NNativeAssembler::isCompilable(commands[index + 1], memorySize)) {
+                assembler.branch(NATIVE_ALWAYS, index + 1);
+            }
+        }
+        if (this->compiledCount == 0) {
+            return;
+        }
+        this->code = assembler.finish([this, length](long long ip) {
+            return ip >= 0 && ip < length ? this->entries[ip] : -1;
+        });
+        if (this->code.isEmpty()) {
+            this->entries.assign(length, -1);
+            this->compiledCount = 0;
+        }
+#endif
+    }
+
+    /**
+     * \brief Returns the decoded program run by the interpreter
+     * \return The decoded program
+     */
+    const NDecodedProgram& NJitProgram::getDecoded() const {
+        return this->decoded;
+    }
+
+    /**
+     * \brief Runs the native code of the command at the IP
+     * \details Does nothing if the command has no native code or the memory of the machine does not allow entering it (see NNativeCode::enter)
+     * \param executed The amount of executed commands, increased by the amount executed by the native code
+     * \param budget The maximal amount of commands to execute
+     * \return True if the native code has run
+     */
+    bool NJitProgram::runNative(long long& executed, long long budget) const {
+        NVirtualMachineStorage* storage = this->decoded.getStorage();
+        long long ip = storage->getIP();
+        if (ip < 0 || ip >= (long long) this->entries.size() || this->entries[ip] < 0) {
+            return false;
+        }
+        return this->code.enter(storage, this->entries[ip], executed, budget);
+    }
+
+    /**
+     * \brief Returns the amount of commands that have native code
+     * \return The amount of compiled commands
+     */
+    long long NJitProgram::getCompiledCount() const {
+        return this->compiledCount;
+    }
+
+    /**
+     * \brief Returns the size of the native code
+     * \return The size in bytes
+     */
+    long long NJitProgram::getCodeSize() const {
+        return this->code.getSize();
+    }
+}
+
+#endif
@@ -0,0 +1,610 @@
+/**
+ * \file nmachine.h
+ * \brief Contains the definition of the class NVirtualMachine
+ * \details Contains the definition of the interpreter that runs NCommand programs on a NVirtualMachineStorage and the following documentation
+ */
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <kernel/command/ncommand.h>
+#include <kernel/command/ncommandlist.h>
+#include <kernel/storage/nmachinememory.h>
+#include <kernel/machine/nprogram.h>
+#include <kernel/machine/nbytecode.h>
+#include <kernel/machine/njit.h>
+#include <kernel/machine/ntrace.h>
+#include <kernel/machine/nblock.h>
+#include <kernel/machine/npeephole.h>
+
+#if defined(NERVI_THREADED_DISPATCH) && !defined(__GNUC__)
+#undef NERVI_THREADED_DISPATCH
+#endif
+
+#ifndef KERNEL_MACHINE_NMACHINE
+#define KERNEL_MACHINE_NMACHINE
+
+namespace NerviKernel {
+
+    /**
+     * \brief The reasons a run of a program stops for
+     */
+    enum NRunStatus {
+        RUN_FINISHED, /// The IP has left the program
+        RUN_HALTED, /// A command has returned COMMAND_HALT
+        RUN_BUDGET_EXHAUSTED, /// The instruction budget has been spent, the run can be continued by another call
+        RUN_FAULT, /// A command has returned an error status (see NRunResult::commandStatus)
+        RUN_INVALID_COMMAND /// The IP points to a command of an unknown plugin or with an unknown index
+    };
+
+    /**
+     * \brief The passes NVirtualMachine::load runs on a program before decoding it
+     */
+    enum NLoadOption {
+        LOAD_AS_IS, /// The program is decoded as it is
+        LOAD_PEEPHOLE /// The redundant commands are removed first (see NerviPeephole::peephole)
+    };
+
+    /**
+     * \brief A structure to represent the result of a run
+     * \details Stores the reason the run has stopped for, the amount of executed commands and the status of the last executed command
+     */
+    struct NRunResult {
+        NRunStatus status;
+        long long executed;
+        int commandStatus;
+    };
+
+    /**
+     * \brief A class of the interpreter of Nervi programs
+     * \details The interpreter runs a program (a vector of NCommand) on a machine storage it does not own. Every step fetches the command
+     * at the IP, moves the IP to the next command and calls the handler of the command from NerviPlugins with the addresses of its arguments,
+     * so the flow commands only have to jump. A run ends when the IP leaves the program, when a command stops it or when the instruction
+     * budget is spent, the state stays in the storage, so the run can be continued:
+     * \code
+     * NerviKernel::NVirtualMachineStorage storage(65536);
+     * NerviKernel::NVirtualMachine machine(storage);
+     * NerviKernel::NRunResult result = machine.run(program, 1000000);
+     * \endcode
+     * The core commands whose operands address the attached discs (see NVirtualMachineStorage::attachDisc) work on the cards of these discs,
+     * so programs can read shared ROM cards, the decoded forms of programs address the disc 0 only.
+     * The exceptions of the handlers (e.g. InvalidIndexException) are not caught, the IP points to the command after the faulting one then.
+     * The interpreter has two engines with the same semantics, chosen at build time. By default every step calls the handler through
+     * the plugin table from a single dispatch point. With NERVI_THREADED_DISPATCH defined (GCC and Clang only, the option of the same name in CMake)
+     * the loop is direct-threaded with labels-as-values: the core and flow commands have their own labels that end with their own indirect jump
+     * to the next command, so the branch predictor keeps a history per command, and the other plugins share one label.
+     * A program can also be decoded once by load (see NDecodedProgram), optionally after removing its redundant commands (see NLoadOption),
+     * and then run without looking up the plugins and checking the commands, or run directly off the packed bytecode (see NPackedProgram).
+     * A program compiled by NJitProgram runs on native code where it can, a NTracedProgram compiles its hot loops while it runs. A NBlockProgram runs a basic block at a time
+     */
+    class NVirtualMachine {
+    private:
+        NVirtualMachineStorage* storage;
+        int runOnDiscs(const NCommand& command);
+    public:
+        explicit NVirtualMachine(NVirtualMachineStorage& storage);
+        NRunResult run(const std::vector<NCommand>& program, long long budget = std::numeric_limits<long long>::max());
+        NDecodedProgram load(const std::vector<NCommand>& program);
+        NDecodedProgram load(const std::vector<NCommand>& program, NLoadOption option, NPeepholeResult* passes = nullptr);
+        NDecodedProgram load(const std::vector<NCommand>& program, const NSuperinstructionProfile& profile, long long superinstructions);
+        NRunResult run(const NDecodedProgram& program, long long budget = std::numeric_limits<long long>::max());
+        NRunResult run(const NPackedProgram& program, long long budget = std::numeric_limits<long long>::max());
+        NRunResult run(const NJitProgram& program, long long budget = std::numeric_limits<long long>::max());
+        NRunResult run(NTracedProgram& program, long long budget = std::numeric_limits<long long>::max());
+        NRunResult run(NBlockProgram& program, long long budget = std::numeric_limits<long long>::max());
+        NVirtualMachineStorage& getStorage();
+    };
+
+    /**
+     * \brief The NVirtualMachine constructor
+     * \param storage The storage the programs run on, it must outlive the machine
+     */
+    NVirtualMachine::NVirtualMachine(NVirtualMachineStorage& storage) {
+        this->storage = &storage;
+    }
+
+    /**
+     * \brief Runs a command that has an operand on an attached disc
+     * \details Called by the runs of the commands and of the packed programs instead of the handler when a disc of an operand is not 0
+     * (see NerviDiscCommandsDeclaration). The decoded forms of programs address the disc 0 only and reject such commands when they are built
+     * \param command The command
+     * \return The status of the command
+     * \throw InvalidDiscException If the command is not a core command or a disc is not attached
+     * \throw ReadOnlyMemoryException If the command writes to a read-only disc
+     */
+    int NVirtualMachine::runOnDiscs(const NCommand& command) {
+        if (command.pluginIndex != CORE_PLUGIN) {
+            throw NerviInternalExceptions::InvalidDiscException(fmt::format("Invalid command {} of plugin {}: only the core commands address the discs (discs {} and {} required)",
+                                                                            command.commandIndex, command.pluginIndex, command.fArg.argAddress.discNumber, command.sArg.argAddress.discNumber));
+        }
+        return NerviDiscCommandsDeclaration::coreCommand(this->storage, command.commandIndex, command.fArg.argAddress, command.sArg.argAddress);
+    }
+
+#ifdef NERVI_THREADED_DISPATCH
+    // the labels of the threaded engine in the order of NDecodedCommand::label: the core commands, the flow commands (from NERVI_FLOW_LABEL)
+    // and the label shared by the other plugins, which calls the handler set by the dispatch
+#define NERVI_THREADED_COMMANDS(X) \
+    X(coreAnd, NerviCoreCommandsDeclaration::byteAnd) \
+    X(coreOr, NerviCoreCommandsDeclaration::byteOr) \
+    X(coreNot, NerviCoreCommandsDeclaration::byteNot) \
+    X(coreXor, NerviCoreCommandsDeclaration::byteXor) \
+    X(coreEqv, NerviCoreCommandsDeclaration::byteEqv) \
+    X(coreImp, NerviCoreCommandsDeclaration::byteImp) \
+    X(coreNand, NerviCoreCommandsDeclaration::byteNand) \
+    X(coreNor, NerviCoreCommandsDeclaration::byteNor) \
+    X(coreMove, NerviCoreCommandsDeclaration::byteMove) \
+    X(coreWordMove, NerviCoreCommandsDeclaration::wordMove) \
+    X(coreDwordMove, NerviCoreCommandsDeclaration::dwordMove) \
+    X(coreQwordMove, NerviCoreCommandsDeclaration::qwordMove) \
+    X(flowJump, NerviFlowCommandsDeclaration::jump) \
+    X(flowJumpIfZero, NerviFlowCommandsDeclaration::jumpIfZero) \
+    X(flowJumpIfNotZero, NerviFlowCommandsDeclaration::jumpIfNotZero) \
+    X(flowDecrementJumpIfNotZero, NerviFlowCommandsDeclaration::decrementJumpIfNotZero) \
+    X(flowCall, NerviFlowCommandsDeclaration::call) \
+    X(flowRet, NerviFlowCommandsDeclaration::ret) \
+    X(flowHalt, NerviFlowCommandsDeclaration::halt) \
+    X(plugin, handler)
+    // the labels of the unchecked byte core commands of a verified program, from NERVI_UNCHECKED_LABEL (after the superinstruction label)
+#define NERVI_UNCHECKED_COMMANDS(X) \
+    X(uncheckedAnd, NerviUncheckedCoreCommandsDeclaration::byteAnd) \
+    X(uncheckedOr, NerviUncheckedCoreCommandsDeclaration::byteOr) \
+    X(uncheckedNot, NerviUncheckedCoreCommandsDeclaration::byteNot) \
+    X(uncheckedXor, NerviUncheckedCoreCommandsDeclaration::byteXor) \
+    X(uncheckedEqv, NerviUncheckedCoreCommandsDeclaration::byteEqv) \
+    X(uncheckedImp, NerviUncheckedCoreCommandsDeclaration::byteImp) \
+    X(uncheckedNand, NerviUncheckedCoreCommandsDeclaration::byteNand) \
+    X(uncheckedNor, NerviUncheckedCoreCommandsDeclaration::byteNor) \
+    X(uncheckedMove, NerviUncheckedCoreCommandsDeclaration::byteMove)
+#define NERVI_LABEL_ADDRESS(label, function) &&label,
+    // every label ends with its own copy of the dispatch, which is the point of the threaded engine
+#define NERVI_THREADED_COMMAND(label, function) \
+    label: \
+        status = function(storage, first, second); \
+        if (status != COMMAND_OK) goto stopped; \
+        NERVI_DISPATCH();
+#endif
+
+    /**
+     * \brief Runs a program from the current IP
+     * \param program The commands of the program, the IP is the index of a command
+     * \param budget The maximal amount of commands to execute
+     * \return The reason the run has stopped for and the amount of executed commands
+     */
+    NRunResult NVirtualMachine::run(const std::vector<NCommand>& program, long long budget) {
+        NVirtualMachineStorage* storage = this->storage;
+        const long long length = (long long) program.size();
+        long long executed = 0;
+#ifdef NERVI_THREADED_DISPATCH
+        static const void* const labels[] = {NERVI_THREADED_COMMANDS(NERVI_LABEL_ADDRESS)};
+        const NCommand* command;
+        NCommandHandler handler = nullptr;
+        long long first, second;
+        int status;
+
+#define NERVI_DISPATCH() \
+        do { \
+            if (executed >= budget) goto budgetExhausted; \
+            long long ip = storage->getIP(); \
+            if (ip < 0 || ip >= length) goto finished; \
+            command = &program[ip]; \
+            if ((unsigned) command->pluginIndex >= std::size(NerviPlugins) || (unsigned) command->commandIndex >= (unsigned) NerviPlugins[command->pluginIndex].commandCount) goto invalidCommand; \
+            storage->jumpNext(); \
+            executed++; \
+            first = command->fArg.argAddress.address; \
+            second = command->sArg.argAddress.address; \
+            if ((command->fArg.argAddress.discNumber | command->sArg.argAddress.discNumber) != 0) goto discs; \
+            if (command->pluginIndex == CORE_PLUGIN) goto *labels[command->commandIndex]; \
+            if (command->pluginIndex == FLOW_PLUGIN) goto *labels[NERVI_FLOW_LABEL + command->commandIndex]; \
+            handler = NerviPlugins[command->pluginIndex].commands[command->commandIndex]; \
+            goto plugin; \
+        } while (false)
+
+        NERVI_DISPATCH();
+        NERVI_THREADED_COMMANDS(NERVI_THREADED_COMMAND)
+    discs:
+        status = this->runOnDiscs(*command);
+        if (status != COMMAND_OK) goto stopped;
+        NERVI_DISPATCH();
+#undef NERVI_DISPATCH
+
+    stopped:
+        return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+    finished:
+        return {RUN_FINISHED, executed, COMMAND_OK};
+    invalidCommand:
+        return {RUN_INVALID_COMMAND, executed, COMMAND_OK};
+    budgetExhausted:
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+#else
+        while (executed < budget) {
+            long long ip = storage->getIP();
+            if (ip < 0 || ip >= length) {
+                return {RUN_FINISHED, executed, COMMAND_OK};
+            }
+            const NCommand& command = program[ip];
+            if ((unsigned) command.pluginIndex >= std::size(NerviPlugins) || (unsigned) command.commandIndex >= (unsigned) NerviPlugins[command.pluginIndex].commandCount) {
+                return {RUN_INVALID_COMMAND, executed, COMMAND_OK};
+            }
+            storage->jumpNext();
+            int status = (command.fArg.argAddress.discNumber | command.sArg.argAddress.discNumber) != 0 ? this->runOnDiscs(command) :
+                         NerviPlugins[command.pluginIndex].commands[command.commandIndex](storage, command.fArg.argAddress.address, command.sArg.argAddress.address);
+            executed++;
+            if (status != COMMAND_OK) {
+                return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+            }
+        }
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+#endif
+    }
+
+    /**
+     * \brief Decodes a program for the machine
+     * \param program The commands of the program
+     * \return The decoded program
+     * \throw InvalidCommandException If a command of the program is invalid (see NDecodedProgram)
+     */
+    NDecodedProgram NVirtualMachine::load(const std::vector<NCommand>& program) {
+        return NDecodedProgram(program, *this->storage);
+    }
+
+    /**
+     * \brief Decodes a program for the machine after running the passes of an option
+     * \details With LOAD_PEEPHOLE the decoded program is the optimized one, so its IPs are the indexes of the optimized commands: the IP 0
+     * stays 0, the other indexes are mapped by the remap of the pass, which is stored into passes if it is given. The peephole pass assumes
+     * the commands do not fault
+     * \param program The commands of the program
+     * \param option The passes to run
+     * \param passes The result of the passes if not null: the decoded commands, the new index of every command and the amount of removed
+     * commands (the program itself, the identity map and 0 with LOAD_AS_IS). It is changed only if the program is decoded
+     * \return The decoded program
+     * \throw InvalidCommandException If a command of the program is invalid (see NDecodedProgram)
+     */
+    NDecodedProgram NVirtualMachine::load(const std::vector<NCommand>& program, NLoadOption option, NPeepholeResult* passes) {
+        if (option != LOAD_PEEPHOLE) {
+            NDecodedProgram decoded(program, *this->storage);
+            if (passes != nullptr) {
+                *passes = {program, std::vector<long long>(program.size() + 1), 0};
+                std::iota(passes->remap.begin(), passes->remap.end(), 0ll);
+            }
+            return decoded;
+        }
+        NPeepholeResult result = NerviPeephole::peephole(program);
+        NDecodedProgram decoded(result.program, *this->storage);
+        if (passes != nullptr) {
+            *passes = std::move(result);
+        }
+        return decoded;
+    }
+
+    /**
+     * \brief Decodes a program for the machine and fuses the most frequent command pairs of a profile into superinstructions
+     * \param program The commands of the program
+     * \param profile The frequencies of the command pairs
+     * \param superinstructions The maximal amount of different pairs to fuse
+     * \return The decoded program
+     * \throw InvalidCommandException If a command of the program is invalid (see NDecodedProgram)
+     */
+    NDecodedProgram NVirtualMachine::load(const std::vector<NCommand>& program, const NSuperinstructionProfile& profile, long long superinstructions) {
+        NDecodedProgram decoded(program, *this->storage);
+        decoded.fuse(profile.select(superinstructions));
+        return decoded;
+    }
+
+    /**
+     * \brief Runs a decoded program from the current IP
+     * \details The same as running the original program, but the commands are neither looked up nor checked. A superinstruction counts
+     * as two commands, it is not used when only one command is left in the budget. The byte core commands of a verified program
+     * run with the unchecked accessors (see NDecodedProgram::verify), unless the memory has been shrunk, locked or made read-only since then:
+     * such a run uses the checked handlers of the commands (their labels are the unchecked ones less NERVI_UNCHECKED_LABEL), so the locks
+     * and the bounds are enforced like for a program that is not verified
+     * \param program The program decoded for the machine by load
+     * \param budget The maximal amount of commands to execute
+     * \return The reason the run has stopped for and the amount of executed commands. The status is never RUN_INVALID_COMMAND
+     * \throw InvalidStateException If the program has been decoded for another machine
+     */
+    NRunResult NVirtualMachine::run(const NDecodedProgram& program, long long budget) {
+        NVirtualMachineStorage* storage = this->storage;
+        if (program.getStorage() != storage) {
+            throw NerviInternalExceptions::InvalidStateException("The program has been decoded for another machine");
+        }
+        const bool checked = program.isVerified() && !storage->allowsUnchecked(program.getVerifiedExtent());
+        const NDecodedCommand* commands = program.getCommands();
+        const long long length = program.getLength();
+        long long executed = 0;
+#ifdef NERVI_THREADED_DISPATCH
+        static const void* const uncheckedLabels[] = {NERVI_THREADED_COMMANDS(NERVI_LABEL_ADDRESS) &&fused, NERVI_UNCHECKED_COMMANDS(NERVI_LABEL_ADDRESS)};
+        // the unchecked labels lead to the checked byte core commands when the memory no longer allows the unchecked accessors
+        static const void* const checkedLabels[] = {NERVI_THREADED_COMMANDS(NERVI_LABEL_ADDRESS) &&fused,
+                                                    &&coreAnd, &&coreOr, &&coreNot, &&coreXor, &&coreEqv, &&coreImp, &&coreNand, &&coreNor, &&coreMove};
+        const void* const* labels = checked ? checkedLabels : uncheckedLabels;
+        const NDecodedCommand* command;
+        NCommandHandler handler = nullptr;
+        long long first, second;
+        int status;
+
+#define NERVI_DISPATCH() \
+        do { \
+            if (executed >= budget) goto budgetExhausted; \
+            long long ip = storage->getIP(); \
+            if (ip < 0 || ip >= length) goto finished; \
+            command = &commands[ip]; \
+            storage->jumpNext(); \
+            executed++; \
+            first = command->first; \
+            second = command->second; \
+            handler = command->handler; \
+            goto *labels[command->label]; \
+        } while (false)
+
+        NERVI_DISPATCH();
+        NERVI_THREADED_COMMANDS(NERVI_THREADED_COMMAND)
+    fused:
+        if (executed >= budget) goto plugin;
+        executed++;
+        status = command->superinstruction(storage, command);
+        if (status != COMMAND_OK) goto stopped;
+        NERVI_DISPATCH();
+        NERVI_UNCHECKED_COMMANDS(NERVI_THREADED_COMMAND)
+#undef NERVI_DISPATCH
+
+    stopped:
+        return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+    finished:
+        return {RUN_FINISHED, executed, COMMAND_OK};
+    budgetExhausted:
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+#else
+        while (executed < budget) {
+            long long ip = storage->getIP();
+            if (ip < 0 || ip >= length) {
+                return {RUN_FINISHED, executed, COMMAND_OK};
+            }
+            const NDecodedCommand& command = commands[ip];
+            storage->jumpNext();
+            int status;
+            if (command.superinstruction != nullptr && budget - executed >= 2) {
+                status = command.superinstruction(storage, &command);
+                executed += 2;
+            } else {
+                NCommandHandler handler = checked && command.label >= NERVI_UNCHECKED_LABEL ? NerviCoreCommands[command.label - NERVI_UNCHECKED_LABEL] : command.handler;
+                status = handler(storage, command.first, command.second);
+                executed++;
+            }
+            if (status != COMMAND_OK) {
+                return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+            }
+        }
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+#endif
+    }
+
+    /**
+     * \brief Runs a packed program from the current IP
+     * \details The same as running the original program, the opcodes of the packed program are known to be valid
+     * \param program The program in the packed bytecode
+     * \param budget The maximal amount of commands to execute
+     * \return The reason the run has stopped for and the amount of executed commands. The status is never RUN_INVALID_COMMAND
+     */
+    NRunResult NVirtualMachine::run(const NPackedProgram& program, long long budget) {
+        NVirtualMachineStorage* storage = this->storage;
+        const NPackedCommand* commands = program.getCommands();
+        const NMemoryAddress* wide = program.getWideOperands();
+        const long long length = program.getLength();
+        long long executed = 0;
+#ifdef NERVI_THREADED_DISPATCH
+        static const void* const labels[] = {NERVI_THREADED_COMMANDS(NERVI_LABEL_ADDRESS)};
+        const NPackedCommand* command;
+        NCommandHandler handler = nullptr;
+        long long first, second;
+        int status;
+
+#define NERVI_DISPATCH() \
+        do { \
+            if (executed >= budget) goto budgetExhausted; \
+            long long ip = storage->getIP(); \
+            if (ip < 0 || ip >= length) goto finished; \
+            command = &commands[ip]; \
+            storage->jumpNext(); \
+            executed++; \
+            first = command->modes & PACKED_WIDE_FIRST ? wide[command->first].address : command->first; \
+            second = command->modes & PACKED_WIDE_SECOND ? wide[command->second].address : command->second; \
+            if (command->modes & PACKED_DISCS) goto discs; \
+            if (command->opcode < NERVI_PLUGIN_LABEL) goto *labels[command->opcode]; \
+            handler = NerviOpcodes[command->opcode].handler; \
+            goto plugin; \
+        } while (false)
+
+        NERVI_DISPATCH();
+        NERVI_THREADED_COMMANDS(NERVI_THREADED_COMMAND)
+    discs:
+        status = this->runOnDiscs(program.getCommand(command - commands));
+        if (status != COMMAND_OK) goto stopped;
+        NERVI_DISPATCH();
+#undef NERVI_DISPATCH
+
+    stopped:
+        return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+    finished:
+        return {RUN_FINISHED, executed, COMMAND_OK};
+    budgetExhausted:
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+#else
+        while (executed < budget) {
+            long long ip = storage->getIP();
+            if (ip < 0 || ip >= length) {
+                return {RUN_FINISHED, executed, COMMAND_OK};
+            }
+            const NPackedCommand& command = commands[ip];
+            storage->jumpNext();
+            long long first = command.modes & PACKED_WIDE_FIRST ? wide[command.first].address : command.first;
+            long long second = command.modes & PACKED_WIDE_SECOND ? wide[command.second].address : command.second;
+            int status = command.modes & PACKED_DISCS ? this->runOnDiscs(program.getCommand(ip)) : NerviOpcodes[command.opcode].handler(storage, first, second);
+            executed++;
+            if (status != COMMAND_OK) {
+                return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+            }
+        }
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+#endif
+    }
+
+    /**
+     * \brief Runs a compiled program from the current IP
+     * \details Enters the native code of the command at the IP whenever it has one and interprets the decoded command otherwise
+     * \param program The program compiled for the machine
+     * \param budget The maximal amount of commands to execute
+     * \return The reason the run has stopped for and the amount of executed commands. The status is never RUN_INVALID_COMMAND
+     * \throw InvalidStateException If the program has been compiled for another machine
+     */
+    NRunResult NVirtualMachine::run(const NJitProgram& program, long long budget) {
+        NVirtualMachineStorage* storage = this->storage;
+        if (program.getDecoded().getStorage() != storage) {
+            throw NerviInternalExceptions::InvalidStateException("The program has been compiled for another machine");
+        }
+        const NDecodedCommand* commands = program.getDecoded().getCommands();
+        const long long length = program.getDecoded().getLength();
+        long long executed = 0;
+        while (executed < budget) {
+            if (program.runNative(executed, budget)) {
+                continue;
+            }
+            long long ip = storage->getIP();
+            if (ip < 0 || ip >= length) {
+                return {RUN_FINISHED, executed, COMMAND_OK};
+            }
+            const NDecodedCommand& command = commands[ip];
+            storage->jumpNext();
+            int status = command.handler(storage, command.first, command.second);
+            executed++;
+            if (status != COMMAND_OK) {
+                return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+            }
+        }
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+    }
+
+    /**
+     * \brief Runs a program with the tracing compiler
+     * \details Runs the cached traces where they start and interprets the other commands, which the program observes to record new traces
+     * (see NTracedProgram)
+     * \param program The program
+     * \param budget The maximal amount of commands to execute
+     * \return The result of the run
+     * \throw InvalidStateException If the program has been decoded for another machine
+     */
+    NRunResult NVirtualMachine::run(NTracedProgram& program, long long budget) {
+        NVirtualMachineStorage* storage = this->storage;
+        if (program.getDecoded().getStorage() != storage) {
+            throw NerviInternalExceptions::InvalidStateException("The program has been decoded for another machine");
+        }
+        const NDecodedCommand* commands = program.getDecoded().getCommands();
+        const long long length = program.getDecoded().getLength();
+        long long executed = 0;
+        while (executed < budget) {
+            long long ip = storage->getIP();
+            if (ip < 0 || ip >= length) {
+                return {RUN_FINISHED, executed, COMMAND_OK};
+            }
+            if (program.hasTrace(ip) && program.runTrace(executed, budget)) {
+                continue;
+            }
+            const NDecodedCommand& command = commands[ip];
+            storage->jumpNext();
+            int status = command.handler(storage, command.first, command.second);
+            executed++;
+            if (status != COMMAND_OK) {
+                return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+            }
+            // only a backward jump can start a recording, the other commands are observed only while one goes on
+            long long next = storage->getIP();
+            if (next <= ip || program.isRecording()) {
+                program.observe(ip, next);
+            }
+        }
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+    }
+
+    /**
+     * \brief Runs a program split into basic blocks
+     * \details Runs the straight commands of the block at the IP in one loop and sets the IP after them (or after the one that has faulted
+     * or thrown), then runs the flow command that ends the block like the other runs do. A block runs its resolved commands if the memory
+     * allows the unchecked accessors for the resolved cells at its entry, otherwise its decoded commands (see NBlockProgram).
+     * The entered blocks are counted locally and added to the statistics of the program when the run ends
+     * \param program The program
+     * \param budget The maximal amount of commands to execute
+     * \return The result of the run
+     * \throw InvalidStateException If the program has been decoded for another machine
+     */
+    NRunResult NVirtualMachine::run(NBlockProgram& program, long long budget) {
+        NVirtualMachineStorage* storage = this->storage;
+        if (program.getDecoded().getStorage() != storage) {
+            throw NerviInternalExceptions::InvalidStateException("The program has been decoded for another machine");
+        }
+        const NDecodedCommand* commands = program.getDecoded().getCommands();
+        const NDecodedCommand* resolved = program.getResolvedCommands();
+        const long long length = program.getDecoded().getLength();
+        long long executed = 0, entered = 0;
+        while (executed < budget) {
+            long long ip = storage->getIP();
+            if (ip < 0 || ip >= length) {
+                program.entered += entered;
+                return {RUN_FINISHED, executed, COMMAND_OK};
+            }
+            entered++;
+            const long long straight = std::min(program.getStraightLength(ip), budget - executed);
+            const NDecodedCommand* block = (storage->allowsUnchecked(program.getResolvedExtent()) ? resolved : commands) + ip;
+            long long index = 0;
+            int status = COMMAND_OK;
+            try {
+                for (; index < straight; index++) {
+                    status = block[index].handler(storage, block[index].first, block[index].second);
+                    if (status != COMMAND_OK) {
+                        break;
+                    }
+                }
+            } catch (...) {
+                storage->jump(ip + index + 1);
+                program.entered += entered;
+                throw;
+            }
+            if (status != COMMAND_OK) {
+                storage->jump(ip + index + 1);
+                program.entered += entered;
+                return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed + index + 1, status};
+            }
+            executed += straight;
+            const long long end = ip + straight;
+            storage->jump(end);
+            if (end < length && executed < budget && block[straight].label >= NERVI_FLOW_LABEL && block[straight].label < NERVI_PLUGIN_LABEL) {
+                const NDecodedCommand& command = block[straight];
+                storage->jumpNext();
+                status = command.handler(storage, command.first, command.second);
+                executed++;
+                if (status != COMMAND_OK) {
+                    program.entered += entered;
+                    return {status == COMMAND_HALT ? RUN_HALTED : RUN_FAULT, executed, status};
+                }
+            }
+        }
+        program.entered += entered;
+        return {RUN_BUDGET_EXHAUSTED, executed, COMMAND_OK};
+    }
+
+    /**
+     * \brief Returns the storage the programs run on
+     * \return The storage passed to the constructor
+     */
+    NVirtualMachineStorage& NVirtualMachine::getStorage() {
+        return *this->storage;
+    }
+}
+
+#ifdef NERVI_THREADED_DISPATCH
+#undef NERVI_THREADED_COMMAND
+#undef NERVI_LABEL_ADDRESS
+#undef NERVI_THREADED_COMMANDS
+#undef NERVI_UNCHECKED_COMMANDS
+#endif
+
+#endif
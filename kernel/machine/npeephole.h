@@ -0,0 +1,129 @@
+/**
+ * \file npeephole.h
+ * \brief Contains the peephole optimizer of Nervi programs
+ * \details Contains the definition of the pass that removes redundant commands from NCommand programs and the following documentation
+ */
+
+#include <vector>
+#include <algorithm>
+#include <kernel/command/ncommand.h>
+#include <kernel/command/ncommandlist.h>
+
+#ifndef KERNEL_MACHINE_NPEEPHOLE
+#define KERNEL_MACHINE_NPEEPHOLE
+
+namespace NerviKernel {
+
+    /**
+     * \brief A structure to represent the result of the peephole optimizer
+     * \details Stores the optimized program, the new index of every original command (the index of the next kept command for a removed one,
+     * the length of the optimized program for the end of the original one) and the amount of removed commands
+     */
+    struct NPeepholeResult {
+        std::vector<NCommand> program;
+        std::vector<long long> remap;
+        long long removed;
+    };
+
+    namespace NerviPeephole {
+        bool sameCell(const NCommandArgument& first, const NCommandArgument& second) {
+            return first.argAddress.discNumber == second.argAddress.discNumber && first.argAddress.address == second.argAddress.address;
+        }
+
+        bool isCore(const NCommand& command, int commandIndex) {
+            return command.pluginIndex == CORE_PLUGIN && command.commandIndex == commandIndex;
+        }
+
+        bool isValid(const NCommand& command) {
+            return (unsigned) command.pluginIndex < std::size(NerviPlugins) && (unsigned) command.commandIndex < (unsigned) NerviPlugins[command.pluginIndex].commandCount;
+        }
+
+        // and x,x, or x,x, mov x,x (of any width) and the jump to the next command change nothing
+        bool isNoOperation(const NCommand& command, long long index) {
+            if (command.pluginIndex == CORE_PLUGIN && (command.commandIndex == CORE_AND || command.commandIndex == CORE_OR ||
+                (command.commandIndex >= CORE_MOVE && command.commandIndex <= CORE_QWORD_MOVE))) {
+                return sameCell(command.fArg, command.sArg);
+            }
+            return command.pluginIndex == FLOW_PLUGIN && command.commandIndex == FLOW_JUMP && command.fArg.argAddress.address == index + 1;
+        }
+
+        /**
+         * \brief Removes the redundant commands of a program
+         * \details The pass folds the pairs of adjacent commands:
+         * - not x followed by not x is removed;
+         * - xor x,x (which clears x) followed by or x,y becomes mov x,y;
+         *
+         * and deletes the commands that change nothing: and x,x, or x,x, mov x,x of any width and jmp to the next command. Removing a command
+         * may make a new pair adjacent, which is folded as well. The second command of a pair is never folded if it is a jump target, because the jump
+         * would skip the first one. The jump targets of the flow commands are remapped to the new indexes of the commands.
+         * The pass assumes the commands of the program do not fault, e.g. a removed not of a write-locked cell does not throw any longer
+         * \param program The commands of the program
+         * \return The optimized program, the map of the indexes and the amount of removed commands
+         */
+        NPeepholeResult peephole(const std::vector<NCommand>& program) {
+            const long long length = (long long) program.size();
+            // targets[i] is the amount of jump targets among the commands before i
+            std::vector<long long> targets(length + 2, 0);
+            for (const NCommand& command : program) {
+                if (!isValid(command)) {
+                    continue;
+                }
+                const NCommandSignature& signature = NerviPlugins[command.pluginIndex].signatures[command.commandIndex];
+                for (auto [operand, argument] : {std::make_pair(signature.first, command.fArg), std::make_pair(signature.second, command.sArg)}) {
+                    if (operand.kind == OPERAND_TARGET && argument.argAddress.address >= 0 && argument.argAddress.address <= length) {
+                        targets[argument.argAddress.address + 1]++;
+                    }
+                }
+            }
+            for (long long index = 1; index < length + 2; index++) {
+                targets[index] += targets[index - 1];
+            }
+
+            std::vector<NCommand> kept;
+            std::vector<long long> origins;
+            for (long long index = 0; index < length; index++) {
+                const NCommand& command = program[index];
+                if (isNoOperation(command, index)) {
+                    continue;
+                }
+                // the previous kept command is adjacent if none of the commands after it up to this one is a jump target
+                if (!kept.empty() && targets[index + 1] == targets[origins.back() + 1]) {
+                    NCommand& previous = kept.back();
+                    if (isCore(previous, CORE_NOT) && isCore(command, CORE_NOT) && sameCell(previous.fArg, command.fArg)) {
+                        kept.pop_back();
+                        origins.pop_back();
+                        continue;
+                    }
+                    if (isCore(previous, CORE_XOR) && sameCell(previous.fArg, previous.sArg) && isCore(command, CORE_OR) && sameCell(previous.fArg, command.fArg)) {
+                        previous = command;
+                        previous.commandIndex = CORE_MOVE;
+                        continue;
+                    }
+                }
+                kept.push_back(command);
+                origins.push_back(index);
+            }
+
+            NPeepholeResult result{{}, std::vector<long long>(length + 1), length - (long long) kept.size()};
+            for (long long index = 0; index <= length; index++) {
+                result.remap[index] = std::lower_bound(origins.begin(), origins.end(), index) - origins.begin();
+            }
+            for (NCommand& command : kept) {
+                if (!isValid(command)) {
+                    continue;
+                }
+                const NCommandSignature& signature = NerviPlugins[command.pluginIndex].signatures[command.commandIndex];
+                for (auto [operand, argument] : {std::make_pair(signature.first, &command.fArg), std::make_pair(signature.second, &command.sArg)}) {
+                    long long& target = argument->argAddress.address;
+                    if (operand.kind == OPERAND_TARGET && target >= 0) {
+                        target = target <= length ? result.remap[target] : (long long) kept.size();
+                    }
+                }
+            }
+            result.program = std::move(kept);
+            return result;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,431 @@
+/**
+ * \file nprogram.h
+ * \brief Contains the definition of the class NDecodedProgram
+ * \details Contains the definition of the pre-decoded form of Nervi programs and the following documentation
+ */
+
+#include <map>
+#include <array>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <kernel/command/ncommand.h>
+#include <kernel/command/ncommandlist.h>
+#include <kernel/storage/nmachinememory.h>
+
+#ifndef KERNEL_MACHINE_NPROGRAM
+#define KERNEL_MACHINE_NPROGRAM
+
+namespace NerviKernel {
+
+    /**
+     * \brief The index of the first flow command label of the threaded engine (see NDecodedCommand::label)
+     */
+    constexpr int NERVI_FLOW_LABEL = 12;
+
+    /**
+     * \brief The index of the label of the threaded engine shared by the commands of the other plugins
+     */
+    constexpr int NERVI_PLUGIN_LABEL = NERVI_FLOW_LABEL + 7;
+
+    /**
+     * \brief The label of the threaded engine for the commands that start a superinstruction
+     */
+    constexpr int NERVI_SUPERINSTRUCTION_LABEL = NERVI_PLUGIN_LABEL + 1;
+
+    /**
+     * \brief The index of the first label of the threaded engine for the unchecked byte core commands of a verified program
+     */
+    constexpr int NERVI_UNCHECKED_LABEL = NERVI_SUPERINSTRUCTION_LABEL + 1;
+
+    struct NDecodedCommand;
+
+    /**
+     * \brief The type of a superinstruction, i.e. a handler of two adjacent commands
+     * \details A superinstruction is called with the first of the commands after the IP has been moved to the second one
+     */
+    typedef int (*NSuperinstruction) (NVirtualMachineStorage*, const NDecodedCommand*);
+
+    /**
+     * \brief A structure to represent a decoded command
+     * \details Stores the resolved handler of a command, the addresses of its arguments and the label of the command in the threaded engine
+     * of NVirtualMachine, so running the command needs no lookups. A command fused with the next one also stores their superinstruction,
+     * the next command keeps its own record, so the jumps to it still work
+     */
+    struct NDecodedCommand {
+        NCommandHandler handler;
+        long long first, second;
+        int label;
+        NSuperinstruction superinstruction;
+    };
+
+    /**
+     * \brief Returns the handler of a core or flow command by its label
+     * \param label The label of the command (less than NERVI_PLUGIN_LABEL)
+     * \return The handler of the command
+     */
+    constexpr NCommandHandler labelHandler(int label) {
+        return label < NERVI_FLOW_LABEL ? NerviCoreCommands[label] : NerviFlowCommands[label - NERVI_FLOW_LABEL];
+    }
+
+    /**
+     * \brief The superinstruction of two commands
+     * \details Both handlers are template arguments, so the compiler joins their bodies into one function. The first command must always return
+     * COMMAND_OK (the core commands do), the second one may be any core or flow command
+     */
+    template<NCommandHandler First, NCommandHandler Second>
+    int superinstruction(NVirtualMachineStorage* storage, const NDecodedCommand* command) {
+        First(storage, command[0].first, command[0].second);
+        storage->jumpNext();
+        return Second(storage, command[1].first, command[1].second);
+    }
+
+    template<int First, int... Second>
+    constexpr std::array<NSuperinstruction, sizeof...(Second)> superinstructionRow(std::integer_sequence<int, Second...>) {
+        return {superinstruction<NerviCoreCommands[First], labelHandler(Second)>...};
+    }
+
+    template<int... First>
+    constexpr std::array<std::array<NSuperinstruction, NERVI_PLUGIN_LABEL>, sizeof...(First)> superinstructionTable(std::integer_sequence<int, First...>) {
+        return {superinstructionRow<First>(std::make_integer_sequence<int, NERVI_PLUGIN_LABEL>())...};
+    }
+
+    /**
+     * \brief The generated superinstructions, indexed by the labels of a core command and the core or flow command that follows it
+     */
+    constexpr auto NerviSuperinstructions = superinstructionTable(std::make_integer_sequence<int, NERVI_FLOW_LABEL>());
+
+    /**
+     * \brief A class of the frequencies of adjacent command pairs
+     * \details Counts the pairs of a core command and the core or flow command that follows it, i.e. the pairs that have a superinstruction.
+     * The counts come from the text of programs or from profile data gathered elsewhere (e.g. the amounts of executions of the pairs),
+     * and select the pairs fused by NDecodedProgram::fuse:
+     * \code
+     * NerviKernel::NSuperinstructionProfile profile;
+     * profile.addProgram(program);
+     * profile.addPair(NerviKernel::CORE_PLUGIN, 8, NerviKernel::FLOW_PLUGIN, 3, 1000000); //mov followed by djnz is hot
+     * NerviKernel::NDecodedProgram decoded = machine.load(program, profile, 16);
+     * \endcode
+     */
+    class NSuperinstructionProfile {
+    private:
+        std::map<std::pair<int, int>, long long> counts;
+        static int fusableLabel(int pluginIndex, int commandIndex);
+    public:
+        void addPair(int firstPlugin, int firstCommand, int secondPlugin, int secondCommand, long long count);
+        void addProgram(const std::vector<NCommand>& program, long long weight = 1);
+        std::vector<std::pair<int, int>> select(long long limit) const;
+    };
+
+    int NSuperinstructionProfile::fusableLabel(int pluginIndex, int commandIndex) {
+        if (pluginIndex == CORE_PLUGIN && commandIndex >= 0 && commandIndex < NERVI_FLOW_LABEL) {
+            return commandIndex;
+        }
+        if (pluginIndex == FLOW_PLUGIN && commandIndex >= 0 && commandIndex < NERVI_PLUGIN_LABEL - NERVI_FLOW_LABEL) {
+            return NERVI_FLOW_LABEL + commandIndex;
+        }
+        return -1;
+    }
+
+    /**
+     * \brief Adds the count of a command pair
+     * \details The pairs without a superinstruction (the first command is not a core one, or the second one is neither a core nor a flow one) are ignored
+     * \param firstPlugin The plugin of the first command
+     * \param firstCommand The index of the first command in its plugin
+     * \param secondPlugin The plugin of the second command
+     * \param secondCommand The index of the second command in its plugin
+     * \param count The amount to add
+     */
+    void NSuperinstructionProfile::addPair(int firstPlugin, int firstCommand, int secondPlugin, int secondCommand, long long count) {
+        int first = fusableLabel(firstPlugin, firstCommand), second = fusableLabel(secondPlugin, secondCommand);
+        if (first >= 0 && first < NERVI_FLOW_LABEL && second >= 0) {
+            this->counts[{first, second}] += count;
+        }
+    }
+
+    /**
+     * \brief Counts the adjacent command pairs of a program
+     * \param program The commands of the program
+     * \param weight The amount added for every occurrence of a pair
+     */
+    void NSuperinstructionProfile::addProgram(const std::vector<NCommand>& program, long long weight) {
+        for (std::size_t index = 1; index < program.size(); index++) {
+            this->addPair(program[index - 1].pluginIndex, program[index - 1].commandIndex, program[index].pluginIndex, program[index].commandIndex, weight);
+        }
+    }
+
+    /**
+     * \brief Selects the most frequent pairs
+     * \param limit The maximal amount of pairs to select
+     * \return The labels of the commands of the selected pairs, the most frequent first
+     */
+    std::vector<std::pair<int, int>> NSuperinstructionProfile::select(long long limit) const {
+        std::vector<std::pair<long long, std::pair<int, int>>> ranked;
+        for (auto& entry : this->counts) {
+            if (entry.second > 0) {
+                ranked.emplace_back(-entry.second, entry.first);
+            }
+        }
+        std::sort(ranked.begin(), ranked.end());
+        std::vector<std::pair<int, int>> selected;
+        for (std::size_t index = 0; index < ranked.size() && (long long) index < limit; index++) {
+            selected.push_back(ranked[index].second);
+        }
+        return selected;
+    }
+
+    /**
+     * \brief A class of a program prepared for running on a machine
+     * \details The constructor checks every command of a program once: its plugin and index, and every operand against the signature
+     * of the command (NCommandSignature). The cells must be inside the memory of the programs (NVirtualMachineStorage::getProgramSize,
+     * which excludes the stack region), the register views must exist and have the width of the command,
+     * and the jump targets must be commands of the program or the end of it. The arguments that address another disc
+     * are rejected, because the handlers work on the machine's own memory. Then every command is replaced with a NDecodedCommand.
+     * The IP of the machine is the index of a decoded command, like the index of a NCommand, so the jumps keep their targets:
+     * \code
+     * NerviKernel::NVirtualMachine machine(storage);
+     * NerviKernel::NDecodedProgram decoded = machine.load(program); //throws InvalidCommandException for an invalid program
+     * machine.run(decoded);
+     * \endcode
+     * The handlers still check the cells they address, so a program stays safe if the memory is resized after decoding.
+     * The pass fuse replaces the selected pairs of adjacent commands with superinstructions (see NSuperinstructionProfile).
+     * The pass verify checks the constant cells of the core commands against the memory once more and marks the program verified,
+     * then its byte core commands run with the unchecked accessors (NerviUncheckedCoreCommands). The other commands address cells through
+     * registers and stacks or their plugins, so they keep their checks:
+     * \code
+     * NerviKernel::NDecodedProgram decoded = machine.load(program);
+     * decoded.verify();
+     * machine.run(decoded); //uses the checked handlers if the memory has been shrunk, locked or made read-only since verify
+     * \endcode
+     */
+    class NDecodedProgram {
+    private:
+        std::vector<NDecodedCommand> commands;
+        NVirtualMachineStorage* storage;
+        bool verified;
+        long long extent;
+        static void checkOperand(const NOperand& operand, const NMemoryAddress& address, long long index, long long length, long long memorySize);
+        NDecodedCommand decode(const NCommand& command, long long index, long long length);
+        void unfuse(long long index);
+    public:
+        NDecodedProgram(const std::vector<NCommand>& program, NVirtualMachineStorage& storage);
+        long long fuse(const std::vector<std::pair<int, int>>& pairs);
+        void replace(long long index, const NCommand& command);
+        bool verify();
+        static long long getCellExtent(const NDecodedCommand& command, long long memorySize);
+        bool isVerified() const;
+        long long getVerifiedExtent() const;
+        const NDecodedCommand* getCommands() const;
+        long long getLength() const;
+        NVirtualMachineStorage* getStorage() const;
+    };
+
+    /**
+     * \brief The NDecodedProgram constructor that decodes a program
+     * \param program The commands of the program
+     * \param storage The machine the program is decoded for
+     * \throw InvalidCommandException If a command refers to an unknown plugin or command, or one of its operands is invalid
+     */
+    NDecodedProgram::NDecodedProgram(const std::vector<NCommand>& program, NVirtualMachineStorage& storage) {
+        this->storage = &storage;
+        this->verified = false;
+        this->extent = 0;
+        const long long length = (long long) program.size();
+        this->commands.reserve(program.size());
+        for (long long index = 0; index < length; index++) {
+            this->commands.push_back(this->decode(program[index], index, length));
+        }
+    }
+
+    NDecodedCommand NDecodedProgram::decode(const NCommand& command, long long index, long long length) {
+        if ((unsigned) command.pluginIndex >= std::size(NerviPlugins) || (unsigned) command.commandIndex >= (unsigned) NerviPlugins[command.pluginIndex].commandCount) {
+            throw NerviInternalExceptions::InvalidCommandException(fmt::format("Invalid command {}: unknown command {} of plugin {}", index, command.commandIndex, command.pluginIndex));
+        }
+        const long long memorySize = this->storage->getProgramSize();
+        const NCommandPlugin& plugin = NerviPlugins[command.pluginIndex];
+        const NCommandSignature& signature = plugin.signatures[command.commandIndex];
+        checkOperand(signature.first, command.fArg.argAddress, index, length, memorySize);
+        checkOperand(signature.second, command.sArg.argAddress, index, length, memorySize);
+        int label = command.pluginIndex == CORE_PLUGIN ? command.commandIndex :
+                    command.pluginIndex == FLOW_PLUGIN ? NERVI_FLOW_LABEL + command.commandIndex : NERVI_PLUGIN_LABEL;
+        return {plugin.commands[command.commandIndex], command.fArg.argAddress.address, command.sArg.argAddress.address, label, nullptr};
+    }
+
+    // a fused command is a core one, its label is the index of its handler
+    void NDecodedProgram::unfuse(long long index) {
+        NDecodedCommand& command = this->commands[index];
+        if (command.label == NERVI_SUPERINSTRUCTION_LABEL) {
+            command.label = int(std::find(std::begin(NerviCoreCommands), std::end(NerviCoreCommands), command.handler) - std::begin(NerviCoreCommands));
+            command.superinstruction = nullptr;
+        }
+    }
+
+    /**
+     * \brief Replaces a command of the program
+     * \details The new command is checked like the commands of the program are. The superinstructions of the command and of the previous one are removed
+     * \param index The index of the command
+     * \param command The new command
+     * \throw InvalidIndexException If there is no command with the index
+     * \throw InvalidCommandException If the command is invalid
+     */
+    void NDecodedProgram::replace(long long index, const NCommand& command) {
+        const long long length = this->getLength();
+        if (index < 0 || index >= length) {
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required command index: {} (expected positive and less than {})", index, length));
+        }
+        NDecodedCommand decoded = this->decode(command, index, length);
+        if (index > 0) {
+            this->unfuse(index - 1);
+        }
+        this->commands[index] = decoded;
+    }
+
+    void NDecodedProgram::checkOperand(const NOperand& operand, const NMemoryAddress& address, long long index, long long length, long long memorySize) {
+        if (operand.kind == OPERAND_NONE) {
+            return;
+        }
+        if (address.discNumber != 0) {
+            throw NerviInternalExceptions::InvalidCommandException(fmt::format("Invalid command {}: an argument addresses disc {}, the decoded commands work on the machine's memory (disc 0), run the commands or the packed program instead", index, address.discNumber));
+        }
+        switch (operand.kind) {
+            case OPERAND_CELL:
+                if (address.address < 0 || address.address > memorySize - operand.width) {
+                    throw NerviInternalExceptions::InvalidCommandException(fmt::format("Invalid command {}: the cells {}..{} are out of the memory of {} bytes", index, address.address, address.address + operand.width - 1, memorySize));
+                }
+                break;
+            case OPERAND_VIEW:
+                if (address.address < EAX_EBX || address.address > FCX_EBD || wideRegisterWidth(NWideRegisterNames(address.address)) != operand.width) {
+                    throw NerviInternalExceptions::InvalidCommandException(fmt::format("Invalid command {}: {} is not a {}-bit register view", index, address.address, operand.width * 8));
+                }
+                break;
+            case OPERAND_TARGET:
+                if (address.address < 0 || address.address > length) {
+                    throw NerviInternalExceptions::InvalidCommandException(fmt::format("Invalid command {}: the jump target {} is out of the program of {} commands", index, address.address, length));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    /**
+     * \brief Fuses the pairs of adjacent commands into superinstructions
+     * \details Every command that starts one of the pairs gets the superinstruction of the pair, overlapping pairs are fused as well
+     * \param pairs The labels of the commands of the pairs to fuse (see NSuperinstructionProfile::select)
+     * \return The amount of fused commands
+     */
+    long long NDecodedProgram::fuse(const std::vector<std::pair<int, int>>& pairs) {
+        long long fused = 0;
+        for (std::size_t index = 0; index + 1 < this->commands.size(); index++) {
+            NDecodedCommand& command = this->commands[index];
+            int second = this->commands[index + 1].label;
+            if (command.label >= NERVI_FLOW_LABEL || second >= NERVI_PLUGIN_LABEL || std::find(pairs.begin(), pairs.end(), std::make_pair(command.label, second)) == pairs.end()) {
+                continue;
+            }
+            command.superinstruction = NerviSuperinstructions[command.label][second];
+            command.label = NERVI_SUPERINSTRUCTION_LABEL;
+            fused++;
+        }
+        return fused;
+    }
+
+    /**
+     * \brief Verifies the constant cells of the program against the memory
+     * \details Checks the cells of every core command against the current size of the memory and checks that the memory allows
+     * the unchecked accessors (see NMemoryCard::allowsUnchecked). A program that passes is marked verified and its byte core commands
+     * get the unchecked handlers, otherwise all of them get the checked handlers back. The commands fused by fuse keep the checked handlers.
+     * The pass can be repeated after the memory has changed
+     * \return True if the program is verified
+     */
+    bool NDecodedProgram::verify() {
+        const long long memorySize = this->storage->getProgramSize();
+        long long extent = 0;
+        bool passed = true;
+        for (NDecodedCommand& command : this->commands) {
+            if (command.label >= NERVI_UNCHECKED_LABEL) {
+                command.label -= NERVI_UNCHECKED_LABEL;
+                command.handler = NerviCoreCommands[command.label];
+            }
+            if (command.label >= NERVI_FLOW_LABEL) {
+                continue;
+            }
+            long long end = getCellExtent(command, memorySize);
+            passed = passed && end >= 0;
+            extent = std::max(extent, end);
+        }
+        this->verified = passed && this->storage->allowsUnchecked(extent);
+        this->extent = this->verified ? extent : 0;
+        if (this->verified) {
+            for (NDecodedCommand& command : this->commands) {
+                if (command.label < (int) std::size(NerviUncheckedCoreCommands)) {
+                    command.handler = NerviUncheckedCoreCommands[command.label];
+                    command.label += NERVI_UNCHECKED_LABEL;
+                }
+            }
+        }
+        return this->verified;
+    }
+
+    /**
+     * \brief Returns the end of the cells a core command addresses
+     * \details The check of verify: every cell operand of the command has to be inside the memory of the programs
+     * \param command The decoded core command (its label is less than NERVI_FLOW_LABEL)
+     * \param memorySize The size of the memory of the programs (see NVirtualMachineStorage::getProgramSize)
+     * \return The index after the last addressed cell, -1 if a cell is outside the memory
+     */
+    long long NDecodedProgram::getCellExtent(const NDecodedCommand& command, long long memorySize) {
+        const NCommandSignature& signature = NerviCoreCommandsSignatures[command.label];
+        long long extent = 0;
+        for (auto [operand, address] : {std::make_pair(signature.first, command.first), std::make_pair(signature.second, command.second)}) {
+            if (operand.kind == OPERAND_CELL) {
+                if (address < 0 || address > memorySize - operand.width) {
+                    return -1;
+                }
+                extent = std::max(extent, address + operand.width);
+            }
+        }
+        return extent;
+    }
+
+    /**
+     * \brief Checks if the program has passed verify
+     * \return True if the byte core commands run with the unchecked accessors while the memory allows them
+     */
+    bool NDecodedProgram::isVerified() const {
+        return this->verified;
+    }
+
+    /**
+     * \brief Returns the end of the cells of the core commands of a verified program
+     * \return The extent, 0 if the program is not verified
+     */
+    long long NDecodedProgram::getVerifiedExtent() const {
+        return this->extent;
+    }
+
+    /**
+     * \brief Returns the decoded commands
+     * \return The pointer to the first decoded command
+     */
+    const NDecodedCommand* NDecodedProgram::getCommands() const {
+        return this->commands.data();
+    }
+
+    /**
+     * \brief Returns the amount of commands of the program
+     * \return The amount of commands
+     */
+    long long NDecodedProgram::getLength() const {
+        return (long long) this->commands.size();
+    }
+
+    /**
+     * \brief Returns the machine the program has been decoded for
+     * \return The pointer to the machine storage
+     */
+    NVirtualMachineStorage* NDecodedProgram::getStorage() const {
+        return this->storage;
+    }
+}
+
+#endif
@@ -0,0 +1,289 @@
+/**
+ * \file ntrace.h
+ * \brief Contains the definition of the class NTracedProgram
+ * \details Contains the definition of the tracing compiler of the hot loops of Nervi programs and the following documentation
+ */
+
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+#include <kernel/command/ncommand.h>
+#include <kernel/command/ncommandlist.h>
+#include <kernel/constant/limits.h>
+#include <kernel/machine/nprogram.h>
+#include <kernel/machine/njit.h>
+
+#ifndef KERNEL_MACHINE_NTRACE
+#define KERNEL_MACHINE_NTRACE
+
+namespace NerviKernel {
+
+    /**
+     * \brief A structure to represent a compiled trace
+     * \details Stores the native code of the trace and the indexes of the commands it has been recorded from
+     */
+    struct NTrace {
+        NNativeCode code;
+        std::vector<long long> ips;
+    };
+
+    /**
+     * \brief A class of a program with the hot loops compiled to native code
+     * \details The program runs on the interpreter (see NDecodedProgram), which counts the backward jumps (jmp, jz, jnz, djnz) to every command.
+     * When the count of a command crosses the threshold, the commands executed from it are recorded until the IP comes back to it, and
+     * the recorded trace is compiled by NNativeAssembler to a straight line of code that loops to its start. A conditional jump of the trace
+     * becomes a guard: if it goes the other way than when recorded, the code exits to the interpreter there (a side exit).
+     * The traces are cached by the index of their first command and entered whenever the IP reaches it:
+     * \code
+     * NerviKernel::NTracedProgram traced(program, storage);
+     * NerviKernel::NVirtualMachine machine(storage);
+     * machine.run(traced);
+     * traced.setCommand(5, command); // the traces with the command 5 are dropped
+     * \endcode
+     * A recording is aborted when the IP leaves the expected path (a fault or a run stopped in the middle), when a command has no template
+     * (see NNativeAssembler::isCompilable) or when the trace gets longer than NERVI_MAX_TRACE_LENGTH. The counting of the command starts over
+     * with the doubled threshold then (up to NERVI_MAX_TRACE_BACKOFF times), so a loop that cannot be traced costs less and less recordings,
+     * and a loop that has once taken a side path is traced again later.
+     * Replacing a command by setCommand invalidates the traces that contain it and restarts the counting. The traces are entered on the same
+     * conditions as NJitProgram is, every command of a trace counts against the budget. On other platforms than x86-64 Linux nothing is compiled
+     */
+    class NTracedProgram {
+        NTracedProgram(const NTracedProgram& ntp) = delete;
+        NTracedProgram& operator=(const NTracedProgram& ntp) = delete;
+    private:
+        NDecodedProgram decoded;
+        std::vector<long long> counters;
+        std::vector<int> backoffs;
+        std::vector<const NTrace*> entries;
+        std::unordered_map<long long, NTrace> traces;
+        long long threshold;
+        bool recording;
+        long long entry, expected;
+        std::vector<std::pair<long long, long long>> recorded;
+        long long compiledCount, abortedCount, invalidationCount;
+        void record(long long ip, long long next);
+        void abort();
+        void compile();
+    public:
+        NTracedProgram(const std::vector<NCommand>& program, NVirtualMachineStorage& storage, long long threshold = NERVI_DEFAULT_TRACE_THRESHOLD);
+        const NDecodedProgram& getDecoded() const;
+        bool hasTrace(long long ip) const;
+        bool isRecording() const;
+        bool runTrace(long long& executed, long long budget) const;
+        void observe(long long ip, long long next);
+        void setCommand(long long index, const NCommand& command);
+        long long getTraceCount() const;
+        long long getCompiledCount() const;
+        long long getAbortedCount() const;
+        long long getInvalidationCount() const;
+    };
+
+    /**
+     * \brief The NTracedProgram constructor
+     * \param program The commands of the program
+     * \param storage The machine the program runs on
+     * \param threshold The amount of backward jumps to a command after which a trace is recorded from it
+     * \throw InvalidCommandException If a command of the program is invalid (see NDecodedProgram)
+     */
+    NTracedProgram::NTracedProgram(const std::vector<NCommand>& program, NVirtualMachineStorage& storage, long long threshold): decoded(program, storage) {
+        this->counters.assign(program.size(), 0);
+        this->backoffs.assign(program.size(), 0);
+        this->entries.assign(program.size(), nullptr);
+        this->threshold = threshold;
+        this->recording = false;
+        this->entry = 0;
+        this->expected = 0;
+        this->compiledCount = 0;
+        this->abortedCount = 0;
+        this->invalidationCount = 0;
+    }
+
+    /**
+     * \brief Returns the decoded program run by the interpreter
+     * \return The decoded program
+     */
+    const NDecodedProgram& NTracedProgram::getDecoded() const {
+        return this->decoded;
+    }
+
+    /**
+     * \brief Checks if a trace starts at a command
+     * \param ip The index of the command, it must be a command of the program
+     * \return True if a cached trace starts at the command
+     */
+    bool NTracedProgram::hasTrace(long long ip) const {
+        return this->entries[ip] != nullptr;
+    }
+
+    /**
+     * \brief Checks if a trace is being recorded
+     * \details While a trace is recorded, every interpreted command has to be observed
+     * \return True if a trace is being recorded
+     */
+    bool NTracedProgram::isRecording() const {
+        return this->recording;
+    }
+
+    /**
+     * \brief Runs the trace that starts at the IP
+     * \details Does nothing while a trace is recorded, if no trace starts at the IP or if the memory of the machine does not allow entering it
+     * (see NNativeCode::enter)
+     * \param executed The amount of executed commands, increased by the amount executed by the trace
+     * \param budget The maximal amount of commands to execute
+     * \return True if the trace has run
+     */
+    bool NTracedProgram::runTrace(long long& executed, long long budget) const {
+        NVirtualMachineStorage* storage = this->decoded.getStorage();
+        long long ip = storage->getIP();
+        if (this->recording || ip < 0 || ip >= (long long) this->entries.size() || this->entries[ip] == nullptr) {
+            return false;
+        }
+        return this->entries[ip]->code.enter(storage, 0, executed, budget);
+    }
+
+    /**
+     * \brief Observes a command executed by the interpreter
+     * \details Records the command if a trace is recorded and counts the backward jumps
+     * \param ip The index of the command
+     * \param next The IP after the command
+     */
+    void NTracedProgram::observe(long long ip, long long next) {
+#ifdef NERVI_JIT
+        if (this->recording) {
+            this->record(ip, next);
+        }
+        int label = this->decoded.getCommands()[ip].label;
+        if (this->recording || label < NERVI_FLOW_LABEL + FLOW_JUMP || label > NERVI_FLOW_LABEL + FLOW_DECREMENT_JUMP_IF_NOT_ZERO || next > ip || next < 0) {
+            return;
+        }
+        if (this->entries[next] != nullptr || ++this->counters[next] < this->threshold << this->backoffs[next]) {
+            return;
+        }
+        this->recording = true;
+        this->entry = next;
+        this->expected = next;
+        this->recorded.clear();
+#endif
+    }
+
+    void NTracedProgram::record(long long ip, long long next) {
+#ifdef NERVI_JIT
+        const NDecodedCommand& command = this->decoded.getCommands()[ip];
+        if (ip != this->expected || !NNativeAssembler::isCompilable(command, this->decoded.getStorage()->getProgramSize())) {
+            this->abort();
+            return;
+        }
+        this->recorded.emplace_back(ip, next);
+        this->expected = next;
+        if (next == this->entry) {
+            this->compile();
+        } else if ((long long) this->recorded.size() >= NERVI_MAX_TRACE_LENGTH) {
+            this->abort();
+        }
+#endif
+    }
+
+    // the entry of an aborted trace needs twice as many jumps to be recorded again
+    void NTracedProgram::abort() {
+        this->recording = false;
+        this->counters[this->entry] = 0;
+        this->backoffs[this->entry] = std::min(this->backoffs[this->entry] + 1, NERVI_MAX_TRACE_BACKOFF);
+        this->abortedCount++;
+    }
+
+    void NTracedProgram::compile() {
+#ifdef NERVI_JIT
+        this->recording = false;
+        const NDecodedCommand* commands = this->decoded.getCommands();
+        NNativeAssembler assembler;
+        NTrace trace;
+        for (auto [ip, next] : this->recorded) {
+            const NDecodedCommand& command = commands[ip];
+            trace.ips.push_back(ip);
+            assembler.checkBudget(ip);
+            assembler.command(command);
+            // a guard exits to the interpreter if the jump goes the other way than when recorded
+            if (command.label > NERVI_FLOW_LABEL + FLOW_JUMP && command.second != ip + 1) {
+                NNativeCondition taken = NNativeAssembler::takenCondition(command);
+                if (next == command.second) {
+                    assembler.branch(NNativeAssembler::invert(taken), ip + 1);
+                } else {
+                    assembler.branch(taken, command.second);
+                }
+            }
+        }
+        assembler.branchTo(NATIVE_ALWAYS, 0);
+        trace.code = assembler.finish([](long long) {
+            return -1LL;
+        });
+        if (trace.code.isEmpty()) {
+            this->abort();
+            return;
+        }
+        std::sort(trace.ips.begin(), trace.ips.end());
+        trace.ips.erase(std::unique(trace.ips.begin(), trace.ips.end()), trace.ips.end());
+        this->entries[this->entry] = &(this->traces[this->entry] = std::move(trace));
+        this->compiledCount++;
+#endif
+    }
+
+    /**
+     * \brief Replaces a command of the program
+     * \details The traces that contain the command are dropped, a trace being recorded is aborted and the counting starts over,
+     * so the commands that have been aborted are traced again
+     * \param index The index of the command
+     * \param command The new command
+     * \throw InvalidIndexException If there is no command with the index
+     * \throw InvalidCommandException If the command is invalid (see NDecodedProgram::replace)
+     */
+    void NTracedProgram::setCommand(long long index, const NCommand& command) {
+        this->decoded.replace(index, command);
+        for (auto iterator = this->traces.begin(); iterator != this->traces.end();) {
+            if (std::binary_search(iterator->second.ips.begin(), iterator->second.ips.end(), index)) {
+                this->entries[iterator->first] = nullptr;
+                iterator = this->traces.erase(iterator);
+                this->invalidationCount++;
+            } else {
+                ++iterator;
+            }
+        }
+        this->recording = false;
+        std::fill(this->counters.begin(), this->counters.end(), 0);
+        std::fill(this->backoffs.begin(), this->backoffs.end(), 0);
+    }
+
+    /**
+     * \brief Returns the amount of cached traces
+     * \return The amount of traces
+     */
+    long long NTracedProgram::getTraceCount() const {
+        return (long long) this->traces.size();
+    }
+
+    /**
+     * \brief Returns the amount of compiled traces, including the invalidated ones
+     * \return The amount of compiled traces
+     */
+    long long NTracedProgram::getCompiledCount() const {
+        return this->compiledCount;
+    }
+
+    /**
+     * \brief Returns the amount of aborted recordings
+     * \return The amount of aborted recordings
+     */
+    long long NTracedProgram::getAbortedCount() const {
+        return this->abortedCount;
+    }
+
+    /**
+     * \brief Returns the amount of traces dropped by setCommand
+     * \return The amount of invalidated traces
+     */
+    long long NTracedProgram::getInvalidationCount() const {
+        return this->invalidationCount;
+    }
+}
+
+#endif
@@ -0,0 +1,427 @@
+/**
+ * \file test.cpp
+ * \brief The tests of NVirtualMachine and the forms of programs it runs
+ * \details Runs small programs on fresh machines and checks the behaviour the engines must share. Every failed check is printed,
+ * the exit code is the amount of the failed checks
+ */
+
+#include <string>
+#include <sstream>
+#include <random>
+#include <vector>
+#include <memory>
+#include <kernel/machine/nmachine.h>
+
+using namespace NerviKernel;
+
+int failures = 0;
+
+void check(bool passed, const std::string& name) {
+    if (!passed) {
+        fmt::print("FAILED: {}\n", name);
+        failures++;
+    }
+}
+
+template<typename E, typename F>
+bool throws(F body) {
+    try {
+        body();
+    } catch (E&) {
+        return true;
+    } catch (...) {
+        return false;
+    }
+    return false;
+}
+
+NCommand command(int plugin, int index, long long first = 0, long long second = 0) {
+    return NCommand{plugin, index, {{0, first}, 0}, {{0, second}, 0}};
+}
+
+// runs a program and returns the result with the kind of the exception it has thrown: 0 for none, 1 for InvalidIndexException,
+// 2 for LockedAddressException and 3 for any other one
+template<typename P>
+std::pair<NRunResult, int> runCaught(NVirtualMachine& machine, P& program, long long budget) {
+    try {
+        return {machine.run(program, budget), 0};
+    } catch (NerviInternalExceptions::InvalidIndexException&) {
+        return {{}, 1};
+    } catch (NerviInternalExceptions::LockedAddressException&) {
+        return {{}, 2};
+    } catch (...) {
+        return {{}, 3};
+    }
+}
+
+std::vector<NCommand> randomProgram(std::mt19937& random, long long cells) {
+    int length = 1 + int(random() % 14);
+    std::vector<NCommand> program;
+    for (int index = 0; index < length; index++) {
+        int kind = int(random() % 16);
+        long long first = random() % cells, second = random() % cells;
+        if (kind < 12) {
+            program.push_back(command(CORE_PLUGIN, kind, first, second));
+        } else if (kind == 12) {
+            program.push_back(command(FLOW_PLUGIN, 3, random() % 4, random() % (length + 1)));
+        } else if (kind == 13) {
+            program.push_back(command(FLOW_PLUGIN, 1 + int(random() % 2), first, random() % (length + 1)));
+        } else if (kind == 14) {
+            program.push_back(command(REGISTER_PLUGIN, EAX, first));
+        } else {
+            program.push_back(command(WIDE_PLUGIN, 10, EAX_FBX, first));
+        }
+    }
+    return program;
+}
+
+// the commands of every engine, and the handlers called directly, must not reach the stack region of a machine with MEMORY_STACKS
+void testStackRegion() {
+    NVirtualMachineStorage storage(64, 16, 4, 0, MEMORY_STACKS);
+    NVirtualMachine machine(storage);
+    storage.pushToStack(42);
+    storage.pushReturnAddress(7);
+    std::vector<std::vector<NCommand>> programs = {
+        {command(CORE_PLUGIN, 8, 64, 0)},                 // mov into the data stack
+        {command(CORE_PLUGIN, 8, 0, 64)},                 // mov from the data stack
+        {command(CORE_PLUGIN, 11, 80, 0)},                // mov64 into the return stack
+        {command(CORE_PLUGIN, 9, 63, 0)},                 // mov16 across the end of the memory of the programs
+        {command(WIDE_PLUGIN, 11, 80, EAX_FBX)},          // st64 into the return stack
+        {command(FLOW_PLUGIN, 3, 64, 0)}                  // djnz on a cell of the data stack
+    };
+    for (std::size_t index = 0; index < programs.size(); index++) {
+        std::string name = fmt::format("stack region program {}", index);
+        storage.jump(0);
+        check(throws<NerviInternalExceptions::InvalidIndexException>([&] { machine.run(programs[index]); }), name + " as commands");
+        storage.jump(0);
+        NPackedProgram packed = NPackedProgram::encode(programs[index]);
+        check(throws<NerviInternalExceptions::InvalidIndexException>([&] { machine.run(packed); }), name + " packed");
+        check(throws<NerviInternalExceptions::InvalidCommandException>([&] { machine.load(programs[index]); }), name + " decoded");
+    }
+    check(throws<NerviInternalExceptions::InvalidIndexException>([&] { NerviCoreCommandsDeclaration::byteMove(&storage, 70, 0); }), "stack region handler");
+    check(throws<NerviInternalExceptions::InvalidIndexException>([&] { storage.setU64(60, 0); }), "stack region accessor");
+    check(storage.getProgramSize() == 64 && storage.getSize() > 64, "stack region size");
+    long long address = 0;
+    char value = 0;
+    check(storage.popReturn(address) == STACK_OK && address == 7, "stack region return address kept");
+    check(storage.popStack(value) == STACK_OK && value == 42, "stack region data kept");
+    storage.jump(0);
+    check(machine.run({command(CORE_PLUGIN, 8, 63, 0)}).status == RUN_FINISHED, "stack region last program cell");
+}
+
+// the card of a machine with MEMORY_STACKS is neither resized nor loaded below the end of its stack region
+void testStackRegionSize() {
+    NVirtualMachineStorage storage(64, 16, 4, 0, MEMORY_STACKS);
+    const long long end = 64 + 16 + 4 * (long long) sizeof(long long);
+    storage.setValueAt(5, 9);
+    storage.pushToStack(42);
+    check(throws<NerviInternalExceptions::InvalidIndexException>([&] { storage.resize(end - 1); }), "stack region resize below the end");
+    check(storage.getSize() == end, "stack region size after a rejected resize");
+    storage.resize(end + 100);
+    check(storage.getSize() == end + 100 && storage.getProgramSize() == 64, "stack region resize above the end");
+    storage.resize(end);
+    NVirtualMachineStorage small(32);
+    std::stringstream saved;
+    small.save(saved);
+    check(throws<NerviInternalExceptions::InvalidStateException>([&] { storage.load(saved); }), "stack region load of a smaller memory");
+    char value = 0;
+    check(storage.getSize() == end && storage.getValueAt(5) == 9, "stack region memory after a rejected load");
+    check(storage.popStack(value) == STACK_OK && value == 42, "stack region stack after a rejected load");
+}
+
+// the core commands read the attached discs and cannot write to a ROM disc, in the commands and in the packed programs
+void testDiscs() {
+    NVirtualMachineStorage storage(64, 16, 4, 0, MEMORY_STACKS);
+    NVirtualMachine machine(storage);
+    char contents[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    storage.attachDisc(1, std::make_shared<NRomCard>(contents, 16));
+    auto onDiscs = [](int index, short firstDisc, long long first, short secondDisc, long long second) {
+        return NCommand{CORE_PLUGIN, index, {{firstDisc, first}, 0}, {{secondDisc, second}, 0}};
+    };
+    std::vector<NCommand> reads = {onDiscs(8, 0, 5, 1, 3), onDiscs(0, 0, 5, 1, 4), onDiscs(11, 0, 8, 1, 8), onDiscs(2, 0, 6, 7, 0)};
+    for (int packed = 0; packed < 2; packed++) {
+        std::string name = packed ? "packed " : "";
+        storage.jump(0);
+        NRunResult result = packed ? machine.run(NPackedProgram::encode(reads)) : machine.run(reads);
+        check(result.status == RUN_FINISHED && result.executed == 4, name + "disc reads");
+        check(storage.getValueAt(5) == (4 & 5) && storage.getU64(8) == storage.getDisc(1)->getU64(8), name + "disc values");
+        check(storage.getValueAt(6) == char(~0), name + "disc not ignores its second operand");
+        storage.setValueAt(6, 0);
+        storage.jump(0);
+        std::vector<NCommand> write = {onDiscs(8, 1, 3, 0, 5)};
+        check(throws<NerviInternalExceptions::ReadOnlyMemoryException>([&] { packed ? machine.run(NPackedProgram::encode(write)) : machine.run(write); }) &&
+              storage.getIP() == 1 && storage.getDisc(1)->getValueAt(3) == 4, name + "disc write to a ROM");
+        storage.jump(0);
+        std::vector<NCommand> detached = {onDiscs(8, 0, 5, 2, 3)};
+        check(throws<NerviInternalExceptions::InvalidDiscException>([&] { packed ? machine.run(NPackedProgram::encode(detached)) : machine.run(detached); }),
+              name + "disc not attached");
+        storage.jump(0);
+        std::vector<NCommand> stack = {onDiscs(8, 0, 64, 1, 3)};
+        check(throws<NerviInternalExceptions::InvalidIndexException>([&] { packed ? machine.run(NPackedProgram::encode(stack)) : machine.run(stack); }),
+              name + "disc read into the stack region");
+        storage.jump(0);
+        std::vector<NCommand> flow = {NCommand{FLOW_PLUGIN, 0, {{1, 0}, 0}, {{0, 0}, 0}}};
+        check(throws<NerviInternalExceptions::InvalidDiscException>([&] { packed ? machine.run(NPackedProgram::encode(flow)) : machine.run(flow); }),
+              name + "disc operand of a flow command");
+    }
+    check(throws<NerviInternalExceptions::InvalidCommandException>([&] { machine.load(reads); }), "disc operands rejected by load");
+    check(NPackedProgram::encode(reads).getCommand(1).sArg.argAddress.discNumber == 1, "disc of a packed command");
+}
+
+// a saved card is checked before the load allocates anything by the counts it declares
+void testLoadHeader() {
+    NMemoryCard card(64);
+    card.setValueAt(3, 5);
+    std::stringstream forged;
+    forged.write("NERVIMC1", 8);
+    NerviBinaryStream::writeU64(forged, 1ull << 40);
+    NerviBinaryStream::writeU64(forged, 1ull << 40);
+    NerviBinaryStream::writeU64(forged, 7);
+    check(throws<NerviInternalExceptions::InvalidStateException>([&] { card.load(forged); }), "load of a forged lock count");
+    check(card.getSize() == 64 && card.getValueAt(3) == 5, "memory after a forged lock count");
+}
+
+// a verified program must behave like the original one, also when the memory is locked, shrunk or grown after verify:
+// the runs use the checked handlers then
+void testVerifiedDifferential() {
+    std::mt19937 random(3);
+    long long mismatches = 0, fallbacks = 0;
+    for (int trial = 0; trial < 3000; trial++) {
+        std::vector<NCommand> program = randomProgram(random, 56);
+        NVirtualMachineStorage original(64), verified(64);
+        NVirtualMachine reference(original), machine(verified);
+        for (long long cell = 0; cell < 64; cell++) {
+            char value = cell < 4 ? 3 : char(random());
+            original.setValueAt(cell, value);
+            verified.setValueAt(cell, value);
+        }
+        NSuperinstructionProfile profile;
+        profile.addProgram(program);
+        NDecodedProgram decoded = trial % 2 ? machine.load(program) : machine.load(program, profile, 8);
+        if (!decoded.verify() || decoded.getVerifiedExtent() > 64) {
+            mismatches++;
+            continue;
+        }
+        long long change = trial % 4, size = change == 2 ? 8 + random() % 56 : 128, locked = random() % 56;
+        if (change == 1) {
+            original.lockCell(locked);
+            verified.lockCell(locked);
+        } else if (change >= 2) {
+            original.resize(size);
+            verified.resize(size);
+        }
+        fallbacks += !verified.allowsUnchecked(decoded.getVerifiedExtent());
+        for (int round = 0; round < 4; round++) {
+            long long budget = 1 + random() % 200;
+            auto [expected, expectedError] = runCaught(reference, program, budget);
+            auto [actual, actualError] = runCaught(machine, decoded, budget);
+            bool same = expectedError == actualError && original.getIP() == verified.getIP() && (expectedError != 0 ||
+                        (expected.status == actual.status && expected.executed == actual.executed && expected.commandStatus == actual.commandStatus));
+            mismatches += !same;
+            if (expectedError != 0 || expected.status != RUN_BUDGET_EXHAUSTED) {
+                original.jump(0);
+                verified.jump(0);
+            }
+        }
+        for (long long cell = 0; cell < original.getSize(); cell++) {
+            mismatches += original.getValueAt(cell) != verified.getValueAt(cell);
+        }
+        mismatches += original.getDirtyPageCount() != verified.getDirtyPageCount();
+    }
+    check(mismatches == 0, fmt::format("verified differential ({} mismatches)", mismatches));
+    check(fallbacks > 0, "verified differential has checked runs");
+}
+
+// a lock after verify makes the runs use the checked handlers until verify restores the unchecked ones
+void testVerifiedFallback() {
+    NVirtualMachineStorage storage(64);
+    NVirtualMachine machine(storage);
+    std::vector<NCommand> program = {command(CORE_PLUGIN, 2, 5), command(CORE_PLUGIN, 8, 6, 5)};
+    NDecodedProgram decoded = machine.load(program);
+    check(decoded.verify() && decoded.getVerifiedExtent() == 7, "verified extent");
+    storage.lockCell(40);
+    char before = storage.getValueAt(5);
+    NRunResult result = machine.run(decoded);
+    check(result.status == RUN_FINISHED && result.executed == 2 && storage.getValueAt(5) == char(~before) && storage.getValueAt(6) == char(~before),
+          "verified run with an unrelated lock");
+    storage.jump(0);
+    storage.lockCell(5);
+    check(throws<NerviInternalExceptions::LockedAddressException>([&] { machine.run(decoded); }) && storage.getIP() == 1, "verified run with a locked cell");
+    check(decoded.isVerified() && !decoded.verify() && !decoded.isVerified(), "verify after a lock");
+    storage.unlockAll();
+    storage.jump(0);
+    check(decoded.verify(), "verify after unlocking");
+    storage.resize(6);
+    check(throws<NerviInternalExceptions::InvalidIndexException>([&] { machine.run(decoded); }) && storage.getIP() == 2, "verified run after a shrink");
+    check(!decoded.verify(), "verify after a shrink");
+    // the card of a machine cannot be made read-only, a ROM card refuses the unchecked accessors instead
+    char contents[16] = {};
+    NRomCard rom(contents, 16);
+    check(!rom.allowsUnchecked(1), "read-only card refuses the unchecked accessors");
+}
+
+// a program split into blocks must behave like the original one, with its resolved commands and with the decoded ones the runs fall
+// back to when the memory is locked or shrunk below the resolved cells
+void testBlockDifferential() {
+    std::mt19937 random(5);
+    long long mismatches = 0, fallbacks = 0, resolved = 0;
+    for (int trial = 0; trial < 3000; trial++) {
+        std::vector<NCommand> program = randomProgram(random, 56);
+        NVirtualMachineStorage original(64), split(64);
+        NVirtualMachine reference(original), machine(split);
+        for (long long cell = 0; cell < 64; cell++) {
+            char value = cell < 4 ? 3 : char(random());
+            original.setValueAt(cell, value);
+            split.setValueAt(cell, value);
+        }
+        NBlockProgram blocks(program, split);
+        long long change = trial % 4, size = change == 2 ? 8 + random() % 56 : 128, locked = random() % 56;
+        for (int round = 0; round < 4; round++) {
+            if (round == 2 && change == 1) {
+                original.lockCell(locked);
+                split.lockCell(locked);
+            } else if (round == 2 && change >= 2) {
+                original.resize(size);
+                split.resize(size);
+            }
+            fallbacks += !split.allowsUnchecked(blocks.getResolvedExtent());
+            long long budget = 1 + random() % 200;
+            auto [expected, expectedError] = runCaught(reference, program, budget);
+            auto [actual, actualError] = runCaught(machine, blocks, budget);
+            bool same = expectedError == actualError && original.getIP() == split.getIP() && (expectedError != 0 ||
+                        (expected.status == actual.status && expected.executed == actual.executed && expected.commandStatus == actual.commandStatus));
+            mismatches += !same;
+            if (expectedError != 0 || expected.status != RUN_BUDGET_EXHAUSTED) {
+                original.jump(0);
+                split.jump(0);
+            }
+        }
+        resolved += blocks.getResolvedExtent() > 0;
+        for (long long cell = 0; cell < original.getSize(); cell++) {
+            mismatches += original.getValueAt(cell) != split.getValueAt(cell);
+        }
+        mismatches += original.getDirtyPageCount() != split.getDirtyPageCount();
+    }
+    check(mismatches == 0, fmt::format("block differential ({} mismatches)", mismatches));
+    check(fallbacks > 0 && resolved > 0, "block differential has resolved and checked runs");
+}
+
+// a block resolves the commands with cells in the memory only, the others keep their checks
+void testBlockResolve() {
+    NVirtualMachineStorage storage(64);
+    NVirtualMachine machine(storage);
+    std::vector<NCommand> program = {command(CORE_PLUGIN, 2, 5), command(CORE_PLUGIN, 8, 6, 5)};
+    NBlockProgram blocks(program, storage);
+    check(blocks.getResolvedExtent() == 0, "block extent before a run");
+    char before = storage.getValueAt(5);
+    check(machine.run(blocks).status == RUN_FINISHED && storage.getValueAt(6) == char(~before), "block run");
+    check(blocks.getResolvedExtent() == 7, "block extent after a run");
+    check(blocks.getResolvedCommands()[0].handler == NerviUncheckedCoreCommands[2], "block resolved handler");
+    check(blocks.getDecoded().getCommands()[0].handler == NerviCoreCommands[2], "block decoded handler kept");
+    storage.jump(0);
+    storage.lockCell(6);
+    check(throws<NerviInternalExceptions::LockedAddressException>([&] { machine.run(blocks); }) && storage.getIP() == 2, "block run with a locked cell");
+}
+
+// the rules of the peephole pass one by one: the folded pairs, the removed commands, the pairs kept by a jump target and the remapped targets
+void testPeepholeRules() {
+    auto folds = [](const std::vector<NCommand>& program, std::size_t length, const std::vector<long long>& remap, const std::string& name) {
+        NPeepholeResult result = NerviPeephole::peephole(program);
+        check(result.program.size() == length && result.removed == (long long) (program.size() - length) && result.remap == remap, "peephole " + name);
+        return result.program;
+    };
+    folds({command(CORE_PLUGIN, CORE_NOT, 10), command(CORE_PLUGIN, CORE_NOT, 10)}, 0, {0, 0, 0}, "not pair");
+    folds({command(CORE_PLUGIN, CORE_NOT, 10), command(CORE_PLUGIN, CORE_NOT, 11)}, 2, {0, 1, 2}, "not of two cells");
+    std::vector<NCommand> moved = folds({command(CORE_PLUGIN, CORE_XOR, 11, 11), command(CORE_PLUGIN, CORE_OR, 11, 12)}, 1, {0, 1, 1}, "xor and or");
+    check(moved.size() == 1 && moved[0].commandIndex == CORE_MOVE && moved[0].fArg.argAddress.address == 11 && moved[0].sArg.argAddress.address == 12,
+          "peephole xor and or become mov");
+    folds({command(CORE_PLUGIN, CORE_XOR, 11, 12), command(CORE_PLUGIN, CORE_OR, 11, 12)}, 2, {0, 1, 2}, "xor of two cells and or");
+    std::vector<NCommand> kept = folds({command(CORE_PLUGIN, CORE_AND, 5, 5), command(CORE_PLUGIN, CORE_OR, 5, 5), command(CORE_PLUGIN, CORE_MOVE, 5, 5),
+                                        command(CORE_PLUGIN, CORE_WORD_MOVE, 5, 5), command(CORE_PLUGIN, CORE_DWORD_MOVE, 5, 5),
+                                        command(CORE_PLUGIN, CORE_QWORD_MOVE, 5, 5), command(FLOW_PLUGIN, FLOW_JUMP, 7), command(CORE_PLUGIN, CORE_AND, 5, 6)},
+                                       1, {0, 0, 0, 0, 0, 0, 0, 0, 1}, "no operations");
+    check(kept.size() == 1 && kept[0].commandIndex == CORE_AND && kept[0].sArg.argAddress.address == 6, "peephole and of two cells kept");
+    folds({command(CORE_PLUGIN, CORE_NOT, 10), command(CORE_PLUGIN, CORE_MOVE, 13, 13), command(CORE_PLUGIN, CORE_NOT, 10)}, 0, {0, 0, 0, 0},
+          "pair made adjacent by a removal");
+    std::vector<NCommand> loop = folds({command(CORE_PLUGIN, CORE_NOT, 14), command(CORE_PLUGIN, CORE_NOT, 14), command(FLOW_PLUGIN, FLOW_DECREMENT_JUMP_IF_NOT_ZERO, 16, 1)},
+                                       3, {0, 1, 2, 3}, "not pair with a jump target");
+    check(loop.size() == 3 && loop[2].sArg.argAddress.address == 1, "peephole target of a kept pair");
+    folds({command(CORE_PLUGIN, CORE_XOR, 11, 11), command(CORE_PLUGIN, CORE_OR, 11, 12), command(FLOW_PLUGIN, FLOW_JUMP_IF_ZERO, 16, 1)}, 3, {0, 1, 2, 3},
+          "xor and or with a jump target");
+    std::vector<NCommand> ends = folds({command(CORE_PLUGIN, CORE_MOVE, 5, 5), command(FLOW_PLUGIN, FLOW_JUMP_IF_ZERO, 16, 3), command(FLOW_PLUGIN, FLOW_JUMP, 9),
+                                        command(CORE_PLUGIN, CORE_MOVE, 5, 5)}, 2, {0, 0, 1, 2, 2}, "targets at and past the end");
+    check(ends.size() == 2 && ends[0].sArg.argAddress.address == 2 && ends[1].fArg.argAddress.address == 2, "peephole targets at and past the end remapped");
+    std::vector<NCommand> program = {
+        command(CORE_PLUGIN, CORE_NOT, 10),
+        command(CORE_PLUGIN, CORE_NOT, 10),
+        command(CORE_PLUGIN, CORE_XOR, 11, 11),
+        command(CORE_PLUGIN, CORE_OR, 11, 12),
+        command(CORE_PLUGIN, CORE_MOVE, 13, 13),
+        command(FLOW_PLUGIN, FLOW_JUMP, 6),
+        command(CORE_PLUGIN, CORE_NOT, 14),
+        command(CORE_PLUGIN, CORE_NOT, 14),
+        command(FLOW_PLUGIN, FLOW_DECREMENT_JUMP_IF_NOT_ZERO, 16, 7)
+    };
+    std::vector<NCommand> optimized = folds(program, 4, {0, 0, 0, 1, 1, 1, 1, 2, 3, 4}, "all the rules");
+    check(optimized.size() == 4 && optimized[3].sArg.argAddress.address == 2, "peephole djnz remapped");
+}
+
+// the optimized program computes the same memory as the original one, and load reports the pass
+void testPeepholeLoad() {
+    std::mt19937 random(7);
+    long long mismatches = 0, removed = 0;
+    for (int trial = 0; trial < 2000; trial++) {
+        std::vector<NCommand> program = randomProgram(random, 24);
+        for (int index = 0; index < 3; index++) {
+            int at = int(random() % (program.size() + 1)), kind = int(random() % 3);
+            long long cell = 4 + random() % 20;
+            std::vector<NCommand> pair = kind == 0 ? std::vector<NCommand>{command(CORE_PLUGIN, CORE_NOT, cell), command(CORE_PLUGIN, CORE_NOT, cell)} :
+                                         kind == 1 ? std::vector<NCommand>{command(CORE_PLUGIN, CORE_XOR, cell, cell), command(CORE_PLUGIN, CORE_OR, cell, cell + 1)} :
+                                         std::vector<NCommand>{command(CORE_PLUGIN, CORE_MOVE, cell, cell)};
+            program.insert(program.begin() + at, pair.begin(), pair.end());
+        }
+        NVirtualMachineStorage original(64), optimized(64);
+        NVirtualMachine reference(original), machine(optimized);
+        for (long long cell = 0; cell < 64; cell++) {
+            char value = cell < 4 ? 3 : char(random());
+            original.setValueAt(cell, value);
+            optimized.setValueAt(cell, value);
+        }
+        NPeepholeResult passes;
+        NDecodedProgram decoded = machine.load(program, LOAD_PEEPHOLE, &passes);
+        removed += passes.removed;
+        mismatches += decoded.getLength() != (long long) program.size() - passes.removed || passes.remap.size() != program.size() + 1;
+        auto [expected, expectedError] = runCaught(reference, program, 10000);
+        auto [actual, actualError] = runCaught(machine, decoded, 10000);
+        if (expectedError != 0 || expected.status != RUN_FINISHED || actualError != 0 || actual.status != RUN_FINISHED) {
+            continue;
+        }
+        for (long long cell = 0; cell < 64; cell++) {
+            mismatches += original.getValueAt(cell) != optimized.getValueAt(cell);
+        }
+    }
+    check(mismatches == 0 && removed > 0, fmt::format("peephole differential ({} mismatches, {} removed)", mismatches, removed));
+    NVirtualMachineStorage storage(64);
+    NVirtualMachine machine(storage);
+    std::vector<NCommand> program = {command(CORE_PLUGIN, CORE_NOT, 10), command(CORE_PLUGIN, CORE_NOT, 10), command(CORE_PLUGIN, CORE_AND, 5, 6)};
+    NPeepholeResult passes;
+    check(machine.load(program, LOAD_AS_IS, &passes).getLength() == 3 && passes.removed == 0 && passes.remap == std::vector<long long>{0, 1, 2, 3},
+          "load as is reports the identity");
+    check(machine.load(program, LOAD_PEEPHOLE, &passes).getLength() == 1 && passes.removed == 2 && passes.remap == std::vector<long long>{0, 0, 0, 1},
+          "load with the peephole pass reports the remap");
+}
+
+int main() {
+    testStackRegion();
+    testStackRegionSize();
+    testLoadHeader();
+    testDiscs();
+    testVerifiedDifferential();
+    testVerifiedFallback();
+    testBlockDifferential();
+    testBlockResolve();
+    testPeepholeRules();
+    testPeepholeLoad();
+    fmt::print("{} failed\n", failures);
+    return failures;
+}
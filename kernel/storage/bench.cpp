@@ -0,0 +1,43 @@
+/**
+ * \file bench.cpp
+ * \brief The benchmark of the per-instruction cost of NVirtualMachineStorage
+ * \details Runs a straight-line program of core commands over a machine the way an interpreter loop does (fetch by IP, dispatch
+ * through NerviCoreCommands, advance the IP, touch the registers and the stack) and reports the average time of an instruction
+ */
+
+#include <chrono>
+#include <vector>
+#include <kernel/command/ncommand.h>
+#include <kernel/command/ncommandlist.h>
+
+using namespace NerviKernel;
+
+int main() {
+    const long long programLength = 4096, rounds = 2000;
+    std::vector<NCommand> program(programLength);
+    for (long long i = 0; i < programLength; i++) {
+        program[i] = NCommand{0, int(i % 8), {{0, (i * 37) % 4096}, 0}, {{0, (i * 91 + 5) % 4096}, 0}};
+    }
+    NVirtualMachineStorage machine(1 << 16);
+    for (long long i = 0; i < 4096; i++) {
+        machine.setValueAt(i, char(i * 13));
+    }
+    long long executed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long long round = 0; round < rounds; round++) {
+        machine.jump(0);
+        while (machine.getIP() < programLength) {
+            const NCommand& command = program[machine.getIP()];
+            NerviCoreCommands[command.commandIndex](&machine, command.fArg.argAddress.address, command.sArg.argAddress.address);
+            machine.pushToRegister(CMPRES, machine.getValueAt(command.fArg.argAddress.address));
+            char top;
+            machine.pushToStack(machine.getRegister(CMPRES));
+            machine.popStack(top);
+            machine.jumpNext();
+            executed++;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fmt::print("{} instructions in {:.3f} s: {:.2f} ns per instruction\n", executed, seconds, seconds * 1e9 / double(executed));
+    return 0;
+}
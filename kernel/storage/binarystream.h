@@ -0,0 +1,78 @@
+/**
+ * \file binarystream.h
+ * \brief Contains the binary stream helpers used by the save and load methods of memory devices
+ * \details The saved states are written as raw bytes and fixed-width little-endian integers. The readers check every read
+ * and throw InvalidStateException when the stream ends too early, so a truncated state is never taken for a valid one
+ */
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <kernel/error/internal.h>
+#include <fmt/core.h>
+
+#ifndef KERNEL_STORAGE_NBINARYSTREAM
+#define KERNEL_STORAGE_NBINARYSTREAM
+
+namespace NerviKernel {
+    namespace NerviBinaryStream {
+
+        /**
+         * \brief Writes a 64-bit value in little-endian order
+         * \param out The stream to write to
+         * \param value The value to write
+         */
+        void writeU64(std::ostream& out, std::uint64_t value) {
+            if constexpr (std::endian::native == std::endian::big) {
+                value = __builtin_bswap64(value);
+            }
+            out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        /**
+         * \brief Reads raw bytes
+         * \param in The stream to read from
+         * \param destination The buffer to read into
+         * \param length The amount of bytes to read
+         * \throw InvalidStateException If the stream ends before all the bytes have been read
+         */
+        void readBytes(std::istream& in, char* destination, long long length) {
+            if (length > 0 && !in.read(destination, length)) {
+                throw NerviInternalExceptions::InvalidStateException(fmt::format("Unexpected end of a saved state: {} of {} bytes read", (long long) in.gcount(), length));
+            }
+        }
+
+        /**
+         * \brief Reads a 64-bit value written by writeU64
+         * \param in The stream to read from
+         * \return The value read
+         * \throw InvalidStateException If the stream ends before the value has been read
+         */
+        std::uint64_t readU64(std::istream& in) {
+            std::uint64_t value;
+            readBytes(in, reinterpret_cast<char*>(&value), sizeof(value));
+            if constexpr (std::endian::native == std::endian::big) {
+                value = __builtin_bswap64(value);
+            }
+            return value;
+        }
+
+        /**
+         * \brief Reads a signature and compares it with the expected one
+         * \param in The stream to read from
+         * \param signature The expected signature of 8 characters
+         * \throw InvalidStateException If the stream ends or the signature differs
+         */
+        void expectSignature(std::istream& in, const char* signature) {
+            char read[8];
+            readBytes(in, read, sizeof(read));
+            if (memcmp(read, signature, sizeof(read)) != 0) {
+                throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved state signature (expected {:.8})", signature));
+            }
+        }
+    }
+}
+
+#endif
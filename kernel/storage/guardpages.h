@@ -0,0 +1,125 @@
+/**
+ * \file guardpages.h
+ * \brief Contains the guard page reservations and the fault translation used by guarded memory cards
+ * \details A guarded memory card places its storage right before a PROT_NONE region and addresses it with a power-of-two mask,
+ * so an accessor needs no comparison: an in-range index hits the storage and any other index lands in the guard region and faults.
+ * The faults raised inside a guarded scope are turned into a jump back to the scope, which throws InvalidIndexException.
+ * Guard pages are available on POSIX systems only, other platforms keep the ordinary bounds checks
+ */
+
+#include <mutex>
+#include <atomic>
+#include <bit>
+#include <kernel/storage/pagedmemory.h>
+
+#ifdef NERVI_PAGED_MEMORY_MMAP
+#include <csignal>
+#include <csetjmp>
+#define NERVI_GUARD_PAGES
+#endif
+
+#ifndef KERNEL_STORAGE_NGUARDPAGES
+#define KERNEL_STORAGE_NGUARDPAGES
+
+namespace NerviKernel {
+    namespace NerviGuardPages {
+
+        /**
+         * \brief Returns the size of the addressing window of a guarded storage
+         * \details The window is the smallest power of two that is greater than the storage size and not less than a page,
+         * so every masked index either hits the storage or the guard region behind it
+         * \param size The size of the storage in bytes
+         * \return The size of the window in bytes
+         */
+        unsigned long long windowSize(long long size) {
+            return std::max(std::bit_ceil((unsigned long long) size + 1), (unsigned long long) NerviPagedMemory::pageSize());
+        }
+
+#ifdef NERVI_GUARD_PAGES
+        /**
+         * \brief Represents an active guarded scope of a thread
+         * \details The scopes of a thread are chained from the innermost one. The signal handler looks for the scope whose reservation
+         * contains the faulting address, stores the address and jumps back to the scope
+         */
+        struct NGuardScope {
+            const char *begin, *end;
+            sigjmp_buf jump;
+            const char* volatile fault;
+            NGuardScope* previous;
+        };
+
+        thread_local NGuardScope* activeScope = nullptr;
+        struct sigaction previousSegvAction, previousBusAction;
+
+        void handleFault(int signal, siginfo_t* info, void* context) {
+            const char* address = static_cast<const char*>(info->si_addr);
+            for (NGuardScope* scope = activeScope; scope != nullptr; scope = scope->previous) {
+                if (address >= scope->begin && address < scope->end) {
+                    scope->fault = address;
+                    siglongjmp(scope->jump, 1);
+                }
+            }
+            // the fault is not caused by a guarded card, so it is passed to the handler installed before
+            struct sigaction* previous = signal == SIGSEGV ? &previousSegvAction : &previousBusAction;
+            if (previous->sa_flags & SA_SIGINFO) {
+                previous->sa_sigaction(signal, info, context);
+            } else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+                previous->sa_handler(signal);
+            } else {
+                sigaction(signal, previous, nullptr);
+            }
+        }
+
+        /**
+         * \brief Installs the fault handler of guarded scopes
+         * \details The handler is installed for SIGSEGV and SIGBUS once per process. The faults that do not belong to a guarded scope
+         * are forwarded to the previously installed handlers
+         */
+        void install() {
+            static std::once_flag installed;
+            std::call_once(installed, [] {
+                struct sigaction action = {};
+                action.sa_sigaction = handleFault;
+                action.sa_flags = SA_SIGINFO;
+                sigemptyset(&action.sa_mask);
+                sigaction(SIGSEGV, &action, &previousSegvAction);
+                sigaction(SIGBUS, &action, &previousBusAction);
+            });
+        }
+
+        /**
+         * \brief Reserves a guarded storage
+         * \details Maps the whole reservation as PROT_NONE and opens only the pages holding the storage.
+         * The storage is placed so that it ends exactly at a page boundary, thus the first byte after it already faults
+         * \param size The size of the storage in bytes
+         * \return The pointer to the beginning of the storage
+         * \throw std::bad_alloc If the reservation cannot be mapped
+         */
+        char* allocate(long long size) {
+            long long opened = NerviPagedMemory::roundToPages(size), lead = opened - size;
+            long long length = NerviPagedMemory::roundToPages(lead + (long long) windowSize(size));
+            void* mapping = mmap(nullptr, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mapping == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            if (size > 0 && mprotect(mapping, opened, PROT_READ | PROT_WRITE) != 0) {
+                munmap(mapping, length);
+                throw std::bad_alloc();
+            }
+            return static_cast<char*>(mapping) + lead;
+        }
+
+        /**
+         * \brief Releases a guarded storage reserved by allocate
+         * \param storage The pointer to the beginning of the storage
+         * \param size The size of the storage in bytes
+         */
+        void release(char* storage, long long size) {
+            long long lead = NerviPagedMemory::roundToPages(size) - size;
+            munmap(storage - lead, NerviPagedMemory::roundToPages(lead + (long long) windowSize(size)));
+        }
+#endif
+    }
+}
+
+#endif
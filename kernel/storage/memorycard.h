@@ -1,5 +1,16 @@
-#include <list>
+#include <unordered_map>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <limits>
 #include <kernel/error/internal.h>
+#include <kernel/constant/limits.h>
+#include <kernel/storage/pagedmemory.h>
+#include <kernel/storage/guardpages.h>
+#include <kernel/storage/binarystream.h>
 #include <fmt/core.h>
 
 #ifndef KERNEL_STORAGE_NMEMC
@@ -7,78 +18,365 @@
 
 namespace NerviKernel {
 
+    /**
+     * \brief The modes of addressing a memory card
+     * \details Defines how a memory card protects its storage from out-of-range accesses
+     */
+    enum NMemoryCardMode {
+        CHECKED, /// Every access compares the index with the size of the card
+        GUARDED /// The storage is followed by guard pages, so the unchecked accessors fault instead of comparing (POSIX only, elsewhere the same as CHECKED)
+    };
+
+    class NMemoryCard;
+    class NNativeCode;
+    template<typename T> class NFixedStack;
+
+    /**
+     * \brief A class of a saved state of a memory card
+     * \details Stores the pages of a card that can contain non-zero values and the locked cells. A snapshot is made by NMemoryCard::snapshot
+     * and can be restored by NMemoryCard::restore of the same card any number of times. The class objects can be moved but not copied
+     */
+    class NMemoryCardSnapshot {
+        friend class NMemoryCard;
+        NMemoryCardSnapshot(const NMemoryCardSnapshot& nmcs) = delete;
+        NMemoryCardSnapshot& operator=(const NMemoryCardSnapshot& nmcs) = delete;
+    private:
+        unsigned long long id;
+        long long size;
+        char* contents;
+        std::vector<std::uint64_t> touched;
+        std::vector<long long> locks;
+        NMemoryCardSnapshot();
+    public:
+        NMemoryCardSnapshot(NMemoryCardSnapshot&& nmcs) noexcept;
+        NMemoryCardSnapshot& operator=(NMemoryCardSnapshot&& nmcs) noexcept;
+        ~NMemoryCardSnapshot();
+        unsigned long long getId() const;
+        long long getSize() const;
+    };
+
+    NMemoryCardSnapshot::NMemoryCardSnapshot() {
+        this->id = 0;
+        this->size = 0;
+        this->contents = nullptr;
+    }
+
+    /**
+     * \brief The NMemoryCardSnapshot move constructor
+     * \details Takes the saved pages of another snapshot, which becomes empty
+     */
+    NMemoryCardSnapshot::NMemoryCardSnapshot(NMemoryCardSnapshot&& nmcs) noexcept {
+        this->id = nmcs.id;
+        this->size = nmcs.size;
+        this->contents = nmcs.contents;
+        this->touched = std::move(nmcs.touched);
+        this->locks = std::move(nmcs.locks);
+        nmcs.contents = nullptr;
+    }
+
+    /**
+     * \brief The NMemoryCardSnapshot move assignment
+     * \details Releases the own saved pages and takes the saved pages of another snapshot, which becomes empty
+     */
+    NMemoryCardSnapshot& NMemoryCardSnapshot::operator=(NMemoryCardSnapshot&& nmcs) noexcept {
+        if (this != &nmcs) {
+            if (this->contents != nullptr) {
+                NerviPagedMemory::release(this->contents, this->size);
+            }
+            this->id = nmcs.id;
+            this->size = nmcs.size;
+            this->contents = nmcs.contents;
+            this->touched = std::move(nmcs.touched);
+            this->locks = std::move(nmcs.locks);
+            nmcs.contents = nullptr;
+        }
+        return *this;
+    }
+
+    /**
+     * \brief The NMemoryCardSnapshot destructor that releases the saved pages
+     */
+    NMemoryCardSnapshot::~NMemoryCardSnapshot() {
+        if (this->contents != nullptr) {
+            NerviPagedMemory::release(this->contents, this->size);
+        }
+    }
+
+    /**
+     * \brief Returns the unique number of the snapshot
+     * \return The number that identifies the snapshot among all snapshots of the process
+     */
+    unsigned long long NMemoryCardSnapshot::getId() const {
+        return this->id;
+    }
+
+    /**
+     * \brief Returns the size of the saved card
+     * \return The size of the card at the moment of the snapshot
+     */
+    long long NMemoryCardSnapshot::getSize() const {
+        return this->size;
+    }
+
     /**
      * \brief A class of a memory card that only stores values in an array
      * \details This is the class that stores some amount of chars in an array that defines during the class' construction.
-     * The size of an array is immutable and the class does not provide a possibility to change it.
+     * The array is allocated by whole pages (see NerviPagedMemory) and can be grown or shrunk in place with resize.
      * The class objects cannot be assigned to other class objects. The following code will cause an error:
      * \code
      * NerviKernel::NMemoryCard card1(4);
      * NerviKernel::NMemoryCard card2 = card1; //error
      * \endcode
-     * Also provides an opportunity to protect the array's cells from writing (i.e. locking), the indexes of the locked are stored in a list.
-     * The locked cells are available only for reading, but can be unlocked from write-locking
+     * Also provides an opportunity to protect the array's cells from writing (i.e. locking), the indexes of the locked are stored in a hash map
+     * together with the lock epoch they were locked in. The locked cells are available only for reading, but can be unlocked from write-locking
+     * one by one or all at once with unlockAll, which only starts a new epoch and therefore takes constant time.
+     * A card created in the GUARDED mode additionally provides getValueAtUnchecked and setValueAtUnchecked that address the storage with a mask
+     * instead of comparing the index. They have to be called inside guarded, which turns a fault on the guard pages into InvalidIndexException:
+     * \code
+     * NerviKernel::NMemoryCard card(4096, NerviKernel::GUARDED);
+     * card.guarded([&card] {
+     *     card.setValueAtUnchecked(5000, 1); //throws InvalidIndexException
+     * });
+     * \endcode
+     * The card tracks the pages (of 2^NERVI_TRACKED_PAGE_SHIFT bytes) written since its last snapshot, so restoring the snapshot
+     * copies only these pages back
      */
 
-    class NMemoryCard {
+    class alignas(64) NMemoryCard {
+        friend class NNativeCode;
+        template<typename T> friend class NFixedStack;
         NMemoryCard(const NMemoryCard& nmc) = delete;
         NMemoryCard& operator=(const NMemoryCard& nmc) = delete;
         private:
+            /**
+             * \brief The state of a card that is not touched by the accessors while a program runs
+             * \details Kept out of the card object, so the fields used by every access share a single cache line
+             */
+            struct NColdState {
+                std::unordered_map<long long, unsigned long long> locked;
+                unsigned long long lockEpoch = 1;
+                std::vector<std::uint64_t> dirtyPages;
+                std::vector<std::uint64_t> touchedPages;
+                unsigned long long snapshotId = 0;
+            };
+            // the hot fields go first, they are read by every access (see also NVirtualMachineStorage)
             char *storage;
+            std::uint64_t* dirtyBits;
             long long size;
-            std::list<long long> locked;
+            unsigned long long guardMask;
+            long long lockedCount;
+            std::unique_ptr<NColdState> cold;
+            NMemoryCardMode mode;
+            void markDirty(long long index);
+            void markDirtyRange(long long index, long long length);
+            void resizePageMaps();
+            unsigned long long windowIndex(long long index);
+            long long getPageCount();
             bool isLocked(long long index);
+            bool isRangeLocked(long long index, long long length);
+            template<typename T> T getWideAt(long long index);
+            template<typename T> void setWideAt(long long index, T value);
+            void writeRegion(long long index, const char* values, long long count);
+        protected:
+            bool readOnly;
+            void makeReadOnly(const char* contents);
+            void rejectWrite();
+            void load(std::istream& in, long long minimalSize);
         public:
-            explicit NMemoryCard(long long size);
+            explicit NMemoryCard(long long size, NMemoryCardMode mode = CHECKED);
             ~NMemoryCard();
             void lockCell(long long index);
             void unlockCell(long long index);
+            void unlockAll();
             long long getSize();
+            void resize(long long newSize);
             void setValueAt(long long index, char value);
             char getValueAt(long long index);
+            char getValueAtUnchecked(long long index);
+            void setValueAtUnchecked(long long index, char value);
+            bool allowsUnchecked(long long extent);
+            template<typename F> void guarded(F body);
+            NMemoryCardMode getMode();
+            std::uint16_t getU16(long long index);
+            std::uint32_t getU32(long long index);
+            std::uint64_t getU64(long long index);
+            void setU16(long long index, std::uint16_t value);
+            void setU32(long long index, std::uint32_t value);
+            void setU64(long long index, std::uint64_t value);
+            void getValuesAt(long long index, char* values, long long count);
+            void setValuesAt(long long index, const char* values, long long count);
             void erase(long long address);
             char pop(long long address);
             void clear();
+            NMemoryCardSnapshot snapshot();
+            void restore(const NMemoryCardSnapshot& saved);
+            long long getDirtyPageCount();
+            unsigned long long getSnapshotId();
+            void save(std::ostream& out);
+            void load(std::istream& in);
     };
 
+    void NMemoryCard::markDirty(long long index) {
+        this->dirtyBits[index >> (NERVI_TRACKED_PAGE_SHIFT + 6)] |= 1ull << ((index >> NERVI_TRACKED_PAGE_SHIFT) & 63);
+    }
+
+    void NMemoryCard::markDirtyRange(long long index, long long length) {
+        for (long long page = index >> NERVI_TRACKED_PAGE_SHIFT; length > 0 && page <= (index + length - 1) >> NERVI_TRACKED_PAGE_SHIFT; page++) {
+            this->dirtyBits[page >> 6] |= 1ull << (page & 63);
+        }
+    }
+
+    long long NMemoryCard::getPageCount() {
+        return (this->size + (1ll << NERVI_TRACKED_PAGE_SHIFT) - 1) >> NERVI_TRACKED_PAGE_SHIFT;
+    }
+
+    void NMemoryCard::resizePageMaps() {
+        long long words = (this->getPageCount() + 63) / 64;
+        this->cold->dirtyPages.resize(words, 0);
+        this->cold->touchedPages.resize(words, 0);
+        this->dirtyBits = this->cold->dirtyPages.data();
+    }
+
     bool NMemoryCard::isLocked(long long index) {
         if (index < 0 || index > this->size - 1) {
             throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index: {} (expected positive and less than {})", index, this->size));
         }
+        else if (this->lockedCount == 0) {
+            return false;
+        }
         else {
-            for (auto iterator = this->locked.cbegin(); iterator != this->locked.cend(); iterator++) {
-                if (*iterator == index) {
+            auto iterator = this->cold->locked.find(index);
+            return iterator != this->cold->locked.end() && iterator->second == this->cold->lockEpoch;
+        }
+    }
+
+    bool NMemoryCard::isRangeLocked(long long index, long long length) {
+        if (this->lockedCount == 0) {
+            return false;
+        }
+        if (length > (long long) this->cold->locked.size()) {
+            for (auto iterator = this->cold->locked.cbegin(); iterator != this->cold->locked.cend(); iterator++) {
+                if (iterator->second == this->cold->lockEpoch && iterator->first >= index && iterator->first < index + length) {
                     return true;
                 }
             }
-            return false;
         }
+        else {
+            for (long long cell = index; cell < index + length; cell++) {
+                auto iterator = this->cold->locked.find(cell);
+                if (iterator != this->cold->locked.end() && iterator->second == this->cold->lockEpoch) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    template<typename T>
+    T NMemoryCard::getWideAt(long long index) {
+        if (index < 0 || index > this->size - (long long) sizeof(T)) {
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index: {} (expected positive and less than {} for a {}-byte value)", index, this->size - (long long) sizeof(T) + 1, sizeof(T)));
+        }
+        T value;
+        memcpy(&value, this->storage + index, sizeof(T));
+        if constexpr (std::endian::native == std::endian::big) {
+            if constexpr (sizeof(T) == 2) value = __builtin_bswap16(value);
+            else if constexpr (sizeof(T) == 4) value = __builtin_bswap32(value);
+            else value = __builtin_bswap64(value);
+        }
+        return value;
+    }
+
+    template<typename T>
+    void NMemoryCard::setWideAt(long long index, T value) {
+        if (index < 0 || index > this->size - (long long) sizeof(T)) {
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index: {} (expected positive and less than {} for a {}-byte value)", index, this->size - (long long) sizeof(T) + 1, sizeof(T)));
+        } else if (this->readOnly) {
+            this->rejectWrite();
+        } else if (this->isRangeLocked(index, sizeof(T))) {
+            throw NerviInternalExceptions::LockedAddressException(fmt::format("Memory range [{}, {}) contains a write-locked cell!", index, index + (long long) sizeof(T)));
+        }
+        if constexpr (std::endian::native == std::endian::big) {
+            if constexpr (sizeof(T) == 2) value = __builtin_bswap16(value);
+            else if constexpr (sizeof(T) == 4) value = __builtin_bswap32(value);
+            else value = __builtin_bswap64(value);
+        }
+        memcpy(this->storage + index, &value, sizeof(T));
+        this->markDirty(index);
+        this->markDirty(index + sizeof(T) - 1);
     }
 
     /**
      * \brief The NMemoryCard constructor that initializes memory array
-     * \details Creates an array with desired length and fills it with zero values
+     * \details Creates an array with desired length filled with zero values. The array is a page mapping, so its pages are not committed until touched.
+     * In the GUARDED mode the array is followed by PROT_NONE guard pages that cover the whole addressing window of the unchecked accessors
      * \param size The size of storage array in bytes. Max is 2^64 - 1 bytes (long long max value)
+     * \param mode The mode of addressing the card, CHECKED by default
      */
-    NMemoryCard::NMemoryCard(long long size) {
+    NMemoryCard::NMemoryCard(long long size, NMemoryCardMode mode) {
         this->size = size;
-        this->storage = new char[size];
-        memset(this->storage, 0, size);
+        this->mode = mode;
+#ifdef NERVI_GUARD_PAGES
+        if (mode == GUARDED) {
+            this->storage = NerviGuardPages::allocate(size);
+            this->guardMask = NerviGuardPages::windowSize(size) - 1;
+        } else {
+            this->storage = NerviPagedMemory::allocate(size);
+            this->guardMask = ~0ull;
+        }
+#else
+        this->storage = NerviPagedMemory::allocate(size);
+        this->guardMask = ~0ull;
+#endif
+        this->lockedCount = 0;
+        this->readOnly = false;
+        this->cold = std::make_unique<NColdState>();
+        this->resizePageMaps();
+    }
+
+    /**
+     * \brief Turns the card into a read-only one
+     * \details Copies the contents into the storage and then write-protects its pages, so even the unchecked accessors cannot change it.
+     * All the writing methods of a read-only card throw ReadOnlyMemoryException without looking at the cell locks
+     * \param contents The values of the cells, the amount must be equal to the size of the card
+     */
+    void NMemoryCard::makeReadOnly(const char* contents) {
+        memcpy(this->storage, contents, this->size);
+#ifdef NERVI_GUARD_PAGES
+        if (this->size > 0) {
+            long long lead = this->mode == GUARDED ? NerviPagedMemory::roundToPages(this->size) - this->size : 0;
+            mprotect(this->storage - lead, NerviPagedMemory::roundToPages(this->size), PROT_READ);
+        }
+#endif
+        this->readOnly = true;
+    }
+
+    void NMemoryCard::rejectWrite() {
+        throw NerviInternalExceptions::ReadOnlyMemoryException(fmt::format("The memory card of size {} is read-only!", this->size));
     }
 
     /**
      * \brief The NMemoryCard destructor that releases all its used resources.
-     * \details Deletes the memory array, clears the list of the locked addresses and defines its size as 0
+     * \details Deletes the memory array, clears the map of the locked addresses and defines its size as 0
      */
     NMemoryCard::~NMemoryCard() {
-        delete[] this->storage;
+#ifdef NERVI_GUARD_PAGES
+        if (this->mode == GUARDED) {
+            NerviGuardPages::release(this->storage, this->size);
+        } else {
+            NerviPagedMemory::release(this->storage, this->size);
+        }
+#else
+        NerviPagedMemory::release(this->storage, this->size);
+#endif
         this->size = 0;
-        this->locked.clear();
+        this->cold->locked.clear();
     }
 
     /**
      * \brief Locks a cell of the memory array
-     * \details Sets a memory array cell's status as write-locked. It pushes back the index to the list of the locked
+     * \details Sets a memory array cell's status as write-locked. The cells of a read-only card are always write-protected, so nothing happens for them. It tags the index in the map of the locked with the current lock epoch.
+     * Entries left from the previous epochs are dropped once they outnumber the live ones, so the map stays proportional to the locked cells
      * \param index The address of a cell to lock
      * \throw InvalidIndexException If the index is out of bounds of the storage array
      */
@@ -86,14 +384,21 @@ namespace NerviKernel {
         if (index < 0 || index > this->size - 1) {
             throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index to block: {} (expected positive and less than {})", index, this->size));
         }
-        else {
-            this->locked.push_back(index);
+        else if (!this->readOnly) {
+            if (this->cold->locked.size() >= 2 * (unsigned long long) this->lockedCount + 64) {
+                std::erase_if(this->cold->locked, [this](const auto& entry) { return entry.second != this->cold->lockEpoch; });
+            }
+            unsigned long long& epoch = this->cold->locked[index];
+            if (epoch != this->cold->lockEpoch) {
+                epoch = this->cold->lockEpoch;
+                this->lockedCount++;
+            }
         }
     }
 
     /**
      * \brief Unlocks a cell of the memory array
-     * \details Unlocks a storage cell from write-protection. It erases the cell to unlock from the list of the locked,
+     * \details Unlocks a storage cell from write-protection. It erases the cell to unlock from the map of the locked,
      * but if the required cell is not locked nothing happens
      * \param index The address of an cell to unlock
      * \throw InvalidIndexException If the index is out of bounds of the storage array
@@ -102,16 +407,29 @@ namespace NerviKernel {
         if (index < 0 || index > this->size - 1) {
             throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index to block: {} (expected positive and less than {})", index, this->size));
         }
-        else {
-            for (auto iterator = this->locked.cbegin(); iterator != this->locked.cend(); iterator++) {
-                if (*iterator == index) {
-                    this->locked.erase(iterator);
-                    break;
+        else if (!this->readOnly) {
+            auto iterator = this->cold->locked.find(index);
+            if (iterator != this->cold->locked.end()) {
+                if (iterator->second == this->cold->lockEpoch) {
+                    this->lockedCount--;
                 }
+                this->cold->locked.erase(iterator);
             }
         }
     }
 
+    /**
+     * \brief Unlocks all cells of the memory array
+     * \details Starts a new lock epoch, so every lock made before becomes stale. Takes constant time regardless of the amount of the locked cells
+     */
+    void NMemoryCard::unlockAll() {
+        if (this->readOnly) {
+            return;
+        }
+        this->cold->lockEpoch++;
+        this->lockedCount = 0;
+    }
+
     /**
      * \brief Returns the size of the storage
      * \return The size of the storage
@@ -120,18 +438,65 @@ namespace NerviKernel {
         return this->size;
     }
 
+    /**
+     * \brief Changes the size of the storage
+     * \details Grows or shrinks the memory array keeping the values of the cells below the new size. The mapping is resized in place
+     * (with mremap on Linux), so growing does not copy the stored data and the new cells are zero, while shrinking returns the tail pages to the OS.
+     * The locks of the cells that do not fit into the new size are dropped.
+     * A GUARDED card has to move its storage in front of a new guard reservation, so its contents are copied.
+     * The dirty page maps are resized as well and the next restore of a snapshot copies all saved pages
+     * \param newSize The new size of the storage array in bytes
+     * \throw InvalidIndexException If the new size is negative
+     * \throw std::bad_alloc If the memory array cannot be resized. The card stays unchanged in this case
+     * \throw ReadOnlyMemoryException If the card is read-only
+     */
+    void NMemoryCard::resize(long long newSize) {
+        if (this->readOnly) {
+            this->rejectWrite();
+        }
+        if (newSize < 0) {
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required size: {} (expected positive)", newSize));
+        }
+#ifdef NERVI_GUARD_PAGES
+        if (this->mode == GUARDED) {
+            char* resized = NerviGuardPages::allocate(newSize);
+            memcpy(resized, this->storage, std::min(this->size, newSize));
+            NerviGuardPages::release(this->storage, this->size);
+            this->storage = resized;
+            this->guardMask = NerviGuardPages::windowSize(newSize) - 1;
+        } else {
+            this->storage = NerviPagedMemory::reallocate(this->storage, this->size, newSize);
+        }
+#else
+        this->storage = NerviPagedMemory::reallocate(this->storage, this->size, newSize);
+#endif
+        this->size = newSize;
+        std::erase_if(this->cold->locked, [this, newSize](const auto& entry) {
+            if (entry.first >= newSize && entry.second == this->cold->lockEpoch) {
+                this->lockedCount--;
+            }
+            return entry.first >= newSize;
+        });
+        this->resizePageMaps();
+        this->cold->snapshotId = 0;
+    }
+
     /**
      * \brief Writes a value to a cell of the memory array at desired index.
      * \param index The address of destination
      * \param value The value to write
      * \throw InvalidIndexException If the index is out of bounds of the storage array
      * \throw LockedAddressException If selected cell is write-locked
+     * \throw ReadOnlyMemoryException If the card is read-only
      */
     void NMemoryCard::setValueAt(long long index, char value) {
-        if (index < 0 || index > this->size) {
+        if (index < 0 || index > this->size - 1) {
             throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index: {} (expected positive and less than {})", index, this->size));
+        } else if (this->readOnly) {
+            this->rejectWrite();
         } else if (!(this->isLocked(index))) {
             this->storage[index] = value;
+            this->markDirty(index);
         } else {
             //std::runtime_error("The required address is write-locked");
             throw NerviInternalExceptions::LockedAddressException(fmt::format("Memory cell with the address {} is write-locked!", index));
@@ -145,37 +510,526 @@ namespace NerviKernel {
      * \throw InvalidIndexException If the index is out of bounds of the storage array
      */
     char NMemoryCard::getValueAt(long long index) {
-        if (index < 0 || index > this->size) {
+        if (index < 0 || index > this->size - 1) {
             throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index: {} (expected positive and less than {})", index, this->size));
         } else {
             return this->storage[index];
         }
     }
 
+    // the window is larger than the storage, so its last byte is always a guard byte; the select compiles to a conditional move,
+    // and a CHECKED card (with the mask of all ones) keeps every index
+    unsigned long long NMemoryCard::windowIndex(long long index) {
+        unsigned long long address = (unsigned long long) index;
+        return address & ~this->guardMask ? this->guardMask : address;
+    }
+
+    /**
+     * \brief Returns a value of a cell of the memory array without comparing the index with the size
+     * \details In the GUARDED mode an index of the addressing window of the card is used as is: an index of the storage reads the cell,
+     * an index of the guard region after it faults. Any index out of the window (a negative one too) is moved to the last byte of the window,
+     * so it faults as well and never aliases a cell. The fault is turned into InvalidIndexException by guarded.
+     * In the CHECKED mode the index is used as is, so it must be proven to be in range by the caller.
+     * On platforms without guard pages the method is the same as getValueAt
+     * \warning Call the method inside guarded or with an index that is known to be in range
+     * \param index The address of a cell to get value
+     * \return The value of selected cell
+     * \throw InvalidIndexException If the index is out of bounds of the storage array (raised by guarded)
+     */
+    char NMemoryCard::getValueAtUnchecked(long long index) {
+#ifdef NERVI_GUARD_PAGES
+        return this->storage[this->windowIndex(index)];
+#else
+        return this->getValueAt(index);
+#endif
+    }
+
+    /**
+     * \brief Writes a value to a cell of the memory array without comparing the index with the size and without checking locks
+     * \details Addresses the storage the same way as getValueAtUnchecked does. The write-locks are not checked,
+     * so the method is meant for the cards that have no locked cells while a program runs.
+     * On platforms without guard pages the method is the same as setValueAt
+     * \warning Call the method inside guarded or with an index that is known to be in range
+     * \param index The address of destination
+     * \param value The value to write
+     * \throw InvalidIndexException If the index is out of bounds of the storage array (raised by guarded)
+     */
+    void NMemoryCard::setValueAtUnchecked(long long index, char value) {
+#ifdef NERVI_GUARD_PAGES
+        unsigned long long address = this->windowIndex(index);
+        this->storage[address] = value;
+        this->markDirty(address);
+#else
+        this->setValueAt(index, value);
+#endif
+    }
+
+    /**
+     * \brief Checks if the unchecked accessors can be used for the cells proven to be below an extent
+     * \details The cells are addressed without checks when the card is writable, has no locked cells and is not smaller than the extent
+     * \param extent The end of the cells
+     * \return True if the unchecked accessors give the same results as the checked ones for the cells
+     */
+    bool NMemoryCard::allowsUnchecked(long long extent) {
+        return !this->readOnly && this->lockedCount == 0 && this->size >= extent;
+    }
+
+    /**
+     * \brief Runs code that uses the unchecked accessors of the card
+     * \details Registers the guard reservation of the card for the calling thread, runs the body and turns a fault on the guard pages
+     * into InvalidIndexException. A write to the storage of a read-only card is turned into ReadOnlyMemoryException.
+     * The scopes of several cards can be nested. A CHECKED card just runs the body. An exception thrown by the body deactivates
+     * the scope and is passed on
+     * \warning The fault leaves the body with siglongjmp, so the objects with non-trivial destructors created inside the body
+     * before the faulting access are not destroyed. Keep such objects outside of the body
+     * \param body The callable to run
+     * \throw InvalidIndexException If the body has accessed a guard page of the card
+     * \throw ReadOnlyMemoryException If the body has written to a read-only card
+     */
+    template<typename F>
+    void NMemoryCard::guarded(F body) {
+#ifdef NERVI_GUARD_PAGES
+        if (this->mode != GUARDED) {
+            body();
+            return;
+        }
+        NerviGuardPages::install();
+        long long lead = NerviPagedMemory::roundToPages(this->size) - this->size;
+        NerviGuardPages::NGuardScope scope;
+        scope.begin = this->storage - lead;
+        scope.end = this->storage + this->guardMask + 1;
+        scope.fault = nullptr;
+        scope.previous = NerviGuardPages::activeScope;
+        if (sigsetjmp(scope.jump, 1) == 0) {
+            NerviGuardPages::activeScope = &scope;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            // the scope dies with this frame, so an exception of the body must not leave it active
+            try {
+                body();
+            } catch (...) {
+                NerviGuardPages::activeScope = scope.previous;
+                throw;
+            }
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            NerviGuardPages::activeScope = scope.previous;
+        } else {
+            NerviGuardPages::activeScope = scope.previous;
+            if (this->readOnly && scope.fault >= this->storage && scope.fault < this->storage + this->size) {
+                this->rejectWrite();
+            }
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index: {} in the window of {} (expected positive and less than {})", scope.fault - this->storage, this->guardMask + 1, this->size));
+        }
+#else
+        body();
+#endif
+    }
+
+    /**
+     * \brief Returns the mode of addressing the card
+     * \return The mode the card has been created in
+     */
+    NMemoryCardMode NMemoryCard::getMode() {
+        return this->mode;
+    }
+
+    /**
+     * \brief Returns a 16-bit value stored in two cells starting at desired index
+     * \details The value is read in little-endian order (the cell at index holds the least significant byte)
+     * with a single bounds check and a single unaligned load
+     * \param index The address of the first cell
+     * \return The value composed of the cells [index, index + 2)
+     * \throw InvalidIndexException If any of the cells is out of bounds of the storage array
+     */
+    std::uint16_t NMemoryCard::getU16(long long index) {
+        return this->getWideAt<std::uint16_t>(index);
+    }
+
+    /**
+     * \brief Returns a 32-bit value stored in four cells starting at desired index
+     * \details The value is read in little-endian order with a single bounds check and a single unaligned load
+     * \param index The address of the first cell
+     * \return The value composed of the cells [index, index + 4)
+     * \throw InvalidIndexException If any of the cells is out of bounds of the storage array
+     */
+    std::uint32_t NMemoryCard::getU32(long long index) {
+        return this->getWideAt<std::uint32_t>(index);
+    }
+
+    /**
+     * \brief Returns a 64-bit value stored in eight cells starting at desired index
+     * \details The value is read in little-endian order with a single bounds check and a single unaligned load
+     * \param index The address of the first cell
+     * \return The value composed of the cells [index, index + 8)
+     * \throw InvalidIndexException If any of the cells is out of bounds of the storage array
+     */
+    std::uint64_t NMemoryCard::getU64(long long index) {
+        return this->getWideAt<std::uint64_t>(index);
+    }
+
+    /**
+     * \brief Writes a 16-bit value to two cells starting at desired index
+     * \details The value is written in little-endian order. The whole range is checked for bounds and write-locks once
+     * and then written with a single unaligned store, so either both cells change or none of them
+     * \param index The address of the first cell
+     * \param value The value to write
+     * \throw InvalidIndexException If any of the cells is out of bounds of the storage array
+     * \throw LockedAddressException If any of the cells is write-locked
+     * \throw ReadOnlyMemoryException If the card is read-only
+     */
+    void NMemoryCard::setU16(long long index, std::uint16_t value) {
+        this->setWideAt<std::uint16_t>(index, value);
+    }
+
+    /**
+     * \brief Writes a 32-bit value to four cells starting at desired index
+     * \details The value is written in little-endian order with a single range check and a single unaligned store
+     * \param index The address of the first cell
+     * \param value The value to write
+     * \throw InvalidIndexException If any of the cells is out of bounds of the storage array
+     * \throw LockedAddressException If any of the cells is write-locked
+     * \throw ReadOnlyMemoryException If the card is read-only
+     */
+    void NMemoryCard::setU32(long long index, std::uint32_t value) {
+        this->setWideAt<std::uint32_t>(index, value);
+    }
+
+    /**
+     * \brief Writes a 64-bit value to eight cells starting at desired index
+     * \details The value is written in little-endian order with a single range check and a single unaligned store
+     * \param index The address of the first cell
+     * \param value The value to write
+     * \throw InvalidIndexException If any of the cells is out of bounds of the storage array
+     * \throw LockedAddressException If any of the cells is write-locked
+     * \throw ReadOnlyMemoryException If the card is read-only
+     */
+    void NMemoryCard::setU64(long long index, std::uint64_t value) {
+        this->setWideAt<std::uint64_t>(index, value);
+    }
+
+    /**
+     * \brief Copies a range of cells into an array
+     * \details The range is checked for bounds once and copied with a single memcpy
+     * \param index The address of the first cell
+     * \param values The array that receives the values
+     * \param count The amount of cells to copy
+     * \throw InvalidIndexException If any of the cells is out of bounds of the storage array
+     */
+    void NMemoryCard::getValuesAt(long long index, char* values, long long count) {
+        if (index < 0 || count < 0 || index > this->size - count) {
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required range: [{}, {}) (expected within {})", index, index + count, this->size));
+        }
+        if (count > 0) {
+            memcpy(values, this->storage + index, count);
+        }
+    }
+
+    /**
+     * \brief Writes an array to a range of cells
+     * \details The range is checked for bounds and write-locks once and written with a single memcpy, so either all cells change or none of them
+     * \param index The address of the first cell
+     * \param values The values to write
+     * \param count The amount of cells to write
+     * \throw InvalidIndexException If any of the cells is out of bounds of the storage array
+     * \throw LockedAddressException If any of the cells is write-locked
+     * \throw ReadOnlyMemoryException If the card is read-only
+     */
+    void NMemoryCard::setValuesAt(long long index, const char* values, long long count) {
+        if (index < 0 || count < 0 || index > this->size - count) {
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required range: [{}, {}) (expected within {})", index, index + count, this->size));
+        } else if (this->readOnly) {
+            this->rejectWrite();
+        } else if (this->isRangeLocked(index, count)) {
+            throw NerviInternalExceptions::LockedAddressException(fmt::format("Memory range [{}, {}) contains a write-locked cell!", index, index + count));
+        }
+        if (count > 0) {
+            memcpy(this->storage + index, values, count);
+            this->markDirtyRange(index, count);
+        }
+    }
+
+    // the writes of the stacks kept in the card (see NFixedStack), which own their region, so the locks of the programs do not apply
+    void NMemoryCard::writeRegion(long long index, const char* values, long long count) {
+        if (index < 0 || count < 0 || index > this->size - count) {
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required range: [{}, {}) (expected within {})", index, index + count, this->size));
+        }
+        if (count > 0) {
+            memcpy(this->storage + index, values, count);
+            this->markDirtyRange(index, count);
+        }
+    }
+
     /**
      *
      * \param address
      */
     void NMemoryCard::erase(long long address) {
-        if (address < 0 || address > this->size) {
+        if (address < 0 || address > this->size - 1) {
             throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index: {} (expected positive and less than {})", address, this->size));
+        } else if (this->readOnly) {
+            this->rejectWrite();
         } else {
             this->storage[address] = 0;
+            this->markDirty(address);
         }
     }
 
     char NMemoryCard::pop(long long address) {
-        if (address < 0 || address > this->size) {
+        if (address < 0 || address > this->size - 1) {
             throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required index: {} (expected positive and less than {})", address, this->size));
+        } else if (this->readOnly) {
+            this->rejectWrite();
+            return 0;
         } else {
             char temp = this->storage[address];
             this->storage[address] = 0;
+            this->markDirty(address);
             return temp;
         }
     }
 
     void NMemoryCard::clear() {
+        if (this->readOnly) {
+            this->rejectWrite();
+        }
         memset(this->storage, 0, size);
+        std::fill(this->cold->dirtyPages.begin(), this->cold->dirtyPages.end(), ~0ull);
+        if (this->getPageCount() % 64 != 0) {
+            this->cold->dirtyPages.back() = (1ull << (this->getPageCount() % 64)) - 1;
+        }
+    }
+
+    /**
+     * \brief Saves the state of the card
+     * \details Copies the pages that can contain non-zero values (the ones written since the card has been created) and the locked cells.
+     * The pages that have never been written are not copied. The snapshot becomes the reference point of the dirty page tracking,
+     * so restoring this snapshot later copies only the pages written after it
+     * \return The snapshot of the card
+     */
+    NMemoryCardSnapshot NMemoryCard::snapshot() {
+        static std::atomic<unsigned long long> lastId = 0;
+        NMemoryCardSnapshot saved;
+        saved.id = ++lastId;
+        saved.size = this->size;
+        bool hasPages = false;
+        for (unsigned long long word = 0; word < this->cold->touchedPages.size(); word++) {
+            this->cold->touchedPages[word] |= this->cold->dirtyPages[word];
+            this->cold->dirtyPages[word] = 0;
+            hasPages |= this->cold->touchedPages[word] != 0;
+        }
+        saved.touched = this->cold->touchedPages;
+        if (hasPages) {
+            saved.contents = NerviPagedMemory::allocate(this->size);
+            long long pageCount = this->getPageCount(), pageSize = 1ll << NERVI_TRACKED_PAGE_SHIFT;
+            for (long long page = 0; page < pageCount; page++) {
+                if (saved.touched[page >> 6] & (1ull << (page & 63))) {
+                    long long offset = page << NERVI_TRACKED_PAGE_SHIFT;
+                    memcpy(saved.contents + offset, this->storage + offset, std::min(pageSize, this->size - offset));
+                }
+            }
+        }
+        if (this->lockedCount != 0) {
+            for (auto iterator = this->cold->locked.cbegin(); iterator != this->cold->locked.cend(); iterator++) {
+                if (iterator->second == this->cold->lockEpoch) {
+                    saved.locks.push_back(iterator->first);
+                }
+            }
+        }
+        this->cold->snapshotId = saved.id;
+        return saved;
+    }
+
+    /**
+     * \brief Restores a saved state of the card
+     * \details If the snapshot is the last one made or restored on the card, only the pages written after it are copied back (or zeroed
+     * if they have not been saved), so the cost depends on the amount of the changed pages rather than on the size of the card.
+     * Otherwise (another snapshot in between, a resize) all the pages that can differ are restored.
+     * The size of the card and the locked cells are restored as well
+     * \param saved The snapshot made by this card
+     * \throw ReadOnlyMemoryException If the card is read-only and the snapshot has a different size
+     */
+    void NMemoryCard::restore(const NMemoryCardSnapshot& saved) {
+        if (saved.size != this->size) {
+            this->resize(saved.size);
+        }
+        bool delta = saved.id == this->cold->snapshotId;
+        long long pageCount = this->getPageCount(), pageSize = 1ll << NERVI_TRACKED_PAGE_SHIFT;
+        for (long long word = 0; word * 64 < pageCount; word++) {
+            std::uint64_t pages = delta ? this->cold->dirtyPages[word] : this->cold->dirtyPages[word] | this->cold->touchedPages[word] | saved.touched[word];
+            while (pages != 0) {
+                long long page = word * 64 + std::countr_zero(pages);
+                pages &= pages - 1;
+                if (page >= pageCount) {
+                    break;
+                }
+                long long offset = page << NERVI_TRACKED_PAGE_SHIFT, length = std::min(pageSize, this->size - offset);
+                if (saved.touched[word] & (1ull << (page & 63))) {
+                    memcpy(this->storage + offset, saved.contents + offset, length);
+                } else {
+                    memset(this->storage + offset, 0, length);
+                }
+            }
+            this->cold->dirtyPages[word] = 0;
+            if (!delta) {
+                this->cold->touchedPages[word] = saved.touched[word];
+            }
+        }
+        if (this->lockedCount != 0 || !saved.locks.empty()) {
+            this->unlockAll();
+            for (long long index : saved.locks) {
+                this->lockCell(index);
+            }
+        }
+        this->cold->snapshotId = saved.id;
+    }
+
+    /**
+     * \brief Returns the number of the snapshot the dirty page tracking refers to
+     * \return The id of the last snapshot made or restored on the card, or 0 if there is none or the card has been resized after it
+     */
+    unsigned long long NMemoryCard::getSnapshotId() {
+        return this->cold->snapshotId;
+    }
+
+    /**
+     * \brief Returns the amount of pages written since the last snapshot
+     * \details Shows how much a restore of the last snapshot would copy
+     * \return The amount of the dirty pages
+     */
+    long long NMemoryCard::getDirtyPageCount() {
+        long long count = 0;
+        for (std::uint64_t word : this->cold->dirtyPages) {
+            count += std::popcount(word);
+        }
+        return count;
+    }
+
+    /**
+     * \brief Writes the state of the card to a binary stream
+     * \details Writes the size, the locked cells and the non-zero runs of pages. Only the pages that can contain non-zero values
+     * (see snapshot) are examined, the pages that turn out to be zero are skipped and every run of adjacent non-zero pages
+     * is written with a single write call, so a sparse card is saved in time proportional to its used part.
+     * The format is compact and little-endian, it is read back by load:
+     * \code
+     * "NERVIMC1" size lockCount lock... (offset length bytes)... 0 0
+     * \endcode
+     * All the numbers are 64-bit. The failures of writing are reported by the state of the stream
+     * \param out The stream to write to, it has to be opened in the binary mode
+     */
+    void NMemoryCard::save(std::ostream& out) {
+        out.write("NERVIMC1", 8);
+        NerviBinaryStream::writeU64(out, this->size);
+        std::vector<long long> locks;
+        if (this->lockedCount != 0) {
+            for (auto iterator = this->cold->locked.cbegin(); iterator != this->cold->locked.cend(); iterator++) {
+                if (iterator->second == this->cold->lockEpoch) {
+                    locks.push_back(iterator->first);
+                }
+            }
+        }
+        NerviBinaryStream::writeU64(out, locks.size());
+        for (long long index : locks) {
+            NerviBinaryStream::writeU64(out, index);
+        }
+        long long pageCount = this->getPageCount(), pageSize = 1ll << NERVI_TRACKED_PAGE_SHIFT, runStart = -1, runEnd = -1;
+        for (long long page = 0; page <= pageCount; page++) {
+            bool used = false;
+            if (page < pageCount && ((this->cold->touchedPages[page >> 6] | this->cold->dirtyPages[page >> 6]) & (1ull << (page & 63)))) {
+                const char* contents = this->storage + (page << NERVI_TRACKED_PAGE_SHIFT);
+                long long length = std::min(pageSize, this->size - (page << NERVI_TRACKED_PAGE_SHIFT));
+                used = contents[0] != 0 || memcmp(contents, contents + 1, length - 1) != 0;
+            }
+            if (used && runStart < 0) {
+                runStart = page << NERVI_TRACKED_PAGE_SHIFT;
+            }
+            if (used) {
+                runEnd = std::min((page + 1) << NERVI_TRACKED_PAGE_SHIFT, this->size);
+            } else if (runStart >= 0) {
+                NerviBinaryStream::writeU64(out, runStart);
+                NerviBinaryStream::writeU64(out, runEnd - runStart);
+                out.write(this->storage + runStart, runEnd - runStart);
+                runStart = -1;
+            }
+        }
+        NerviBinaryStream::writeU64(out, 0);
+        NerviBinaryStream::writeU64(out, 0);
+    }
+
+    /**
+     * \brief Reads the state of the card written by save
+     * \details Resizes the card, zeroes the pages that can contain non-zero values and reads the saved runs right into the storage,
+     * checking every part of the input before using it. The locked cells are replaced by the saved ones.
+     * The loaded pages are tracked as written, and the next restore of a snapshot restores all the saved pages
+     * \param in The stream to read from, it has to be opened in the binary mode
+     * \throw InvalidStateException If the input is not a saved state of a card or ends too early. The contents of the card are unspecified then
+     * \throw ReadOnlyMemoryException If the card is read-only
+     * \throw std::bad_alloc If the card cannot be resized to the saved size
+     */
+    void NMemoryCard::load(std::istream& in) {
+        this->load(in, 0);
+    }
+
+    /**
+     * \brief Reads the state of the card written by save if its size is not less than a minimum
+     * \details The same as load, but a saved card smaller than the minimum is rejected before the card is changed
+     * \param in The stream to read from, it has to be opened in the binary mode
+     * \param minimalSize The least size of the card the owner can work with
+     * \throw InvalidStateException If the input is not a saved state of a card, ends too early or the saved size is less than the minimum.
+     * The card stays unchanged if the header is invalid, otherwise its contents are unspecified
+     * \throw ReadOnlyMemoryException If the card is read-only
+     * \throw std::bad_alloc If the card cannot be resized to the saved size
+     */
+    void NMemoryCard::load(std::istream& in, long long minimalSize) {
+        if (this->readOnly) {
+            this->rejectWrite();
+        }
+        NerviBinaryStream::expectSignature(in, "NERVIMC1");
+        std::uint64_t newSize = NerviBinaryStream::readU64(in), lockCount = NerviBinaryStream::readU64(in);
+        if (newSize < (std::uint64_t) minimalSize) {
+            throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved memory size: {} (expected at least {})", newSize, minimalSize));
+        }
+        if (newSize > (std::uint64_t) std::numeric_limits<long long>::max() || lockCount > newSize) {
+            throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved card: size {}, {} locked cells", newSize, lockCount));
+        }
+        // the locks are read one by one: the saved count is not trusted with an allocation, the list only grows with the input
+        std::vector<long long> locks;
+        for (std::uint64_t lock = 0; lock < lockCount; lock++) {
+            std::uint64_t read = NerviBinaryStream::readU64(in);
+            if (read >= newSize) {
+                throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved locked cell: {} (expected less than {})", read, newSize));
+            }
+            locks.push_back((long long) read);
+        }
+        if ((long long) newSize != this->size) {
+            this->resize((long long) newSize);
+        }
+        long long pageCount = this->getPageCount(), pageSize = 1ll << NERVI_TRACKED_PAGE_SHIFT;
+        for (long long word = 0; word * 64 < pageCount; word++) {
+            std::uint64_t pages = this->cold->touchedPages[word] | this->cold->dirtyPages[word];
+            while (pages != 0) {
+                long long offset = (word * 64 + std::countr_zero(pages)) << NERVI_TRACKED_PAGE_SHIFT;
+                pages &= pages - 1;
+                memset(this->storage + offset, 0, std::min(pageSize, this->size - offset));
+            }
+            this->cold->dirtyPages[word] |= this->cold->touchedPages[word];
+        }
+        std::uint64_t end = 0;
+        while (true) {
+            std::uint64_t offset = NerviBinaryStream::readU64(in), length = NerviBinaryStream::readU64(in);
+            if (length == 0) {
+                break;
+            }
+            if (offset < end || offset > newSize || length > newSize - offset) {
+                throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved range: [{}, {}) (expected ascending ranges within {})", offset, offset + length, newSize));
+            }
+            NerviBinaryStream::readBytes(in, this->storage + offset, (long long) length);
+            this->markDirtyRange((long long) offset, (long long) length);
+            end = offset + length;
+        }
+        this->unlockAll();
+        for (long long index : locks) {
+            this->lockCell(index);
+        }
+        this->cold->snapshotId = 0;
     }
 
 }
@@ -8,12 +8,15 @@
 
 
 #include <memory.h>
-#include <list>
-#include <stack>
+#include <vector>
+#include <memory>
 #include <kernel/error/internal.h>
 #include <kernel/storage/registers.h>
 #include <kernel/constant/regadresses.h>
+#include <kernel/constant/limits.h>
 #include <kernel/storage/memorycard.h>
+#include <kernel/storage/romcard.h>
+#include <kernel/storage/nstack.h>
 #include <stdexcept>
 #include <fmt/core.h>
 
@@ -28,47 +31,214 @@
 
 namespace NerviKernel {
 
+    /**
+     * \brief The placements of the stacks of a virtual machine
+     * \details Defines where NVirtualMachineStorage keeps its data stack and return stack
+     */
+    enum NStackPlacement {
+        HOST_STACKS, /// Both stacks are reserved in the host memory separately from the machine's memory
+        MEMORY_STACKS /// Both stacks are kept in a region at the end of the machine's memory, only their top segments are kept in the object
+    };
+
+    /**
+     * \brief A class of a saved state of a virtual machine
+     * \details Stores the registers with the IP, both stacks, the locked cells and the memory of a NVirtualMachineStorage.
+     * A snapshot is made by NVirtualMachineStorage::snapshot and restored by NVirtualMachineStorage::restore of the same machine.
+     * The attached discs are not a part of the snapshot. The class objects can be moved but not copied
+     */
+    class NVirtualMachineSnapshot {
+        friend class NVirtualMachineStorage;
+    private:
+        NMemoryCardSnapshot memory;
+        NRegisters registers;
+        std::vector<char> stack;
+        std::vector<long long> retStack;
+        std::vector<char> windowBank, windowSpill;
+        long long windowIndex;
+        explicit NVirtualMachineSnapshot(NMemoryCardSnapshot memory);
+    public:
+        NMemoryCardSnapshot& getMemory();
+    };
+
+    NVirtualMachineSnapshot::NVirtualMachineSnapshot(NMemoryCardSnapshot memory): memory(std::move(memory)) {}
+
+    /**
+     * \brief Returns the snapshot of the machine's memory
+     * \return The saved state of the disc 0
+     */
+    NMemoryCardSnapshot& NVirtualMachineSnapshot::getMemory() {
+        return this->memory;
+    }
+
     /**
     * \brief Represents the class of an internal memory device of a virtual machine
     * \details The class is for storing char values in an array, whose size is immutable and limited my the max value of the type long long.
-    * Also provides an opportunity to protect cells from writing (i.e. locking), the indexes of th locked are stored in a list
+    * Also provides an opportunity to protect cells from writing (i.e. locking), the indexes of th locked are stored in a hash map tagged with lock epochs.
+    * The storage itself is the disc 0 of the machine, other memory cards (e.g. shared NRomCard objects) can be attached as the discs with greater numbers.
+    * The state used by every instruction (the card's storage pointer, size and dirty map, the registers with the IP and the data stack pointers)
+    * takes the first two cache lines of the object, the lock map, page maps and the discs are kept behind pointers.
+    * A machine created with a non-zero window depth has register windows: the common purpose registers EAX..EBD are a window into a bank,
+    * and a call (pushReturnAddress) moves the window by NERVI_REGISTER_WINDOW_STEP registers instead of saving anything, a return (popReturn, returnJump)
+    * moves it back. The windows overlap, so the registers FCX..EBD of a caller are EAX..FBX of its callee and pass the arguments and the results,
+    * while the caller's EAX..FBX are preserved by the call. The bank holds the given amount of windows, the oldest windows are spilled
+    * to the host memory only when the calls nest deeper than that:
+    * \code
+    * NerviKernel::NVirtualMachineStorage machine(65536, NerviKernel::NERVI_DEFAULT_STACK_LIMIT, NerviKernel::NERVI_DEFAULT_RETURN_STACK_LIMIT, 8);
+    * machine.pushToRegister(NerviKernel::FCX, 1); //an argument
+    * machine.pushReturnAddress(machine.getIP() + 1); //now EAX is 1
+    * \endcode
+    * A machine created with MEMORY_STACKS keeps the stacks in its own memory: the card is enlarged by the stack region (stackLimit bytes
+    * of the data stack followed by returnLimit addresses of the return stack) right after the first size cells. Only the top segments of the stacks
+    * are kept in the object, so the host memory of the machine is bounded by the size of its card and is accounted together with it.
+    * The programs see only the first size cells (getProgramSize): the accessors of the cells (getValueAt, setU16, setValuesAt and so on)
+    * of the storage throw InvalidIndexException for the cells of the region, so no command can forge the stacks, and the decoded programs
+    * (NDecodedProgram) reject them at once, so the compiled and verified programs never address the region either.
+    * The locks of the region do not affect the stacks. The host can still reach the whole card through the accessors of NMemoryCard.
+    * The card of such a machine cannot be resized or loaded below the end of its stack region
     */
     class NVirtualMachineStorage final: public NMemoryCard{
     private:
-        char *storage;
-        long long size;
-        std::list<long long> locked;
+        // the registers and the data stack pointers share the cache line that follows the hot fields of the card
         NRegisters registers;
-        std::stack<char> stack; std::stack<long long> retStack;
+        char* window;
+        NFixedStack<char> stack;
+        NFixedStack<long long> retStack;
+        long long windowDepth, windowIndex, windowSpills, stackRegion;
+        std::vector<char> windowBank, windowSpill;
+        char* registerCell(NRegisterNames registerName);
+        void checkProgramRange(long long index, long long count);
+        void rejectStackRegion(long long index, long long count);
+        long long getStackRegionEnd();
+        void enterWindow();
+        void leaveWindow();
+        template<typename T> NStackStatus pushWideToStack(T value);
+        template<typename T> NStackStatus popWideStack(T& value);
+        template<typename T> T getWideRegister(NWideRegisterNames view);
+        template<typename T> void pushToWideRegister(NWideRegisterNames view, T value);
+        std::vector<std::shared_ptr<NMemoryCard>> discs;
     public:
-        explicit NVirtualMachineStorage(long long size);
+        explicit NVirtualMachineStorage(long long size, long long stackLimit = NERVI_DEFAULT_STACK_LIMIT, long long returnLimit = NERVI_DEFAULT_RETURN_STACK_LIMIT, long long windowDepth = 0, NStackPlacement placement = HOST_STACKS);
         ~NVirtualMachineStorage();
         //void lockCell(long long index);
         //void unlockCell(long long index);
         //long long getSize();
-        //void setValueAt(long long index, char value);
-        //char getValueAt(long long index);
+        void resize(long long newSize);
+        void setValueAt(long long index, char value);
+        char getValueAt(long long index);
+        std::uint16_t getU16(long long index);
+        std::uint32_t getU32(long long index);
+        std::uint64_t getU64(long long index);
+        void setU16(long long index, std::uint16_t value);
+        void setU32(long long index, std::uint32_t value);
+        void setU64(long long index, std::uint64_t value);
+        void getValuesAt(long long index, char* values, long long count);
+        void setValuesAt(long long index, const char* values, long long count);
         void pushToRegister(NerviKernel::NRegisterNames registerName, char value);
         char getRegister(NerviKernel::NRegisterNames registerName);
+        template<NRegisterNames R> char reg();
+        template<NRegisterNames R> void setReg(char value);
+        std::uint16_t getRegister16(NWideRegisterNames view);
+        std::uint32_t getRegister32(NWideRegisterNames view);
+        std::uint64_t getRegister64(NWideRegisterNames view);
+        void pushToRegister16(NWideRegisterNames view, std::uint16_t value);
+        void pushToRegister32(NWideRegisterNames view, std::uint32_t value);
+        void pushToRegister64(NWideRegisterNames view, std::uint64_t value);
+        template<NWideRegisterNames V> auto wideReg();
+        template<NWideRegisterNames V> void setWideReg(auto value);
         long long getIP();
-        void pushToStack(char value);
-        void pushReturnAddress(long long address);
-        char popStack();
-        long long popReturn();
-        void returnJump();
+        long long getProgramSize();
+        NStackStatus pushToStack(char value);
+        NStackStatus pushToStackN(const char* values, long long count);
+        NStackStatus pushToStackU16(std::uint16_t value);
+        NStackStatus pushToStackU32(std::uint32_t value);
+        NStackStatus pushToStackU64(std::uint64_t value);
+        NStackStatus pushReturnAddress(long long address);
+        NStackStatus popStack(char& value);
+        NStackStatus popStackN(char* values, long long count);
+        NStackStatus popStackU16(std::uint16_t& value);
+        NStackStatus popStackU32(std::uint32_t& value);
+        NStackStatus popStackU64(std::uint64_t& value);
+        long long getStackDepth();
+        NStackStatus popReturn(long long& address);
+        NStackStatus returnJump();
+        long long getReturnDepth();
+        long long getStackHighWaterMark();
+        long long getReturnHighWaterMark();
+        long long getWindowDepth();
+        long long getWindowSpillCount();
         void jump(long long destination);
         void jumpNext();
+        void attachDisc(short discNumber, std::shared_ptr<NMemoryCard> card);
+        void detachDisc(short discNumber);
+        NMemoryCard* getDisc(short discNumber);
+        short getDiscCount();
+        NVirtualMachineSnapshot snapshot();
+        void restore(const NVirtualMachineSnapshot& saved);
+        void save(std::ostream& out);
+        void load(std::istream& in);
     };
 
     /**
      * \brief The NVirtualMachineStorage constructor that creates a null-determined storage device.
      * \details Initializes storage's memory array with the defined size and initializes its cells with zeros
      * \param size The size of storage array in bytes. Max is 2^64 - 1 bytes
+     * \param stackLimit The capacity of the data stack in bytes. The stack is reserved at once and never grows beyond the limit
+     * \param returnLimit The maximal depth of the return stack, i.e. of nested calls. The stack is reserved at once as well
+     * \param windowDepth The amount of register windows kept in the bank, 0 (by default) disables register windows
+     * \param placement Where the stacks are kept, HOST_STACKS by default
      */
-    NVirtualMachineStorage::NVirtualMachineStorage(long long size): NMemoryCard(size) {
+    NVirtualMachineStorage::NVirtualMachineStorage(long long size, long long stackLimit, long long returnLimit, long long windowDepth, NStackPlacement placement):
+        NMemoryCard(placement == MEMORY_STACKS ? size + stackLimit + returnLimit * (long long) sizeof(long long) : size),
+        stack(stackLimit, placement == MEMORY_STACKS ? this : nullptr, size),
+        retStack(returnLimit, placement == MEMORY_STACKS ? this : nullptr, size + stackLimit) {
         memset(this->registers.CHAR_REGS, 0, 27);
         this->registers.IP = 0;
         //this->stack = stack;
+        this->windowDepth = std::max(windowDepth, 0ll);
+        this->windowIndex = 0;
+        this->windowSpills = 0;
+        this->stackRegion = placement == MEMORY_STACKS ? size : -1;
+        if (this->windowDepth > 0) {
+            this->windowBank.assign((this->windowDepth + 1) * NERVI_REGISTER_WINDOW_STEP, 0);
+            this->window = this->windowBank.data();
+        } else {
+            this->window = this->registers.CHAR_REGS + EAX;
+        }
+    }
+
+    char* NVirtualMachineStorage::registerCell(NRegisterNames registerName) {
+        return registerName >= EAX && registerName <= EBD ? this->window + (registerName - EAX) : this->registers.CHAR_REGS + registerName;
+    }
+
+    void NVirtualMachineStorage::enterWindow() {
+        const long long step = NERVI_REGISTER_WINDOW_STEP;
+        if (this->windowIndex == this->windowDepth - 1) {
+            // the bank is full, so the older half of the windows goes to the host memory at once
+            long long spilled = std::max(this->windowDepth / 2, 1ll);
+            this->windowSpill.insert(this->windowSpill.end(), this->windowBank.begin(), this->windowBank.begin() + spilled * step);
+            memmove(this->windowBank.data(), this->windowBank.data() + spilled * step, this->windowBank.size() - spilled * step);
+            this->windowIndex -= spilled;
+            this->windowSpills++;
+        }
+        this->windowIndex++;
+        this->window = this->windowBank.data() + this->windowIndex * step;
+    }
+
+    void NVirtualMachineStorage::leaveWindow() {
+        const long long step = NERVI_REGISTER_WINDOW_STEP;
+        if (this->windowIndex == 0) {
+            long long filled = std::min(std::max(this->windowDepth / 2, 1ll), (long long) this->windowSpill.size() / step);
+            if (filled == 0) {
+                return;
+            }
+            // only the lower half of the current window belongs to the caller, the rest of the bank is free
+            memmove(this->windowBank.data() + filled * step, this->windowBank.data(), step);
+            memcpy(this->windowBank.data(), this->windowSpill.data() + this->windowSpill.size() - filled * step, filled * step);
+            this->windowSpill.resize(this->windowSpill.size() - filled * step);
+            this->windowIndex += filled;
+        }
+        this->windowIndex--;
+        this->window = this->windowBank.data() + this->windowIndex * step;
     }
 
     /**
@@ -96,7 +266,7 @@ namespace NerviKernel {
             if (registerName == IP) {
                 throw NerviInternalExceptions::InstructionPointerInterruptionPushException("Trying to push a value into IP with the method pushToRegister has no sense due the difference between char and long long types");
             } else {
-                this->registers.CHAR_REGS[registerName] = value;
+                *this->registerCell(registerName) = value;
             }
         }
     }
@@ -118,11 +288,324 @@ namespace NerviKernel {
             if (registerName == IP) {
                 throw NerviInternalExceptions::InstructionPointerInterruptionPushException("Trying to return the value of the IP with the method getRegister has no sense due the difference between char and long long types");
             } else {
-                return this->registers.CHAR_REGS[registerName];
+                return *this->registerCell(registerName);
             }
         }
     }
 
+    /**
+     * \brief Returns the value of a common register chosen at compile time
+     * \details The compile-time counterpart of getRegister. The register is checked by static_assert, so the method cannot throw.
+     * The windowed registers (EAX to EBD) are read through the window pointer, which points into CHAR_REGS when the windows are disabled:
+     * they cost a load of the pointer and a load of the cell, the other registers a single load at a constant offset.
+     * A constant offset for the windowed registers would need a test of the window depth on every access instead:
+     * \code
+     * char value = storage.reg<NerviKernel::EAX>();
+     * storage.reg<NerviKernel::IP>(); //error
+     * \endcode
+     * \tparam R The name of the register from the enumeration NerviKernel::NRegisterName, except IP
+     * \return The value of the register
+     */
+    template<NRegisterNames R>
+    char NVirtualMachineStorage::reg() {
+        static_assert(R >= PUTC && R < IP, "reg<R>() requires a char register, use getIP for the IP");
+        return *this->registerCell(R);
+    }
+
+    /**
+     * \brief Pushes a value to a common register chosen at compile time
+     * \details The compile-time counterpart of pushToRegister. The register is checked by static_assert, so the method cannot throw.
+     * The windowed registers are written through the window pointer, so they cost a load of the pointer and a store (see reg),
+     * the other registers a single store at a constant offset
+     * \tparam R The name of the register from the enumeration NerviKernel::NRegisterName, except IP
+     * \param value The value to push
+     */
+    template<NRegisterNames R>
+    void NVirtualMachineStorage::setReg(char value) {
+        static_assert(R >= PUTC && R < IP, "setReg<R>() requires a char register, use jump to change the IP");
+        *this->registerCell(R) = value;
+    }
+
+    template<typename T>
+    T NVirtualMachineStorage::getWideRegister(NWideRegisterNames view) {
+        if (view < EAX_EBX || view > FCX_EBD || wideRegisterWidth(view) != sizeof(T)) {
+            throw NerviInternalExceptions::InvalidRegisterException(fmt::format("Invalid required {}-bit register view index: {}", 8 * sizeof(T), int(view)));
+        }
+        T value;
+        memcpy(&value, this->window + (wideRegisterFirst(view) - EAX), sizeof(T));
+        if constexpr (std::endian::native == std::endian::big) {
+            if constexpr (sizeof(T) == 2) value = __builtin_bswap16(value);
+            else if constexpr (sizeof(T) == 4) value = __builtin_bswap32(value);
+            else value = __builtin_bswap64(value);
+        }
+        return value;
+    }
+
+    template<typename T>
+    void NVirtualMachineStorage::pushToWideRegister(NWideRegisterNames view, T value) {
+        if (view < EAX_EBX || view > FCX_EBD || wideRegisterWidth(view) != sizeof(T)) {
+            throw NerviInternalExceptions::InvalidRegisterException(fmt::format("Invalid required {}-bit register view index: {}", 8 * sizeof(T), int(view)));
+        }
+        if constexpr (std::endian::native == std::endian::big) {
+            if constexpr (sizeof(T) == 2) value = __builtin_bswap16(value);
+            else if constexpr (sizeof(T) == 4) value = __builtin_bswap32(value);
+            else value = __builtin_bswap64(value);
+        }
+        memcpy(this->window + (wideRegisterFirst(view) - EAX), &value, sizeof(T));
+    }
+
+    /**
+     * \brief Returns the value of a 16-bit register view
+     * \details Reads the two registers of the view at once, the first one is the least significant byte
+     * \param view The name of a 16-bit view from the enumeration NerviKernel::NWideRegisterNames
+     * \return The value of the view
+     * \throw InvalidRegisterException if the view is unknown or is not 16-bit wide
+     */
+    std::uint16_t NVirtualMachineStorage::getRegister16(NWideRegisterNames view) {
+        return this->getWideRegister<std::uint16_t>(view);
+    }
+
+    /**
+     * \brief Returns the value of a 32-bit register view
+     * \details Reads the four registers of the view at once, the first one is the least significant byte
+     * \param view The name of a 32-bit view from the enumeration NerviKernel::NWideRegisterNames
+     * \return The value of the view
+     * \throw InvalidRegisterException if the view is unknown or is not 32-bit wide
+     */
+    std::uint32_t NVirtualMachineStorage::getRegister32(NWideRegisterNames view) {
+        return this->getWideRegister<std::uint32_t>(view);
+    }
+
+    /**
+     * \brief Returns the value of a 64-bit register view
+     * \details Reads the eight registers of the view at once, the first one is the least significant byte
+     * \param view The name of a 64-bit view from the enumeration NerviKernel::NWideRegisterNames
+     * \return The value of the view
+     * \throw InvalidRegisterException if the view is unknown or is not 64-bit wide
+     */
+    std::uint64_t NVirtualMachineStorage::getRegister64(NWideRegisterNames view) {
+        return this->getWideRegister<std::uint64_t>(view);
+    }
+
+    /**
+     * \brief Pushes a value to a 16-bit register view
+     * \details Writes the two registers of the view at once, the least significant byte goes to the first one
+     * \param view The name of a 16-bit view from the enumeration NerviKernel::NWideRegisterNames
+     * \param value The value to push
+     * \throw InvalidRegisterException if the view is unknown or is not 16-bit wide
+     */
+    void NVirtualMachineStorage::pushToRegister16(NWideRegisterNames view, std::uint16_t value) {
+        this->pushToWideRegister<std::uint16_t>(view, value);
+    }
+
+    /**
+     * \brief Pushes a value to a 32-bit register view
+     * \details Writes the four registers of the view at once, the least significant byte goes to the first one
+     * \param view The name of a 32-bit view from the enumeration NerviKernel::NWideRegisterNames
+     * \param value The value to push
+     * \throw InvalidRegisterException if the view is unknown or is not 32-bit wide
+     */
+    void NVirtualMachineStorage::pushToRegister32(NWideRegisterNames view, std::uint32_t value) {
+        this->pushToWideRegister<std::uint32_t>(view, value);
+    }
+
+    /**
+     * \brief Pushes a value to a 64-bit register view
+     * \details Writes the eight registers of the view at once, the least significant byte goes to the first one
+     * \param view The name of a 64-bit view from the enumeration NerviKernel::NWideRegisterNames
+     * \param value The value to push
+     * \throw InvalidRegisterException if the view is unknown or is not 64-bit wide
+     */
+    void NVirtualMachineStorage::pushToRegister64(NWideRegisterNames view, std::uint64_t value) {
+        this->pushToWideRegister<std::uint64_t>(view, value);
+    }
+
+    /**
+     * \brief Returns the value of a wide register view chosen at compile time
+     * \details The compile-time counterpart of getRegister16, getRegister32 and getRegister64. The result type matches the width of the view
+     * \tparam V The name of the view from the enumeration NerviKernel::NWideRegisterNames
+     * \return The value of the view as std::uint16_t, std::uint32_t or std::uint64_t
+     */
+    template<NWideRegisterNames V>
+    auto NVirtualMachineStorage::wideReg() {
+        static_assert(V >= EAX_EBX && V <= FCX_EBD, "wideReg<V>() requires a wide register view");
+        if constexpr (wideRegisterWidth(V) == 2) return this->getWideRegister<std::uint16_t>(V);
+        else if constexpr (wideRegisterWidth(V) == 4) return this->getWideRegister<std::uint32_t>(V);
+        else return this->getWideRegister<std::uint64_t>(V);
+    }
+
+    /**
+     * \brief Pushes a value to a wide register view chosen at compile time
+     * \details The compile-time counterpart of pushToRegister16, pushToRegister32 and pushToRegister64. The value is truncated to the width of the view
+     * \tparam V The name of the view from the enumeration NerviKernel::NWideRegisterNames
+     * \param value The value to push
+     */
+    template<NWideRegisterNames V>
+    void NVirtualMachineStorage::setWideReg(auto value) {
+        static_assert(V >= EAX_EBX && V <= FCX_EBD, "setWideReg<V>() requires a wide register view");
+        if constexpr (wideRegisterWidth(V) == 2) this->pushToWideRegister<std::uint16_t>(V, value);
+        else if constexpr (wideRegisterWidth(V) == 4) this->pushToWideRegister<std::uint32_t>(V, value);
+        else this->pushToWideRegister<std::uint64_t>(V, value);
+    }
+
+    /**
+     * \brief Returns the size of the memory the programs can address
+     * \details The cells of the stack region of a machine with MEMORY_STACKS follow the memory of the programs and are not counted
+     * \return The size of the memory of the programs
+     */
+    long long NVirtualMachineStorage::getProgramSize() {
+        return this->stackRegion >= 0 ? this->stackRegion : this->getSize();
+    }
+
+    // the accessors of the cells inline the comparison, the exception is built out of line like NMemoryCard::rejectWrite does
+    void NVirtualMachineStorage::checkProgramRange(long long index, long long count) {
+        if (this->stackRegion >= 0 && index > this->stackRegion - count) {
+            this->rejectStackRegion(index, count);
+        }
+    }
+
+    void NVirtualMachineStorage::rejectStackRegion(long long index, long long count) {
+        throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required range: [{}, {}) (the stack region of the machine starts at {})", index, index + count, this->stackRegion));
+    }
+
+    long long NVirtualMachineStorage::getStackRegionEnd() {
+        return this->stackRegion >= 0 ? this->stackRegion + this->stack.getCapacity() + this->retStack.getCapacity() * (long long) sizeof(long long) : 0;
+    }
+
+    /**
+     * \brief Changes the size of the machine's memory
+     * \details The same as NMemoryCard::resize, but the card of a machine with MEMORY_STACKS keeps at least its stack region.
+     * The memory of the programs (getProgramSize) of such a machine does not change
+     * \param newSize The new size of the storage array in bytes
+     * \throw InvalidIndexException If the new size is negative or would cut the stack region. The card stays unchanged then
+     * \throw std::bad_alloc If the memory array cannot be resized. The card stays unchanged in this case
+     */
+    void NVirtualMachineStorage::resize(long long newSize) {
+        if (newSize < this->getStackRegionEnd()) {
+            throw NerviInternalExceptions::InvalidIndexException(fmt::format("Invalid required size: {} (the stack region of the machine ends at {})", newSize, this->getStackRegionEnd()));
+        }
+        NMemoryCard::resize(newSize);
+    }
+
+    /**
+     * \brief Writes a value to a cell of the memory of the programs
+     * \details The same as NMemoryCard::setValueAt, but the cells of the stack region of a machine with MEMORY_STACKS are out of bounds
+     * \param index The address of destination
+     * \param value The value to write
+     * \throw InvalidIndexException If the index is out of bounds of the memory of the programs
+     * \throw LockedAddressException If selected cell is write-locked
+     */
+    void NVirtualMachineStorage::setValueAt(long long index, char value) {
+        this->checkProgramRange(index, 1);
+        NMemoryCard::setValueAt(index, value);
+    }
+
+    /**
+     * \brief Returns a value of a cell of the memory of the programs
+     * \details The same as NMemoryCard::getValueAt, but the cells of the stack region of a machine with MEMORY_STACKS are out of bounds
+     * \param index The address of a cell to get value
+     * \return The value of selected cell
+     * \throw InvalidIndexException If the index is out of bounds of the memory of the programs
+     */
+    char NVirtualMachineStorage::getValueAt(long long index) {
+        this->checkProgramRange(index, 1);
+        return NMemoryCard::getValueAt(index);
+    }
+
+    /**
+     * \brief Returns a 16-bit value stored in two cells of the memory of the programs (see NMemoryCard::getU16)
+     * \param index The address of the first cell
+     * \return The value composed of the cells [index, index + 2)
+     * \throw InvalidIndexException If any of the cells is out of bounds of the memory of the programs
+     */
+    std::uint16_t NVirtualMachineStorage::getU16(long long index) {
+        this->checkProgramRange(index, 2);
+        return NMemoryCard::getU16(index);
+    }
+
+    /**
+     * \brief Returns a 32-bit value stored in four cells of the memory of the programs (see NMemoryCard::getU32)
+     * \param index The address of the first cell
+     * \return The value composed of the cells [index, index + 4)
+     * \throw InvalidIndexException If any of the cells is out of bounds of the memory of the programs
+     */
+    std::uint32_t NVirtualMachineStorage::getU32(long long index) {
+        this->checkProgramRange(index, 4);
+        return NMemoryCard::getU32(index);
+    }
+
+    /**
+     * \brief Returns a 64-bit value stored in eight cells of the memory of the programs (see NMemoryCard::getU64)
+     * \param index The address of the first cell
+     * \return The value composed of the cells [index, index + 8)
+     * \throw InvalidIndexException If any of the cells is out of bounds of the memory of the programs
+     */
+    std::uint64_t NVirtualMachineStorage::getU64(long long index) {
+        this->checkProgramRange(index, 8);
+        return NMemoryCard::getU64(index);
+    }
+
+    /**
+     * \brief Writes a 16-bit value to two cells of the memory of the programs (see NMemoryCard::setU16)
+     * \param index The address of the first cell
+     * \param value The value to write
+     * \throw InvalidIndexException If any of the cells is out of bounds of the memory of the programs
+     * \throw LockedAddressException If any of the cells is write-locked
+     */
+    void NVirtualMachineStorage::setU16(long long index, std::uint16_t value) {
+        this->checkProgramRange(index, 2);
+        NMemoryCard::setU16(index, value);
+    }
+
+    /**
+     * \brief Writes a 32-bit value to four cells of the memory of the programs (see NMemoryCard::setU32)
+     * \param index The address of the first cell
+     * \param value The value to write
+     * \throw InvalidIndexException If any of the cells is out of bounds of the memory of the programs
+     * \throw LockedAddressException If any of the cells is write-locked
+     */
+    void NVirtualMachineStorage::setU32(long long index, std::uint32_t value) {
+        this->checkProgramRange(index, 4);
+        NMemoryCard::setU32(index, value);
+    }
+
+    /**
+     * \brief Writes a 64-bit value to eight cells of the memory of the programs (see NMemoryCard::setU64)
+     * \param index The address of the first cell
+     * \param value The value to write
+     * \throw InvalidIndexException If any of the cells is out of bounds of the memory of the programs
+     * \throw LockedAddressException If any of the cells is write-locked
+     */
+    void NVirtualMachineStorage::setU64(long long index, std::uint64_t value) {
+        this->checkProgramRange(index, 8);
+        NMemoryCard::setU64(index, value);
+    }
+
+    /**
+     * \brief Copies a range of cells of the memory of the programs into an array (see NMemoryCard::getValuesAt)
+     * \param index The address of the first cell
+     * \param values The array that receives the values
+     * \param count The amount of cells to copy
+     * \throw InvalidIndexException If any of the cells is out of bounds of the memory of the programs
+     */
+    void NVirtualMachineStorage::getValuesAt(long long index, char* values, long long count) {
+        this->checkProgramRange(index, count);
+        NMemoryCard::getValuesAt(index, values, count);
+    }
+
+    /**
+     * \brief Writes an array to a range of cells of the memory of the programs (see NMemoryCard::setValuesAt)
+     * \param index The address of the first cell
+     * \param values The values to write
+     * \param count The amount of cells to write
+     * \throw InvalidIndexException If any of the cells is out of bounds of the memory of the programs
+     * \throw LockedAddressException If any of the cells is write-locked
+     */
+    void NVirtualMachineStorage::setValuesAt(long long index, const char* values, long long count) {
+        this->checkProgramRange(index, count);
+        NMemoryCard::setValuesAt(index, values, count);
+    }
+
     /**
      * \brief Returns the value of the IP
      * \details Returns the value of the IP
@@ -132,55 +615,225 @@ namespace NerviKernel {
         return this->registers.IP;
     }
 
+    template<typename T>
+    NStackStatus NVirtualMachineStorage::pushWideToStack(T value) {
+        char bytes[sizeof(T)];
+        for (unsigned i = 0; i < sizeof(T); i++) {
+            bytes[i] = char(value >> (8 * i));
+        }
+        return this->stack.pushN(bytes, sizeof(T));
+    }
+
+    template<typename T>
+    NStackStatus NVirtualMachineStorage::popWideStack(T& value) {
+        unsigned char bytes[sizeof(T)];
+        NStackStatus status = this->stack.popN(reinterpret_cast<char*>(bytes), sizeof(T));
+        if (status == STACK_OK) {
+            value = 0;
+            for (unsigned i = 0; i < sizeof(T); i++) {
+                value |= T(bytes[i]) << (8 * i);
+            }
+        }
+        return status;
+    }
+
     /**
      * \brief Pushes a value to the stack
-     * \details Pushes a value to the stack to use it later in a program. The stack has no program limit
+     * \details Pushes a value to the stack to use it later in a program. The stack is limited by the capacity passed to the constructor
+     * \param value The value to push
+     * \return STACK_OK or STACK_OVERFLOW if the stack is full
+     */
+    NStackStatus NVirtualMachineStorage::pushToStack(char value) {
+        return this->stack.push(value);
+    }
+
+    /**
+     * \brief Pushes several values to the stack at once
+     * \details The values are pushed in their order with a single copy. Either all of them are pushed or none
+     * \param values The values to push
+     * \param count The amount of values
+     * \return STACK_OK or STACK_OVERFLOW if the values do not fit into the stack
+     */
+    NStackStatus NVirtualMachineStorage::pushToStackN(const char* values, long long count) {
+        return this->stack.pushN(values, count);
+    }
+
+    /**
+     * \brief Pushes a 16-bit value to the stack
+     * \details The value occupies two bytes of the stack in little-endian order, like in a memory card. Use popStackU16 to pop it back
+     * \param value The value to push
+     * \return STACK_OK or STACK_OVERFLOW if the value does not fit into the stack
+     */
+    NStackStatus NVirtualMachineStorage::pushToStackU16(std::uint16_t value) {
+        return this->pushWideToStack(value);
+    }
+
+    /**
+     * \brief Pushes a 32-bit value to the stack
+     * \details The value occupies four bytes of the stack in little-endian order. Use popStackU32 to pop it back
+     * \param value The value to push
+     * \return STACK_OK or STACK_OVERFLOW if the value does not fit into the stack
+     */
+    NStackStatus NVirtualMachineStorage::pushToStackU32(std::uint32_t value) {
+        return this->pushWideToStack(value);
+    }
+
+    /**
+     * \brief Pushes a 64-bit value to the stack
+     * \details The value occupies eight bytes of the stack in little-endian order. Use popStackU64 to pop it back
      * \param value The value to push
+     * \return STACK_OK or STACK_OVERFLOW if the value does not fit into the stack
      */
-    void NVirtualMachineStorage::pushToStack(char value) {
-        this->stack.push(value);
+    NStackStatus NVirtualMachineStorage::pushToStackU64(std::uint64_t value) {
+        return this->pushWideToStack(value);
     }
 
     /**
      * \brief Pushes a value to the return stack
-     * \details Pushes a value to the return stack. The values of the stack are used as return addresses. The command 'ret' invokes the method
+     * \details Pushes a value to the return stack. The values of the stack are used as return addresses. The command 'ret' invokes the method.
+     * If the machine has register windows, the window moves to the callee's one
      * \param address The return address to push
+     * \return STACK_OK or STACK_OVERFLOW if the maximal call depth has been reached
      */
-    void NVirtualMachineStorage::pushReturnAddress(long long address) {
-        this->retStack.push(address);
+    NStackStatus NVirtualMachineStorage::pushReturnAddress(long long address) {
+        NStackStatus status = this->retStack.push(address);
+        if (status == STACK_OK && this->windowDepth > 0) {
+            this->enterWindow();
+        }
+        return status;
     }
 
     /**
      * \brief Pops the top value of the stack
-     * \details Deletes the top value of the stack and returns it as the result of this method
+     * \details Deletes the top value of the stack and stores it into the passed variable
+     * \param value The variable that receives the popped value. It is not changed if the stack is empty
+     * \return STACK_OK or STACK_UNDERFLOW if the stack is empty
+     */
+    NStackStatus NVirtualMachineStorage::popStack(char& value) {
+        return this->stack.pop(value);
+    }
+
+    /**
+     * \brief Pops several values from the stack at once
+     * \details The values are stored in the order they have been pushed in, so popStackN is the inverse of pushToStackN
+     * \param values The array that receives the popped values
+     * \param count The amount of values
+     * \return STACK_OK or STACK_UNDERFLOW if the stack contains less values than required
+     */
+    NStackStatus NVirtualMachineStorage::popStackN(char* values, long long count) {
+        return this->stack.popN(values, count);
+    }
+
+    /**
+     * \brief Pops a 16-bit value pushed by pushToStackU16
+     * \param value The variable that receives the popped value. It is not changed if the stack is too shallow
+     * \return STACK_OK or STACK_UNDERFLOW if the stack contains less than two bytes
+     */
+    NStackStatus NVirtualMachineStorage::popStackU16(std::uint16_t& value) {
+        return this->popWideStack(value);
+    }
+
+    /**
+     * \brief Pops a 32-bit value pushed by pushToStackU32
+     * \param value The variable that receives the popped value. It is not changed if the stack is too shallow
+     * \return STACK_OK or STACK_UNDERFLOW if the stack contains less than four bytes
+     */
+    NStackStatus NVirtualMachineStorage::popStackU32(std::uint32_t& value) {
+        return this->popWideStack(value);
+    }
+
+    /**
+     * \brief Pops a 64-bit value pushed by pushToStackU64
+     * \param value The variable that receives the popped value. It is not changed if the stack is too shallow
+     * \return STACK_OK or STACK_UNDERFLOW if the stack contains less than eight bytes
+     */
+    NStackStatus NVirtualMachineStorage::popStackU64(std::uint64_t& value) {
+        return this->popWideStack(value);
+    }
+
+    /**
+     * \brief Returns the amount of bytes in the stack
+     * \return The depth of the data stack
      */
-    char NVirtualMachineStorage::popStack() {
-        char temp = this->stack.top();
-        this->stack.pop();
-        return temp;
+    long long NVirtualMachineStorage::getStackDepth() {
+        return this->stack.getDepth();
     }
 
     /**
      * \brief Pops the top value of the return stack
-     * \details Deletes the top value of the return stack and returns it as the result of this method
+     * \details Deletes the top value of the return stack and stores it into the passed variable.
+     * If the machine has register windows, the window moves back to the caller's one
+     * \param address The variable that receives the popped address. It is not changed if the return stack is empty
+     * \return STACK_OK or STACK_UNDERFLOW if there is no address to return to
      */
-    long long NVirtualMachineStorage::popReturn() {
-        long long temp = this->retStack.top();
-        this->retStack.pop();
-        return temp;
+    NStackStatus NVirtualMachineStorage::popReturn(long long& address) {
+        NStackStatus status = this->retStack.pop(address);
+        if (status == STACK_OK && this->windowDepth > 0) {
+            this->leaveWindow();
+        }
+        return status;
     }
 
     /**
      * \brief Jumps to the last return address
-     * \details Jumps to another command address by changing the value of the IP causing by which executing of a command with required address (i. e. number)
+     * \details Jumps to the last return address stored in the return stack. The address is popped after jumping.
+     * A stray return (with the empty return stack) does not change the IP
+     * \return STACK_OK or STACK_UNDERFLOW if there is no address to return to
+     */
+    NStackStatus NVirtualMachineStorage::returnJump() {
+        long long address;
+        NStackStatus status = this->popReturn(address);
+        if (status == STACK_OK) {
+            this->jump(address);
+        }
+        return status;
+    }
+
+    /**
+     * \brief Returns the amount of addresses in the return stack
+     * \return The current call depth
      */
-    void NVirtualMachineStorage::returnJump() {
-        this->jump(this->popReturn());
+    long long NVirtualMachineStorage::getReturnDepth() {
+        return this->retStack.getDepth();
+    }
+
+    /**
+     * \brief Returns the high-water mark of the data stack
+     * \return The greatest amount of bytes the data stack has contained
+     */
+    long long NVirtualMachineStorage::getStackHighWaterMark() {
+        return this->stack.getHighWaterMark();
+    }
+
+    /**
+     * \brief Returns the high-water mark of the return stack
+     * \details Use the value to choose the return stack limit of the machines that run the same programs
+     * \return The greatest call depth the machine has reached
+     */
+    long long NVirtualMachineStorage::getReturnHighWaterMark() {
+        return this->retStack.getHighWaterMark();
+    }
+
+    /**
+     * \brief Returns the amount of register windows kept in the bank
+     * \return The window depth the machine has been created with, 0 if it has no register windows
+     */
+    long long NVirtualMachineStorage::getWindowDepth() {
+        return this->windowDepth;
+    }
+
+    /**
+     * \brief Returns the amount of window overflows
+     * \details Every overflow spills the older half of the bank to the host memory. Use the value to choose the window depth
+     * \return The amount of calls that have found the bank full
+     */
+    long long NVirtualMachineStorage::getWindowSpillCount() {
+        return this->windowSpills;
     }
 
     /**
      * \brief Jumps to a command address
-     * \details Jumps to the last return address stored in the return stack. The address is popped after jumping
+     * \details Jumps to another command address by changing the value of the IP causing by which executing of a command with required address (i. e. number)
      */
     void NVirtualMachineStorage::jump(long long destination) {
         this->registers.IP = destination;
@@ -193,6 +846,196 @@ namespace NerviKernel {
     void NVirtualMachineStorage::jumpNext() {
         this->registers.IP++;
     }
+
+    /**
+     * \brief Attaches a memory card to the machine as a disc
+     * \details The machine shares the ownership of the card, so the same card (e.g. a NRomCard with constant data) can be attached
+     * to many machines at once. Attaching a card to an occupied disc number replaces the previous card
+     * \param discNumber The number of the disc, starting from 1 (the disc 0 is the machine's own storage)
+     * \param card The card to attach
+     * \throw InvalidDiscException If the disc number is not positive or the card is null
+     */
+    void NVirtualMachineStorage::attachDisc(short discNumber, std::shared_ptr<NMemoryCard> card) {
+        if (discNumber < 1 || card == nullptr) {
+            throw NerviInternalExceptions::InvalidDiscException(fmt::format("Invalid disc to attach: {} (expected a card and a positive number)", discNumber));
+        }
+        if (discNumber >= (short) this->discs.size()) {
+            this->discs.resize(discNumber + 1);
+        }
+        this->discs[discNumber] = std::move(card);
+    }
+
+    /**
+     * \brief Detaches a disc from the machine
+     * \details Releases the machine's share of the card. If the disc is not attached nothing happens
+     * \param discNumber The number of the disc to detach
+     * \throw InvalidDiscException If the disc number is not positive
+     */
+    void NVirtualMachineStorage::detachDisc(short discNumber) {
+        if (discNumber < 1) {
+            throw NerviInternalExceptions::InvalidDiscException(fmt::format("Invalid disc to detach: {} (expected positive)", discNumber));
+        }
+        if (discNumber < (short) this->discs.size()) {
+            this->discs[discNumber].reset();
+        }
+    }
+
+    /**
+     * \brief Returns a disc of the machine
+     * \param discNumber The number of the disc. The number 0 refers to the machine's own storage
+     * \return The memory card attached as the disc
+     * \throw InvalidDiscException If no card is attached as the disc
+     */
+    NMemoryCard* NVirtualMachineStorage::getDisc(short discNumber) {
+        if (discNumber == 0) {
+            return this;
+        }
+        if (discNumber < 0 || discNumber >= (short) this->discs.size() || this->discs[discNumber] == nullptr) {
+            throw NerviInternalExceptions::InvalidDiscException(fmt::format("Invalid required disc: {}", discNumber));
+        }
+        return this->discs[discNumber].get();
+    }
+
+    /**
+     * \brief Saves the state of the machine
+     * \details Saves the registers (with the register windows), the IP, both stacks, the locked cells and the memory (see NMemoryCard::snapshot).
+     * The snapshot becomes the reference point of the dirty tracking of the memory and the stacks
+     * \return The snapshot of the machine
+     */
+    NVirtualMachineSnapshot NVirtualMachineStorage::snapshot() {
+        NVirtualMachineSnapshot saved(NMemoryCard::snapshot());
+        saved.registers = this->registers;
+        this->stack.saveTo(saved.stack);
+        this->retStack.saveTo(saved.retStack);
+        saved.windowBank = this->windowBank;
+        saved.windowSpill = this->windowSpill;
+        saved.windowIndex = this->windowIndex;
+        return saved;
+    }
+
+    /**
+     * \brief Restores a saved state of the machine
+     * \details If the snapshot is the last one made or restored on the machine, only the memory pages written after it
+     * and the parts of the stacks popped after it are copied back, so resetting a machine that has done little work is cheap
+     * regardless of the size of its memory. Otherwise everything that can differ is restored
+     * \param saved The snapshot made by this machine
+     */
+    void NVirtualMachineStorage::restore(const NVirtualMachineSnapshot& saved) {
+        bool delta = saved.memory.getId() == this->getSnapshotId();
+        NMemoryCard::restore(saved.memory);
+        this->registers = saved.registers;
+        this->stack.restoreFrom(saved.stack, delta);
+        this->retStack.restoreFrom(saved.retStack, delta);
+        if (this->windowDepth > 0) {
+            this->windowBank = saved.windowBank;
+            this->windowSpill = saved.windowSpill;
+            this->windowIndex = saved.windowIndex;
+            this->window = this->windowBank.data() + this->windowIndex * NERVI_REGISTER_WINDOW_STEP;
+        }
+    }
+
+    /**
+     * \brief Writes the state of the machine to a binary stream
+     * \details Writes the registers, the IP and both stacks with bulk writes, followed by the memory (see NMemoryCard::save),
+     * so the zero pages of the memory are skipped. The attached discs are not saved:
+     * \code
+     * "NERVIVM1" registers IP stackDepth stack... returnDepth returnStack... windowIndex bankSize bank... spillSize spill... memory
+     * \endcode
+     * The failures of writing are reported by the state of the stream
+     * \param out The stream to write to, it has to be opened in the binary mode
+     */
+    void NVirtualMachineStorage::save(std::ostream& out) {
+        out.write("NERVIVM1", 8);
+        out.write(this->registers.CHAR_REGS, sizeof(this->registers.CHAR_REGS));
+        NerviBinaryStream::writeU64(out, this->registers.IP);
+        std::vector<char> values(this->stack.getDepth());
+        this->stack.copyTo(values.data());
+        NerviBinaryStream::writeU64(out, values.size());
+        out.write(values.data(), values.size());
+        std::vector<long long> addresses(this->retStack.getDepth());
+        this->retStack.copyTo(addresses.data());
+        NerviBinaryStream::writeU64(out, addresses.size());
+        if constexpr (std::endian::native == std::endian::little) {
+            out.write(reinterpret_cast<const char*>(addresses.data()), addresses.size() * sizeof(long long));
+        } else {
+            for (long long address : addresses) {
+                NerviBinaryStream::writeU64(out, address);
+            }
+        }
+        NerviBinaryStream::writeU64(out, this->windowIndex);
+        NerviBinaryStream::writeU64(out, this->windowBank.size());
+        out.write(this->windowBank.data(), this->windowBank.size());
+        NerviBinaryStream::writeU64(out, this->windowSpill.size());
+        out.write(this->windowSpill.data(), this->windowSpill.size());
+        NMemoryCard::save(out);
+    }
+
+    /**
+     * \brief Reads the state of the machine written by save
+     * \details The input is checked while it is read. The registers and the stacks are changed only after the whole state has been read,
+     * the memory is read right into the storage. The attached discs stay attached
+     * \param in The stream to read from, it has to be opened in the binary mode
+     * \throw InvalidStateException If the input is not a saved state of a machine, ends too early, a saved stack exceeds the limit of this machine,
+     * the register windows do not match the window depth of this machine or the saved memory would cut the stack region of this machine.
+     * The registers and the stacks stay unchanged then. The memory stays unchanged too, unless the input ends or is invalid after the header
+     * of the saved memory, its contents are unspecified in this case
+     * \throw std::bad_alloc If the memory cannot be resized to the saved size
+     */
+    void NVirtualMachineStorage::load(std::istream& in) {
+        NerviBinaryStream::expectSignature(in, "NERVIVM1");
+        NRegisters loaded;
+        NerviBinaryStream::readBytes(in, loaded.CHAR_REGS, sizeof(loaded.CHAR_REGS));
+        loaded.IP = (long long) NerviBinaryStream::readU64(in);
+        std::uint64_t depth = NerviBinaryStream::readU64(in);
+        if (depth > (std::uint64_t) this->stack.getCapacity()) {
+            throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved stack depth: {} (the limit is {})", depth, this->stack.getCapacity()));
+        }
+        std::vector<char> values(depth);
+        NerviBinaryStream::readBytes(in, values.data(), depth);
+        depth = NerviBinaryStream::readU64(in);
+        if (depth > (std::uint64_t) this->retStack.getCapacity()) {
+            throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved return stack depth: {} (the limit is {})", depth, this->retStack.getCapacity()));
+        }
+        std::vector<long long> addresses(depth);
+        NerviBinaryStream::readBytes(in, reinterpret_cast<char*>(addresses.data()), depth * sizeof(long long));
+        if constexpr (std::endian::native == std::endian::big) {
+            for (long long& address : addresses) {
+                address = __builtin_bswap64(address);
+            }
+        }
+        std::uint64_t windowIndex = NerviBinaryStream::readU64(in), bankSize = NerviBinaryStream::readU64(in);
+        if (bankSize != this->windowBank.size() || (this->windowDepth > 0 && windowIndex >= (std::uint64_t) this->windowDepth) || (this->windowDepth == 0 && windowIndex != 0)) {
+            throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved register windows: window {} of a {}-byte bank (expected {} windows)", windowIndex, bankSize, this->windowDepth));
+        }
+        std::vector<char> bank(bankSize);
+        NerviBinaryStream::readBytes(in, bank.data(), bankSize);
+        std::uint64_t spillSize = NerviBinaryStream::readU64(in);
+        if (spillSize % NERVI_REGISTER_WINDOW_STEP != 0 || spillSize > (std::uint64_t) this->retStack.getCapacity() * NERVI_REGISTER_WINDOW_STEP) {
+            throw NerviInternalExceptions::InvalidStateException(fmt::format("Invalid saved register window spill: {} bytes", spillSize));
+        }
+        std::vector<char> spill(spillSize);
+        NerviBinaryStream::readBytes(in, spill.data(), spillSize);
+        NMemoryCard::load(in, this->getStackRegionEnd());
+        this->registers = loaded;
+        this->stack.clear();
+        this->stack.pushN(values.data(), values.size());
+        this->retStack.clear();
+        this->retStack.pushN(addresses.data(), addresses.size());
+        this->windowBank = std::move(bank);
+        this->windowSpill = std::move(spill);
+        if (this->windowDepth > 0) {
+            this->windowIndex = (long long) windowIndex;
+            this->window = this->windowBank.data() + this->windowIndex * NERVI_REGISTER_WINDOW_STEP;
+        }
+    }
+
+    /**
+     * \brief Returns the amount of disc numbers in use
+     * \return The greatest attached disc number plus one (at least 1 for the machine's own storage)
+     */
+    short NVirtualMachineStorage::getDiscCount() {
+        return std::max((short) this->discs.size(), (short) 1);
+    }
 }
 
 
@@ -0,0 +1,212 @@
+/**
+ * \file nmachinepool.h
+ * \brief Contains the definition of the class NVirtualMachinePool
+ * \details Contains the definition of the thread-safe pool of warm virtual machines and the following documentation
+ */
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <kernel/storage/nmachinememory.h>
+
+#ifndef KERNEL_STORAGE_NMACHINEPOOL
+#define KERNEL_STORAGE_NMACHINEPOOL
+
+namespace NerviKernel {
+
+    /**
+     * \brief A class of a thread-safe pool of pre-constructed virtual machines
+     * \details The pool hands out NVirtualMachineStorage instances keyed by the size of their memory and takes them back when a program
+     * has finished. Each machine created by the pool gets a snapshot of its pristine state, and a returned machine is restored to it,
+     * which copies only the registers, the used part of the stacks and the pages the program has written (see NVirtualMachineStorage::restore).
+     * The attached discs are detached on return. The pool collects the hit rate of acquire and the time spent on resets:
+     * \code
+     * NerviKernel::NVirtualMachinePool pool;
+     * pool.prewarm(65536, 16);
+     * auto machine = pool.acquire(65536);
+     * //run a program
+     * pool.release(std::move(machine));
+     * \endcode
+     * \warning All the machines must be released before the pool is destroyed
+     */
+    class NVirtualMachinePool {
+        NVirtualMachinePool(const NVirtualMachinePool& nvmp) = delete;
+        NVirtualMachinePool& operator=(const NVirtualMachinePool& nvmp) = delete;
+    private:
+        long long stackLimit, returnLimit, maxIdlePerSize;
+        std::mutex mutex;
+        std::unordered_map<long long, std::vector<std::unique_ptr<NVirtualMachineStorage>>> idle;
+        std::unordered_map<NVirtualMachineStorage*, NVirtualMachineSnapshot> pristine;
+        std::atomic<long long> hits, misses, resets, resetNanoseconds;
+        std::unique_ptr<NVirtualMachineStorage> create(long long size);
+    public:
+        explicit NVirtualMachinePool(long long maxIdlePerSize = 64, long long stackLimit = NERVI_DEFAULT_STACK_LIMIT, long long returnLimit = NERVI_DEFAULT_RETURN_STACK_LIMIT);
+        std::unique_ptr<NVirtualMachineStorage> acquire(long long size);
+        void release(std::unique_ptr<NVirtualMachineStorage> machine);
+        void prewarm(long long size, long long count);
+        long long getIdleCount();
+        long long getHits();
+        long long getMisses();
+        double getHitRate();
+        long long getResetCount();
+        double getAverageResetNanoseconds();
+    };
+
+    /**
+     * \brief The NVirtualMachinePool constructor
+     * \param maxIdlePerSize The maximal amount of idle machines of the same size kept by the pool, the extra returned machines are destroyed
+     * \param stackLimit The data stack limit of the created machines
+     * \param returnLimit The return stack limit of the created machines
+     */
+    NVirtualMachinePool::NVirtualMachinePool(long long maxIdlePerSize, long long stackLimit, long long returnLimit):
+        hits(0), misses(0), resets(0), resetNanoseconds(0) {
+        this->maxIdlePerSize = maxIdlePerSize;
+        this->stackLimit = stackLimit;
+        this->returnLimit = returnLimit;
+    }
+
+    std::unique_ptr<NVirtualMachineStorage> NVirtualMachinePool::create(long long size) {
+        auto machine = std::make_unique<NVirtualMachineStorage>(size, this->stackLimit, this->returnLimit);
+        NVirtualMachineSnapshot saved = machine->snapshot();
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->pristine.emplace(machine.get(), std::move(saved));
+        return machine;
+    }
+
+    /**
+     * \brief Hands out a machine in its pristine state
+     * \details Takes an idle machine of the required size if there is one (a hit), otherwise constructs a new one (a miss)
+     * \param size The size of the machine's memory in bytes
+     * \return The machine, which must be given back by release
+     */
+    std::unique_ptr<NVirtualMachineStorage> NVirtualMachinePool::acquire(long long size) {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto iterator = this->idle.find(size);
+            if (iterator != this->idle.end() && !iterator->second.empty()) {
+                std::unique_ptr<NVirtualMachineStorage> machine = std::move(iterator->second.back());
+                iterator->second.pop_back();
+                this->hits++;
+                return machine;
+            }
+        }
+        this->misses++;
+        return this->create(size);
+    }
+
+    /**
+     * \brief Takes a machine back to the pool
+     * \details Restores the machine to its pristine state and detaches its discs. The reset happens in the calling thread without holding
+     * the pool's lock. If the pool already keeps enough idle machines of the size, or the machine has not been created by the pool, it is destroyed
+     * \param machine The machine handed out by acquire
+     */
+    void NVirtualMachinePool::release(std::unique_ptr<NVirtualMachineStorage> machine) {
+        if (machine == nullptr) {
+            return;
+        }
+        const NVirtualMachineSnapshot* saved;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto iterator = this->pristine.find(machine.get());
+            if (iterator == this->pristine.end()) {
+                return;
+            }
+            saved = &iterator->second;
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (short disc = 1; disc < machine->getDiscCount(); disc++) {
+            machine->detachDisc(disc);
+        }
+        machine->restore(*saved);
+        this->resetNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        this->resets++;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto& machines = this->idle[machine->getSize()];
+        if ((long long) machines.size() < this->maxIdlePerSize) {
+            machines.push_back(std::move(machine));
+        } else {
+            this->pristine.erase(machine.get());
+        }
+    }
+
+    /**
+     * \brief Constructs idle machines in advance
+     * \details Adds machines of the size until the pool keeps the desired amount of them (but not more than its limit)
+     * \param size The size of the machines' memory in bytes
+     * \param count The desired amount of idle machines
+     */
+    void NVirtualMachinePool::prewarm(long long size, long long count) {
+        count = std::min(count, this->maxIdlePerSize);
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                if ((long long) this->idle[size].size() >= count) {
+                    return;
+                }
+            }
+            std::unique_ptr<NVirtualMachineStorage> machine = this->create(size);
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->idle[size].push_back(std::move(machine));
+        }
+    }
+
+    /**
+     * \brief Returns the amount of idle machines of all sizes
+     * \return The amount of machines ready to be handed out
+     */
+    long long NVirtualMachinePool::getIdleCount() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        long long count = 0;
+        for (auto& entry : this->idle) {
+            count += entry.second.size();
+        }
+        return count;
+    }
+
+    /**
+     * \brief Returns the amount of acquire calls served by idle machines
+     * \return The amount of hits
+     */
+    long long NVirtualMachinePool::getHits() {
+        return this->hits;
+    }
+
+    /**
+     * \brief Returns the amount of acquire calls that have constructed a new machine
+     * \return The amount of misses
+     */
+    long long NVirtualMachinePool::getMisses() {
+        return this->misses;
+    }
+
+    /**
+     * \brief Returns the share of acquire calls served by idle machines
+     * \return The hit rate between 0 and 1, or 0 if nothing has been acquired yet
+     */
+    double NVirtualMachinePool::getHitRate() {
+        long long hits = this->hits, total = hits + this->misses;
+        return total == 0 ? 0.0 : double(hits) / double(total);
+    }
+
+    /**
+     * \brief Returns the amount of machines reset on release
+     * \return The amount of resets
+     */
+    long long NVirtualMachinePool::getResetCount() {
+        return this->resets;
+    }
+
+    /**
+     * \brief Returns the average time of resetting a released machine
+     * \return The average reset time in nanoseconds, or 0 if nothing has been released yet
+     */
+    double NVirtualMachinePool::getAverageResetNanoseconds() {
+        long long resets = this->resets;
+        return resets == 0 ? 0.0 : double(this->resetNanoseconds) / double(resets);
+    }
+}
+
+#endif
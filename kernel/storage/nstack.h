@@ -0,0 +1,343 @@
+/**
+ * \file nstack.h
+ * \brief Contains the definition of the class template NFixedStack
+ * \details Contains the definition of the contiguous fixed-capacity stack used by NVirtualMachineStorage and the statuses of its operations
+ */
+
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <kernel/constant/limits.h>
+#include <kernel/storage/pagedmemory.h>
+#include <kernel/storage/memorycard.h>
+
+#ifndef KERNEL_STORAGE_NSTACK
+#define KERNEL_STORAGE_NSTACK
+
+namespace NerviKernel {
+
+    /**
+     * \brief The statuses of stack operations
+     * \details Stack operations report a status instead of throwing, so a program can handle a stack fault like any other result
+     */
+    enum NStackStatus {
+        STACK_OK, /// The operation has been completed
+        STACK_OVERFLOW, /// The operation has been rejected because the stack would exceed its capacity
+        STACK_UNDERFLOW /// The operation has been rejected because the stack does not contain enough values
+    };
+
+    /**
+     * \brief A class template of a contiguous stack with a fixed capacity
+     * \details The stack stores its values in one array that is reserved during the construction (as a page mapping, so the untouched
+     * part of the array does not occupy memory) and never reallocated. Pushing and popping only move the depth.
+     * The operations never fail silently or with undefined behaviour: a push beyond the capacity or a pop from an insufficient stack
+     * leaves the stack unchanged and reports STACK_OVERFLOW or STACK_UNDERFLOW.
+     * The stack also keeps its high-water mark, i.e. the greatest depth it has reached, to help choosing the capacity,
+     * and its low-water mark since the last save, so restoring the saved values copies only the part of the stack changed after the save.
+     * A stack can also be backed by a region of a memory card instead of the host memory. Then only its top segment
+     * (NERVI_STACK_HOT_BYTES) is kept in a host buffer, which only such stacks allocate, and the older half of the segment is moved to the card when the segment
+     * is full and moved back when it is empty, so the push and the pop still compare the depth with a single bound.
+     * The class objects cannot be copied
+     * \tparam T The type of the values, must be trivially copyable
+     */
+    template<typename T>
+    class NFixedStack {
+        NFixedStack(const NFixedStack& nfs) = delete;
+        NFixedStack& operator=(const NFixedStack& nfs) = delete;
+    private:
+        static constexpr long long HOT_COUNT = std::max(NERVI_STACK_HOT_BYTES / (long long) sizeof(T), 2ll);
+        // values holds the stack from hotBase to hotLimit, i.e. the whole stack unless it is backed by a card,
+        // then it is the top segment, allocated only for such stacks. The fields read by every push and pop go first
+        T* values;
+        long long depth;
+        long long hotLimit;
+        long long hotBase;
+        long long highWater;
+        long long lowWater;
+        long long capacity;
+        NMemoryCard* card;
+        long long cardBase;
+        void spill();
+        void fill();
+        void readValues(long long from, long long count, T* destination);
+    public:
+        explicit NFixedStack(long long capacity, NMemoryCard* card = nullptr, long long base = 0);
+        ~NFixedStack();
+        NStackStatus push(T value);
+        NStackStatus pop(T& value);
+        NStackStatus pushN(const T* source, long long count);
+        NStackStatus popN(T* destination, long long count);
+        long long getDepth();
+        long long getCapacity();
+        bool isCardBacked();
+        void copyTo(T* destination);
+        long long getHighWaterMark();
+        void resetHighWaterMark();
+        void clear();
+        void saveTo(std::vector<T>& saved);
+        void restoreFrom(const std::vector<T>& saved, bool delta);
+    };
+
+    /**
+     * \brief The NFixedStack constructor that reserves the array of the stack
+     * \details Without a card the array is reserved in the host memory at once. With a card the region [base, base + capacity * sizeof(T))
+     * of the card receives the values that do not fit into the top segment, the stack allocates no host memory and the card must outlive it
+     * \param capacity The maximal amount of values in the stack
+     * \param card The card that holds the stack, nullptr (by default) to keep the stack in the host memory
+     * \param base The address of the first cell of the region of the card
+     */
+    template<typename T>
+    NFixedStack<T>::NFixedStack(long long capacity, NMemoryCard* card, long long base) {
+        this->capacity = capacity;
+        this->depth = 0;
+        this->hotBase = 0;
+        this->highWater = 0;
+        this->lowWater = 0;
+        this->card = card;
+        this->cardBase = base;
+        if (card == nullptr) {
+            this->hotLimit = capacity;
+            this->values = reinterpret_cast<T*>(NerviPagedMemory::allocate(capacity * (long long) sizeof(T)));
+        } else {
+            this->hotLimit = std::min(capacity, HOT_COUNT);
+            this->values = new T[HOT_COUNT];
+        }
+    }
+
+    /**
+     * \brief The NFixedStack destructor that releases the array of the stack
+     */
+    template<typename T>
+    NFixedStack<T>::~NFixedStack() {
+        if (this->card == nullptr) {
+            NerviPagedMemory::release(reinterpret_cast<char*>(this->values), this->capacity * (long long) sizeof(T));
+        } else {
+            delete[] this->values;
+        }
+    }
+
+    template<typename T>
+    void NFixedStack<T>::spill() {
+        long long moved = HOT_COUNT / 2;
+        this->card->writeRegion(this->cardBase + this->hotBase * (long long) sizeof(T), reinterpret_cast<const char*>(this->values), moved * sizeof(T));
+        memmove(this->values, this->values + moved, (this->depth - this->hotBase - moved) * sizeof(T));
+        this->hotBase += moved;
+        this->hotLimit = std::min(this->capacity, this->hotBase + HOT_COUNT);
+    }
+
+    template<typename T>
+    void NFixedStack<T>::fill() {
+        // the segment is empty here, so it is refilled from its bottom and keeps room for the pushes
+        long long moved = std::min(HOT_COUNT / 2, this->hotBase);
+        this->hotBase -= moved;
+        this->hotLimit = std::min(this->capacity, this->hotBase + HOT_COUNT);
+        this->card->getValuesAt(this->cardBase + this->hotBase * (long long) sizeof(T), reinterpret_cast<char*>(this->values), moved * sizeof(T));
+    }
+
+    template<typename T>
+    void NFixedStack<T>::readValues(long long from, long long count, T* destination) {
+        long long inCard = std::clamp(this->hotBase - from, 0ll, count);
+        if (inCard > 0) {
+            this->card->getValuesAt(this->cardBase + from * (long long) sizeof(T), reinterpret_cast<char*>(destination), inCard * sizeof(T));
+        }
+        std::copy_n(this->values + (from + inCard - this->hotBase), count - inCard, destination + inCard);
+    }
+
+    /**
+     * \brief Pushes a value to the stack
+     * \param value The value to push
+     * \return STACK_OK or STACK_OVERFLOW if the stack is full
+     */
+    template<typename T>
+    NStackStatus NFixedStack<T>::push(T value) {
+        if (this->depth == this->hotLimit) {
+            if (this->depth == this->capacity) {
+                return STACK_OVERFLOW;
+            }
+            this->spill();
+        }
+        this->values[this->depth++ - this->hotBase] = value;
+        if (this->depth > this->highWater) {
+            this->highWater = this->depth;
+        }
+        return STACK_OK;
+    }
+
+    /**
+     * \brief Pops the top value of the stack
+     * \param value The variable that receives the popped value. It is not changed if the stack is empty
+     * \return STACK_OK or STACK_UNDERFLOW if the stack is empty
+     */
+    template<typename T>
+    NStackStatus NFixedStack<T>::pop(T& value) {
+        if (this->depth == this->hotBase) {
+            if (this->depth == 0) {
+                return STACK_UNDERFLOW;
+            }
+            this->fill();
+        }
+        value = this->values[--this->depth - this->hotBase];
+        if (this->depth < this->lowWater) {
+            this->lowWater = this->depth;
+        }
+        return STACK_OK;
+    }
+
+    /**
+     * \brief Pushes several values to the stack at once
+     * \details The values are pushed in their order, so the last one becomes the top. Either all values are pushed or none of them
+     * \param source The values to push
+     * \param count The amount of values to push
+     * \return STACK_OK or STACK_OVERFLOW if the values do not fit into the stack
+     */
+    template<typename T>
+    NStackStatus NFixedStack<T>::pushN(const T* source, long long count) {
+        if (count < 0 || count > this->capacity - this->depth) {
+            return STACK_OVERFLOW;
+        }
+        if (count > this->hotLimit - this->depth) {
+            // the values go to the card past the segment, which is moved there as well and becomes empty
+            long long kept = this->depth - this->hotBase;
+            this->card->writeRegion(this->cardBase + this->hotBase * (long long) sizeof(T), reinterpret_cast<const char*>(this->values), kept * sizeof(T));
+            this->card->writeRegion(this->cardBase + this->depth * (long long) sizeof(T), reinterpret_cast<const char*>(source), count * sizeof(T));
+            this->depth += count;
+            this->hotBase = this->depth;
+            this->hotLimit = std::min(this->capacity, this->hotBase + HOT_COUNT);
+        } else {
+            std::copy_n(source, count, this->values + (this->depth - this->hotBase));
+            this->depth += count;
+        }
+        if (this->depth > this->highWater) {
+            this->highWater = this->depth;
+        }
+        return STACK_OK;
+    }
+
+    /**
+     * \brief Pops several values from the stack at once
+     * \details The values are copied in the order they have been pushed in (the former top becomes the last one), which makes popN the
+     * exact inverse of pushN. Either all values are popped or none of them
+     * \param destination The array that receives the popped values
+     * \param count The amount of values to pop
+     * \return STACK_OK or STACK_UNDERFLOW if the stack contains less values than required
+     */
+    template<typename T>
+    NStackStatus NFixedStack<T>::popN(T* destination, long long count) {
+        if (count < 0 || count > this->depth) {
+            return STACK_UNDERFLOW;
+        }
+        this->readValues(this->depth - count, count, destination);
+        this->depth -= count;
+        if (this->depth < this->hotBase) {
+            this->hotBase = this->depth;
+            this->hotLimit = std::min(this->capacity, this->hotBase + HOT_COUNT);
+        }
+        if (this->depth < this->lowWater) {
+            this->lowWater = this->depth;
+        }
+        return STACK_OK;
+    }
+
+    /**
+     * \brief Returns the amount of values in the stack
+     * \return The depth of the stack
+     */
+    template<typename T>
+    long long NFixedStack<T>::getDepth() {
+        return this->depth;
+    }
+
+    /**
+     * \brief Returns the maximal amount of values in the stack
+     * \return The capacity of the stack
+     */
+    template<typename T>
+    long long NFixedStack<T>::getCapacity() {
+        return this->capacity;
+    }
+
+    /**
+     * \brief Returns whether the stack is backed by a memory card
+     * \return True if the stack has been created in a region of a card, false if it is in the host memory
+     */
+    template<typename T>
+    bool NFixedStack<T>::isCardBacked() {
+        return this->card != nullptr;
+    }
+
+    /**
+     * \brief Copies the values of the stack without changing it
+     * \param destination The array that receives getDepth values from the bottom to the top
+     */
+    template<typename T>
+    void NFixedStack<T>::copyTo(T* destination) {
+        this->readValues(0, this->depth, destination);
+    }
+
+    /**
+     * \brief Returns the high-water mark of the stack
+     * \return The greatest depth the stack has reached since its construction or the last resetHighWaterMark
+     */
+    template<typename T>
+    long long NFixedStack<T>::getHighWaterMark() {
+        return this->highWater;
+    }
+
+    /**
+     * \brief Resets the high-water mark of the stack to its current depth
+     */
+    template<typename T>
+    void NFixedStack<T>::resetHighWaterMark() {
+        this->highWater = this->depth;
+    }
+
+    /**
+     * \brief Removes all values from the stack
+     */
+    template<typename T>
+    void NFixedStack<T>::clear() {
+        this->depth = 0;
+        this->lowWater = 0;
+        if (this->card != nullptr) {
+            this->hotBase = 0;
+            this->hotLimit = std::min(this->capacity, HOT_COUNT);
+        }
+    }
+
+    /**
+     * \brief Saves the values of the stack
+     * \details Copies the values from the bottom to the top and starts tracking the low-water mark from the current depth
+     * \param saved The vector that receives the values
+     */
+    template<typename T>
+    void NFixedStack<T>::saveTo(std::vector<T>& saved) {
+        saved.resize(this->depth);
+        this->readValues(0, this->depth, saved.data());
+        this->lowWater = this->depth;
+    }
+
+    /**
+     * \brief Restores the values saved by saveTo
+     * \details In the delta mode only the values above the low-water mark are copied, because the values below it have not been popped
+     * (hence have not been changed) since the save. The delta mode is valid only for the last save of this stack.
+     * A stack backed by a card always writes all the values to the card, because its region can be restored by the card's own snapshot
+     * \param saved The saved values
+     * \param delta Whether to copy only the values changed since the last save
+     */
+    template<typename T>
+    void NFixedStack<T>::restoreFrom(const std::vector<T>& saved, bool delta) {
+        if (this->card != nullptr) {
+            this->card->writeRegion(this->cardBase, reinterpret_cast<const char*>(saved.data()), saved.size() * sizeof(T));
+            this->depth = saved.size();
+            this->hotBase = this->depth;
+            this->hotLimit = std::min(this->capacity, this->hotBase + HOT_COUNT);
+        } else {
+            long long from = delta ? std::min(this->lowWater, (long long) saved.size()) : 0;
+            std::copy(saved.begin() + from, saved.end(), this->values + from);
+            this->depth = saved.size();
+        }
+        this->lowWater = this->depth;
+    }
+}
+
+#endif
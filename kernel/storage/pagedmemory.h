@@ -0,0 +1,117 @@
+/**
+ * \file pagedmemory.h
+ * \brief Contains the page-granular allocation helpers used by memory devices
+ * \details Memory cards are backed by anonymous page mappings on POSIX systems, so their storage is zero-filled by the OS
+ * on demand and can be grown or shrunk in place. On other platforms the helpers fall back to the free store and copying
+ */
+
+#include <new>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define NERVI_PAGED_MEMORY_MMAP
+#endif
+
+#ifndef KERNEL_STORAGE_NPAGEDMEM
+#define KERNEL_STORAGE_NPAGEDMEM
+
+namespace NerviKernel {
+    namespace NerviPagedMemory {
+
+        /**
+         * \brief Returns the size of a host memory page
+         * \return The page size in bytes
+         */
+        long long pageSize() {
+#ifdef NERVI_PAGED_MEMORY_MMAP
+            static const long long size = sysconf(_SC_PAGESIZE);
+            return size;
+#else
+            return 4096;
+#endif
+        }
+
+        /**
+         * \brief Rounds an amount of bytes up to whole pages
+         * \details The result is never zero so that even an empty memory device owns a valid mapping
+         * \param bytes The amount of bytes to round
+         * \return The amount of bytes occupied by whole pages
+         */
+        long long roundToPages(long long bytes) {
+            long long page = pageSize();
+            return std::max((bytes + page - 1) / page * page, page);
+        }
+
+        /**
+         * \brief Allocates a zero-filled memory block
+         * \details On POSIX systems the block is an anonymous private mapping whose pages are committed on the first touch
+         * \param bytes The size of the block in bytes
+         * \return The pointer to the beginning of the block
+         * \throw std::bad_alloc If the block cannot be allocated
+         */
+        char* allocate(long long bytes) {
+#ifdef NERVI_PAGED_MEMORY_MMAP
+            void* memory = mmap(nullptr, roundToPages(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            return static_cast<char*>(memory);
+#else
+            char* memory = new char[roundToPages(bytes)];
+            memset(memory, 0, roundToPages(bytes));
+            return memory;
+#endif
+        }
+
+        /**
+         * \brief Releases a memory block allocated by allocate or reallocate
+         * \param memory The block to release
+         * \param bytes The size of the block in bytes
+         */
+        void release(char* memory, long long bytes) {
+#ifdef NERVI_PAGED_MEMORY_MMAP
+            munmap(memory, roundToPages(bytes));
+#else
+            delete[] memory;
+#endif
+        }
+
+        /**
+         * \brief Changes the size of a memory block allocated by allocate
+         * \details On Linux the block is remapped with mremap, so growing never copies the contents and shrinking returns the tail
+         * pages to the OS. Other platforms allocate a new block and copy the preserved part. The bytes beyond the preserved part are zero
+         * \param memory The block to resize
+         * \param oldBytes The current size of the block in bytes
+         * \param newBytes The desired size of the block in bytes
+         * \return The pointer to the beginning of the resized block, which can differ from the passed one
+         * \throw std::bad_alloc If the block cannot be resized. The passed block stays valid in this case
+         */
+        char* reallocate(char* memory, long long oldBytes, long long newBytes) {
+            long long oldLength = roundToPages(oldBytes), newLength = roundToPages(newBytes);
+            if (newBytes < oldBytes) {
+                // the tail of the last kept page is not released, so it has to be zeroed for a later growth
+                memset(memory + newBytes, 0, std::min(oldBytes, newLength) - newBytes);
+            }
+            if (oldLength == newLength) {
+                return memory;
+            }
+#if defined(NERVI_PAGED_MEMORY_MMAP) && defined(__linux__)
+            void* remapped = mremap(memory, oldLength, newLength, MREMAP_MAYMOVE);
+            if (remapped == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            return static_cast<char*>(remapped);
+#else
+            char* remapped = allocate(newBytes);
+            memcpy(remapped, memory, std::min(oldBytes, newBytes));
+            release(memory, oldBytes);
+            return remapped;
+#endif
+        }
+    }
+}
+
+#endif
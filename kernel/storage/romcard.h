@@ -0,0 +1,43 @@
+/**
+ * \file romcard.h
+ * \brief Contains the definition of the class NRomCard
+ * \details Contains the definition of the read-only memory card that is shared by virtual machines
+ */
+
+#include <memory>
+#include <kernel/storage/memorycard.h>
+
+#ifndef KERNEL_STORAGE_NROMC
+#define KERNEL_STORAGE_NROMC
+
+namespace NerviKernel {
+
+    /**
+     * \brief A class of a read-only memory card (ROM) for constant data shared by virtual machines
+     * \details The card copies its contents once during the construction and write-protects its pages.
+     * A ROM card never changes after that, so a single object can be attached to any number of NVirtualMachineStorage instances
+     * at once (they hold it by std::shared_ptr), and the constant data occupies memory once regardless of the amount of machines:
+     * \code
+     * auto rom = std::make_shared<NerviKernel::NRomCard>(table, tableSize);
+     * machine1.attachDisc(1, rom);
+     * machine2.attachDisc(1, rom);
+     * \endcode
+     * All the writing methods throw ReadOnlyMemoryException after a single flag check, the card keeps no cell locks.
+     * The card is created in the GUARDED mode, so the unchecked accessors can be used with it inside guarded
+     */
+    class NRomCard final: public NMemoryCard {
+    public:
+        NRomCard(const char* contents, long long size);
+    };
+
+    /**
+     * \brief The NRomCard constructor that creates a read-only card with desired contents
+     * \param contents The values of the cells of the card
+     * \param size The amount of the values, i.e. the size of the card
+     */
+    NRomCard::NRomCard(const char* contents, long long size): NMemoryCard(size, GUARDED) {
+        this->makeReadOnly(contents);
+    }
+}
+
+#endif